@@ -0,0 +1,50 @@
+#!/usr/bin/env python
+import socket
+import struct
+import sys
+
+
+BMUQUERY_MAGIC = 0x51554d42
+BMUREPLY_MAGIC = 0x52554d42
+BMUQUERY_SECOND = 0x1
+
+
+def read_full(sock, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise IOError("connection closed")
+        buf += chunk
+    return buf
+
+
+def query(sock, vecs, second=False):
+    ndimen = len(vecs[0])
+    flags = BMUQUERY_SECOND if second else 0
+    msg = struct.pack('4I', BMUQUERY_MAGIC, flags, len(vecs), ndimen)
+    for v in vecs:
+        msg += struct.pack('%df' % ndimen, *v)
+    sock.sendall(msg)
+
+    magic, status, nvecs, flags = struct.unpack('4I', read_full(sock, 16))
+    if magic != BMUREPLY_MAGIC or status != 0:
+        raise IOError("bad query")
+    fmt = '2If2If' if flags & BMUQUERY_SECOND else '2If'
+    size = struct.calcsize(fmt)
+    return [struct.unpack(fmt, read_full(sock, size)) for i in range(nvecs)]
+
+
+if __name__ == '__main__':
+
+    if len(sys.argv) != 3:
+        print("python bmuclient.py socket txt_infile")
+        print("Usage: ./bmuclient.py /tmp/mrsom.sock rgbs.txt")
+        sys.exit(1)
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(sys.argv[1])
+    vecs = [[float(x) for x in line.split()] for line in open(sys.argv[2]) if line.strip()]
+    for r in query(sock, vecs, True):
+        print("%d %d %g %d %d %g" % r)
+    sock.close()
@@ -0,0 +1,211 @@
+//### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ##
+//#
+//#   See COPYING file distributed along with the MGTAXA package for the
+//#   copyright and license terms.
+//#
+//### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ##
+
+#ifndef BLOCKBIN_HPP
+#define BLOCKBIN_HPP
+
+///
+/// Block-compressed bin format (*.zbin)
+///
+///   header | block index (nblocks entries) | compressed blocks
+///
+/// Rows are grouped into blocks of a fixed number of rows and every block is
+/// compressed on its own, so any block can be decompressed without touching
+/// the others. For dense input a row is NDIMEN floats. For sparse input a row
+/// is the list of its (index, value) items; the *.idx and *.num files of the
+/// sparse format are not changed.
+///
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/// Codec
+#include <zlib.h>
+
+#define ZBIN_MAGIC      0x4e49425a          /// "ZBIN"
+#define ZBIN_VERSION    1
+
+enum ZBINCODEC  { ZBIN_ZLIB = 1 };          /// block codecs
+
+typedef struct zbinheader {
+    uint32_t magic;             /// ZBIN_MAGIC
+    uint32_t version;           /// ZBIN_VERSION
+    uint32_t codec;             /// ZBINCODEC
+    uint32_t sparse;            /// 0 = dense floats, 1 = sparse items
+    uint32_t ndimen;            /// num of dimensionality
+    uint32_t nvecs;             /// total num of rows
+    uint32_t rowsperblock;      /// num of rows in each block (except the last)
+    uint32_t nblocks;           /// num of blocks
+} ZBIN_HEADER_T;
+
+typedef struct zbinblock {
+    uint64_t offset;            /// file offset of the compressed block
+    uint32_t csize;             /// compressed size of the block
+    uint32_t usize;             /// uncompressed size of the block
+} ZBIN_BLOCK_T;
+
+/// Writer state used by the converters
+typedef struct zbinwriter {
+    FILE* fp;
+    ZBIN_HEADER_T header;
+    std::vector<ZBIN_BLOCK_T> index;
+    std::vector<char> rows;     /// uncompressed rows of the current block
+    std::vector<char> cbuf;     /// compressed block
+    uint32_t nrows;             /// num of rows in the current block
+    uint64_t offset;            /// file offset of the next block
+} ZBIN_WRITER_T;
+
+
+/** Check if the memory holds a zbin file
+ * @param data - start of the file
+ * @param size - file size
+ */
+
+inline int zbin_check(const char* data,
+                      size_t size)
+{
+    if (size < sizeof(ZBIN_HEADER_T))
+        return 0;
+    const ZBIN_HEADER_T* h = reinterpret_cast<const ZBIN_HEADER_T*>(data);
+    return h->magic == ZBIN_MAGIC && h->version == ZBIN_VERSION;
+}
+
+/** Decompress one block
+ * @param data - start of the zbin file
+ * @param blk - block index entry
+ * @param dst - destination, at least blk->usize bytes
+ */
+
+inline int zbin_decompress(const char* data,
+                           const ZBIN_BLOCK_T* blk,
+                           char* dst)
+{
+    if (blk->usize == 0)
+        return 0;
+    uLongf len = blk->usize;
+    int ret = uncompress((Bytef*)dst, &len, (const Bytef*)(data + blk->offset),
+                         blk->csize);
+    if (ret != Z_OK || len != blk->usize)
+        return 1;
+    return 0;
+}
+
+/** Flush the rows of the current block to file
+ * @param w - writer
+ */
+
+inline int zbin_flush_block(ZBIN_WRITER_T* w)
+{
+    uLongf len = compressBound(w->rows.size());
+    if (w->cbuf.size() < len)
+        w->cbuf.resize(len);
+    if (compress2((Bytef*)w->cbuf.data(), &len, (const Bytef*)w->rows.data(),
+                  w->rows.size(), Z_BEST_SPEED) != Z_OK)
+        return 1;
+
+    ZBIN_BLOCK_T blk;
+    blk.offset = w->offset;
+    blk.csize = len;
+    blk.usize = w->rows.size();
+    if (fwrite(w->cbuf.data(), 1, len, w->fp) != len)
+        return 1;
+    w->index.push_back(blk);
+    w->offset += len;
+    w->rows.clear();
+    w->nrows = 0;
+    return 0;
+}
+
+/** Open zbin file for writing
+ * @param w - writer
+ * @param fname - output file name
+ * @param sparse - 0 = dense, 1 = sparse
+ * @param ndimen - num of dimensionality
+ * @param nvecs - num of rows
+ * @param rowsperblock - num of rows in a block
+ */
+
+inline int zbin_open(ZBIN_WRITER_T* w,
+                     const char* fname,
+                     uint32_t sparse,
+                     uint32_t ndimen,
+                     uint32_t nvecs,
+                     uint32_t rowsperblock)
+{
+    if (rowsperblock == 0)
+        return 1;
+    w->fp = fopen(fname, "wb");
+    if (!w->fp)
+        return 1;
+    w->header.magic = ZBIN_MAGIC;
+    w->header.version = ZBIN_VERSION;
+    w->header.codec = ZBIN_ZLIB;
+    w->header.sparse = sparse;
+    w->header.ndimen = ndimen;
+    w->header.nvecs = nvecs;
+    w->header.rowsperblock = rowsperblock;
+    w->header.nblocks = (nvecs + rowsperblock - 1) / rowsperblock;
+    w->nrows = 0;
+    w->index.clear();
+    w->rows.clear();
+
+    ///
+    /// Leave room for the header and the index, which are written when
+    /// the file is closed
+    ///
+    w->offset = sizeof(ZBIN_HEADER_T) + w->header.nblocks * sizeof(ZBIN_BLOCK_T);
+    if (fseek(w->fp, w->offset, SEEK_SET)) {
+        fclose(w->fp);
+        w->fp = NULL;
+        remove(fname);
+        return 1;
+    }
+    return 0;
+}
+
+/** Add one row
+ * @param w - writer
+ * @param row - row data (floats or sparse items)
+ * @param nbytes - size of the row
+ */
+
+inline int zbin_add_row(ZBIN_WRITER_T* w,
+                        const void* row,
+                        size_t nbytes)
+{
+    const char* p = static_cast<const char*>(row);
+    w->rows.insert(w->rows.end(), p, p + nbytes);
+    w->nrows++;
+    if (w->nrows == w->header.rowsperblock)
+        return zbin_flush_block(w);
+    return 0;
+}
+
+/** Write the last block, header and index and close the file
+ * @param w - writer
+ */
+
+inline int zbin_close(ZBIN_WRITER_T* w)
+{
+    int ret = 0;
+    if (w->nrows)
+        ret = zbin_flush_block(w);
+    if (w->index.size() != w->header.nblocks)
+        ret = 1;
+    if (!ret) {
+        fseek(w->fp, 0, SEEK_SET);
+        fwrite(&w->header, sizeof(ZBIN_HEADER_T), 1, w->fp);
+        fwrite(w->index.data(), sizeof(ZBIN_BLOCK_T), w->index.size(), w->fp);
+    }
+    fclose(w->fp);
+    return ret;
+}
+
+
+#endif
@@ -0,0 +1,202 @@
+//### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ##
+//#
+//#   See COPYING file distributed along with the MGTAXA package for the
+//#   copyright and license terms.
+//#
+//### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ### ##
+
+#ifndef CHUNKREADER_HPP
+#define CHUNKREADER_HPP
+
+///
+/// Streaming reader for out-of-core input
+///
+/// A reader thread reads a list of chunks (byte ranges of the input file) in
+/// order into a ring of depth buffers, while the caller consumes the chunks
+/// in the same order. With depth >= 2 chunk k+1 is loading while chunk k is
+/// processed. Read chunks are dropped from the page cache.
+///
+
+#include "mpi.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+
+typedef struct chunk {
+    uint64_t offset;            /// file offset
+    uint64_t nbytes;            /// num of bytes to read
+    uint32_t itask;             /// work item the chunk belongs to
+    uint32_t rowStart;          /// first row in the chunk
+    uint32_t nrows;             /// num of rows in the chunk
+    char* data;                 /// buffer holding the chunk, set by the reader
+} CHUNK_T;
+
+typedef struct chunkreader {
+    int fd;                     /// input file
+    size_t depth;               /// num of buffers = read-ahead depth
+    size_t bufsize;             /// size of each buffer
+    std::vector<char*> buffers;
+    std::vector<CHUNK_T> plan;  /// chunks to read, in order
+    size_t nread;               /// num of chunks read
+    size_t nconsumed;           /// num of chunks released by the consumer
+    int error;                  /// 1 if a read failed
+    int stop;                   /// 1 to stop the reader early
+    double stalltime;           /// time the consumer waited for data
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CHUNKREADER_T;
+
+
+/** Reader thread: fill the buffers in plan order
+ * @param ptr - chunk reader
+ */
+
+inline void* chunkreader_thread(void* ptr)
+{
+    CHUNKREADER_T* r = static_cast<CHUNKREADER_T*>(ptr);
+    for (size_t i = 0; i < r->plan.size(); i++) {
+        pthread_mutex_lock(&r->lock);
+        while (i >= r->nconsumed + r->depth && !r->stop)
+            pthread_cond_wait(&r->cond, &r->lock);
+        int stop = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        if (stop)
+            break;
+
+        CHUNK_T* c = &r->plan[i];
+        c->data = r->buffers[i % r->depth];
+        uint64_t done = 0;
+        while (done < c->nbytes) {
+            ssize_t n = pread(r->fd, c->data + done, c->nbytes - done, c->offset + done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        posix_fadvise(r->fd, c->offset, c->nbytes, POSIX_FADV_DONTNEED);
+
+        pthread_mutex_lock(&r->lock);
+        if (done != c->nbytes)
+            r->error = 1;
+        r->nread++;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        if (r->error)
+            break;
+    }
+    return NULL;
+}
+
+/** Set up the reader
+ * @param r - chunk reader
+ * @param fd - input file
+ * @param depth - num of buffers
+ * @param bufsize - size of each buffer
+ */
+
+inline void chunkreader_init(CHUNKREADER_T* r,
+                             int fd,
+                             size_t depth,
+                             size_t bufsize)
+{
+    r->fd = fd;
+    r->depth = depth < 1 ? 1 : depth;
+    r->bufsize = bufsize;
+    r->buffers.assign(r->depth, (char*)NULL);
+    r->plan.clear();
+    r->nread = r->nconsumed = 0;
+    r->error = 0;
+    r->stop = 0;
+    r->stalltime = 0.0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/** Start reading the plan from its first chunk. The buffers are allocated
+ * on the first call, large enough for the largest chunk.
+ * @param r - chunk reader
+ */
+
+inline int chunkreader_start(CHUNKREADER_T* r)
+{
+    for (size_t i = 0; i < r->plan.size(); i++)
+        if (r->plan[i].nbytes > r->bufsize)
+            r->bufsize = r->plan[i].nbytes;
+    if (r->bufsize == 0)
+        r->bufsize = 1;
+    for (size_t i = 0; i < r->depth; i++) {
+        if (!r->buffers[i]) {
+            r->buffers[i] = static_cast<char*>(malloc(r->bufsize));
+            if (!r->buffers[i])
+                return 1;
+        }
+    }
+    r->nread = r->nconsumed = 0;
+    r->error = 0;
+    r->stop = 0;
+    return pthread_create(&r->thread, NULL, chunkreader_thread, r);
+}
+
+/** Wait for the next chunk, NULL on read error
+ * @param r - chunk reader
+ */
+
+inline const CHUNK_T* chunkreader_next(CHUNKREADER_T* r)
+{
+    pthread_mutex_lock(&r->lock);
+    if (r->nread <= r->nconsumed && !r->error) {
+        double t = MPI_Wtime();
+        while (r->nread <= r->nconsumed && !r->error)
+            pthread_cond_wait(&r->cond, &r->lock);
+        r->stalltime += MPI_Wtime() - t;
+    }
+    const CHUNK_T* c = (r->nread > r->nconsumed) ? &r->plan[r->nconsumed] : NULL;
+    pthread_mutex_unlock(&r->lock);
+    return c;
+}
+
+/** Give the buffer of the current chunk back to the reader
+ * @param r - chunk reader
+ */
+
+inline void chunkreader_release(CHUNKREADER_T* r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->nconsumed++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/** Stop the reader thread and wait for it
+ * @param r - chunk reader
+ */
+
+inline void chunkreader_join(CHUNKREADER_T* r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+}
+
+/** Free buffers and close the file
+ * @param r - chunk reader
+ */
+
+inline void chunkreader_close(CHUNKREADER_T* r)
+{
+    for (size_t i = 0; i < r->buffers.size(); i++)
+        free(r->buffers[i]);
+    r->buffers.clear();
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    close(r->fd);
+}
+
+
+#endif
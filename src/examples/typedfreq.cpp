@@ -0,0 +1,194 @@
+/* ----------------------------------------------------------------------
+   MR-MPI = MapReduce-MPI library
+   http://www.cs.sandia.gov/~sjplimp/mapreduce.html
+   Steve Plimpton, sjplimp@sandia.gov, Sandia National Laboratories
+
+   Copyright (2009) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the modified Berkeley Software Distribution (BSD) License.
+
+   See the README file in the top-level MapReduce directory.
+------------------------------------------------------------------------- */
+
+// TypedMapReduce example: frequency of integer keys
+// Syntax: typedfreq [ntask npertask nkey]
+// each task emits npertask keys in 0..nkey-1, counts are folded by a
+//   combiner, aggregated, converted and reduced to one count per key,
+//   then mapped into a second TypedMapReduce and collated again
+// every step is checked against counts computed serially on each proc,
+//   exit status is 1 if any check fails
+
+#include "mpi.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include <vector>
+#include "typedmapreduce.h"
+
+using namespace MAPREDUCE_NS;
+
+typedef TypedMapReduce<uint64_t,uint64_t> CountMR;
+typedef TypedMapReduce<uint32_t,double> FreqMR;
+
+/* ----------------------------------------------------------------------
+   key of pair i of task itask, skewed so low keys are frequent
+------------------------------------------------------------------------- */
+
+static uint64_t task_key(int itask, int i, int nkey)
+{
+    uint64_t u = (uint64_t) itask * 2654435761u + (uint64_t) i * 40503u;
+    u ^= u >> 13;
+    return (u % nkey) * (u % 3) / 2;
+}
+
+// emit (key,1) for every pair of one task
+
+struct Emit {
+    int nper, nkey;
+    void operator()(int itask, CountMR::Writer &out) const {
+        uint64_t one = 1;
+        for (int i = 0; i < nper; i++) out.add(task_key(itask, i, nkey), one);
+    }
+};
+
+// combiner and reducer both sum counts of a key
+
+struct Add {
+    void operator()(const uint64_t &, uint64_t &value,
+                    const uint64_t &value2) const {
+        value += value2;
+    }
+};
+
+struct Sum {
+    void operator()(const uint64_t &key, const CountMR::Values &values,
+                    CountMR::Writer &out) const {
+        uint64_t total = 0;
+        int n;
+        for (int iblock = 0; iblock < values.nblock(); iblock++) {
+            const uint64_t *v = values.block(iblock, n);
+            for (int i = 0; i < n; i++) total += v[i];
+        }
+        out.add(key, total);
+    }
+};
+
+// proc of a key, state is held by the function object
+
+struct Owner {
+    int nprocs, shift;
+    int operator()(const uint64_t &key) const {
+        return (int) ((key >> shift) % nprocs);
+    }
+    int operator()(const uint32_t &key) const {
+        return (int) ((key >> shift) % nprocs);
+    }
+};
+
+// check each reduced count, store its frequency keyed by 32-bit key
+
+struct Check {
+    const std::vector<uint64_t> *expect;
+    Owner owner;
+    int me;
+    double ntotal;
+    int *nerror;
+    void operator()(const uint64_t &key, const uint64_t &count,
+                    FreqMR::Writer &out) const {
+        if (owner(key) != me || (*expect)[key] != count) (*nerror)++;
+        out.add((uint32_t) key, count / ntotal);
+    }
+};
+
+// check that all frequencies of a key were collated into 1 KMV pair
+
+struct Collated {
+    const std::vector<uint64_t> *expect;
+    Owner owner;
+    int me;
+    double ntotal;
+    int *nerror;
+    void operator()(const uint32_t &key, const FreqMR::Values &values,
+                    FreqMR::Writer &) const {
+        int n;
+        const double *freq = values.block(0, n);
+        if (owner(key) != me || values.size() != 1 ||
+            freq[0] != (*expect)[key] / ntotal) (*nerror)++;
+    }
+};
+
+/* ---------------------------------------------------------------------- */
+
+int main(int narg, char **args)
+{
+    MPI_Init(&narg, &args);
+
+    int me, nprocs;
+    MPI_Comm_rank(MPI_COMM_WORLD, &me);
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+
+    if (narg != 1 && narg != 4) {
+        if (me == 0) printf("Syntax: typedfreq [ntask npertask nkey]\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    Emit emit = {1000, 5000};
+    int ntask = 4 * nprocs;
+    if (narg == 4) {
+        ntask = atoi(args[1]);
+        emit.nper = atoi(args[2]);
+        emit.nkey = atoi(args[3]);
+    }
+
+    // counts every proc expects, computed serially
+
+    std::vector<uint64_t> expect(emit.nkey, 0);
+    for (int itask = 0; itask < ntask; itask++)
+        for (int i = 0; i < emit.nper; i++)
+            expect[task_key(itask, i, emit.nkey)]++;
+    uint64_t nunique = 0;
+    for (int ikey = 0; ikey < emit.nkey; ikey++)
+        if (expect[ikey]) nunique++;
+    double ntotal = (double) ntask * emit.nper;
+
+    int nerror = 0;
+    Owner owner = {nprocs, 0};
+    Owner owner2 = {nprocs, 2};
+
+    // map with combiner, aggregate, convert, reduce
+
+    CountMR *counts = new CountMR(MPI_COMM_WORLD);
+    counts->mr->verbosity = 0;
+    counts->set_combiner(Add());
+
+    counts->map(ntask, emit);
+    counts->aggregate(owner);
+    counts->mr->convert();
+    uint64_t ncount = counts->reduce(Sum());
+    if (ncount != nunique) nerror++;
+
+    // map from MR: check counts, convert to frequencies, collate by owner2
+
+    FreqMR *freqs = new FreqMR(MPI_COMM_WORLD);
+    freqs->mr->verbosity = 0;
+
+    Check check = {&expect, owner, me, ntotal, &nerror};
+    freqs->map(*counts, check);
+    uint64_t nfreq = freqs->collate(owner2);
+    if (nfreq != nunique) nerror++;
+
+    Collated collated = {&expect, owner2, me, ntotal, &nerror};
+    freqs->reduce(collated);
+
+    int nerrorall;
+    MPI_Allreduce(&nerror, &nerrorall, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (me == 0)
+        printf("%lu pairs, %lu unique keys, %d errors\n",
+               (unsigned long) ntotal, (unsigned long) nunique, nerrorall);
+
+    delete freqs;
+    delete counts;
+    MPI_Finalize();
+    return nerrorall ? 1 : 0;
+}
@@ -0,0 +1,720 @@
+/* ----------------------------------------------------------------------
+   MR-MPI = MapReduce-MPI library
+   http://www.cs.sandia.gov/~sjplimp/mapreduce.html
+   Steve Plimpton, sjplimp@sandia.gov, Sandia National Laboratories
+
+   Copyright (2009) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the modified Berkeley Software Distribution (BSD) License.
+
+   See the README file in the top-level MapReduce directory.
+------------------------------------------------------------------------- */
+
+// asynchronous file I/O for KV, KMV, and Spool pages
+// a write copies the page into a staging buffer and returns,
+//   an I/O thread writes the buffer to disk while the caller fills the page
+// a prefetch reads the next page into a staging buffer,
+//   the following read() of that page is a copy from the buffer
+// each open file gets up to nbuf staging buffers of its own,
+//   so a file being written never waits for another file's prefetches
+// all requests use pread/pwrite with explicit offsets on the file's fd
+// write_page() and read_page() add optional compression of each page,
+//   with a fast LZ codec or with zlib
+
+#include "mpi.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "zlib.h"
+#include "asyncio.h"
+#include "mapreduce.h"
+#include "memory.h"
+#include "error.h"
+
+using namespace MAPREDUCE_NS;
+
+#define ALIGNFILE 512              // same as in mapreduce.cpp
+
+enum {FREE, WRITING, READING, READY};
+enum {ZIPLZ = 1, ZIPZLIB};             // codec stored at start of zipped page
+
+#define LZHASHLOG 12                   // 4096 hash entries for LZ matches
+#define LZMINMATCH 4
+#define LZMAXOFFSET 65535
+
+/* ---------------------------------------------------------------------- */
+
+AsyncIO::AsyncIO(uint64_t bufsize_caller, int nbuf_caller, MapReduce *mr_caller,
+		 Memory *memory_caller, Error *error_caller)
+{
+  mr = mr_caller;
+  memory = memory_caller;
+  error = error_caller;
+
+  bufsize = bufsize_caller;
+  nbuf = nbuf_caller;
+  if (nbuf < 0) nbuf = 0;
+
+  bufs = NULL;
+  npool = maxpool = 0;
+  qhead = qtail = NULL;
+  errflag = stopflag = started = 0;
+  zbuf = NULL;
+  lzhash = NULL;
+  deflateflag = inflateflag = 0;
+
+  pthread_mutex_init(&lock,NULL);
+  pthread_cond_init(&cond,NULL);
+}
+
+/* ---------------------------------------------------------------------- */
+
+AsyncIO::~AsyncIO()
+{
+  if (started) {
+    pthread_mutex_lock(&lock);
+    stopflag = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread,NULL);
+  }
+
+  for (int i = 0; i < npool; i++) {
+    memory->sfree(bufs[i]->ptr);
+    delete bufs[i];
+  }
+  memory->sfree(bufs);
+  memory->sfree(zbuf);
+  memory->sfree(lzhash);
+  if (deflateflag) deflateEnd(&zdeflate);
+  if (inflateflag) inflateEnd(&zinflate);
+
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&cond);
+}
+
+/* ----------------------------------------------------------------------
+   write N bytes of buf to file at offset
+   returns once buf is copied to a staging buffer
+------------------------------------------------------------------------- */
+
+void AsyncIO::write(FILE *fp, uint64_t offset, char *buf, uint64_t n)
+{
+  int fd = fileno(fp);
+  double stall = 0.0;
+
+  if (nbuf == 0 || n > bufsize) {
+    pthread_mutex_lock(&lock);
+    invalidate(fd,offset,n);
+    while (busy(fd)) wait(stall);
+    pthread_mutex_unlock(&lock);
+
+    double time = MPI_Wtime();
+    if (pwrite(fd,buf,n,offset) != (ssize_t) n)
+      error->one("Failed to write MR-MPI page to file");
+    mr->iostall += stall + MPI_Wtime() - time;
+    return;
+  }
+
+  if (!started) start();
+
+  pthread_mutex_lock(&lock);
+  invalidate(fd,offset,n);
+  Buffer *b = acquire(fd,1);
+  while (b == NULL) {
+    wait(stall);
+    b = acquire(fd,1);
+  }
+  b->state = WRITING;
+  b->stale = 0;
+  b->fd = fd;
+  b->offset = offset;
+  b->nbytes = n;
+  pthread_mutex_unlock(&lock);
+
+  if (b->ptr == NULL)
+    b->ptr = (char *) memory->smalloc_align(bufsize,ALIGNFILE,"AIO:buf");
+  memcpy(b->ptr,buf,n);
+
+  pthread_mutex_lock(&lock);
+  enqueue(b);
+  pthread_mutex_unlock(&lock);
+
+  mr->iostall += stall;
+  check();
+}
+
+/* ----------------------------------------------------------------------
+   read N bytes from file at offset into buf
+   use a prefetched buffer if one matches,
+   else wait for pending writes to the file and read directly
+------------------------------------------------------------------------- */
+
+void AsyncIO::read(FILE *fp, uint64_t offset, char *buf, uint64_t n)
+{
+  int fd = fileno(fp);
+  double stall = 0.0;
+
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < npool; i++) {
+    Buffer *b = bufs[i];
+    if ((b->state != READING && b->state != READY) || b->stale ||
+	b->fd != fd || b->offset != offset || b->nbytes != n) continue;
+    while (b->state == READING) wait(stall);
+    if (b->state == READY && !b->stale) {
+      pthread_mutex_unlock(&lock);
+      memcpy(buf,b->ptr,n);
+      pthread_mutex_lock(&lock);
+      b->state = FREE;
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&lock);
+      mr->iostall += stall;
+      check();
+      return;
+    }
+    break;
+  }
+  while (busy(fd)) wait(stall);
+  pthread_mutex_unlock(&lock);
+
+  double time = MPI_Wtime();
+  if (pread(fd,buf,n,offset) != (ssize_t) n)
+    error->one("Failed to read MR-MPI page from file");
+  mr->iostall += stall + MPI_Wtime() - time;
+  check();
+}
+
+/* ----------------------------------------------------------------------
+   start reading N bytes from file at offset into a free staging buffer
+   never waits, the prefetch is skipped if the file holds nbuf buffers
+------------------------------------------------------------------------- */
+
+void AsyncIO::prefetch(FILE *fp, uint64_t offset, uint64_t n)
+{
+  if (nbuf == 0 || n > bufsize) return;
+  if (!started) start();
+
+  int fd = fileno(fp);
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < npool; i++)
+    if ((bufs[i]->state == READING || bufs[i]->state == READY) &&
+	!bufs[i]->stale && bufs[i]->fd == fd && bufs[i]->offset == offset) {
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+
+  Buffer *b = acquire(fd,0);
+  if (b) {
+    if (b->ptr == NULL)
+      b->ptr = (char *) memory->smalloc_align(bufsize,ALIGNFILE,"AIO:buf");
+    b->state = READING;
+    b->stale = 0;
+    b->fd = fd;
+    b->offset = offset;
+    b->nbytes = n;
+    enqueue(b);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/* ----------------------------------------------------------------------
+   finish all requests on a file, drop its prefetched pages, close it
+   release pool buffers beyond nbuf that the file used
+------------------------------------------------------------------------- */
+
+void AsyncIO::close(FILE *fp)
+{
+  int fd = fileno(fp);
+  double stall = 0.0;
+
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < npool; i++) {
+    if (bufs[i]->fd != fd) continue;
+    if (bufs[i]->state == READY) bufs[i]->state = FREE;
+    else if (bufs[i]->state == READING) bufs[i]->stale = 1;
+  }
+  while (busy(fd)) wait(stall);
+  trim();
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+
+  mr->iostall += stall;
+  check();
+  fclose(fp);
+}
+
+/* ----------------------------------------------------------------------
+   write a page with N bytes of data to file at offset
+   compress it first if MR compresslevel is set and it saves file blocks
+   set zipsize = compressed size, 0 if page is written uncompressed
+   return # of bytes written to file
+------------------------------------------------------------------------- */
+
+uint64_t AsyncIO::write_page(FILE *fp, uint64_t offset, char *page,
+			     uint64_t n, uint64_t &zipsize)
+{
+  uint64_t filesize = roundup(n);
+  zipsize = 0;
+
+  if (mr->compresslevel && filesize > ALIGNFILE && filesize <= bufsize) {
+    zipsize = zip(page,n,filesize-ALIGNFILE);
+    if (zipsize) {
+      filesize = roundup(zipsize);
+      write(fp,offset,zbuf,filesize);
+      return filesize;
+    }
+  }
+
+  write(fp,offset,page,filesize);
+  return filesize;
+}
+
+/* ----------------------------------------------------------------------
+   read a page written by write_page() into page of size pagesize
+------------------------------------------------------------------------- */
+
+void AsyncIO::read_page(FILE *fp, uint64_t offset, char *page,
+			uint64_t pagesize, uint64_t filesize, uint64_t zipsize)
+{
+  if (zipsize == 0) {
+    read(fp,offset,page,filesize);
+    return;
+  }
+
+  if (zbuf == NULL) allocate_zip();
+  read(fp,offset,zbuf,filesize);
+  unzip(page,pagesize,zipsize);
+}
+
+/* ----------------------------------------------------------------------
+   compress N bytes of page into zbuf, using at most maxbytes
+   compresslevel = 1 uses the LZ codec, 2-9 uses zlib at that level
+   zbuf starts with an int for the codec
+   return compressed size, 0 if it does not fit in maxbytes
+------------------------------------------------------------------------- */
+
+uint64_t AsyncIO::zip(char *page, uint64_t n, uint64_t maxbytes)
+{
+  if (zbuf == NULL) allocate_zip();
+  if (maxbytes <= sizeof(int)) return 0;
+
+  int level = mr->compresslevel;
+  char *out = zbuf + sizeof(int);
+  maxbytes -= sizeof(int);
+  uint64_t nzip;
+
+  if (level == 1) {
+    *((int *) zbuf) = ZIPLZ;
+    nzip = lz_compress((uint8_t *) page,n,(uint8_t *) out,maxbytes);
+  } else {
+    *((int *) zbuf) = ZIPZLIB;
+    if (!deflateflag) {
+      memset(&zdeflate,0,sizeof(z_stream));
+      if (deflateInit(&zdeflate,level) != Z_OK)
+	error->one("Could not initialize zlib compression");
+      deflateflag = 1;
+      deflatelevel = level;
+    } else if (level != deflatelevel) {
+      deflateReset(&zdeflate);
+      deflateParams(&zdeflate,level,Z_DEFAULT_STRATEGY);
+      deflatelevel = level;
+    }
+    deflateReset(&zdeflate);
+    zdeflate.next_in = (Bytef *) page;
+    zdeflate.avail_in = n;
+    zdeflate.next_out = (Bytef *) out;
+    zdeflate.avail_out = maxbytes;
+    if (deflate(&zdeflate,Z_FINISH) == Z_STREAM_END) nzip = zdeflate.total_out;
+    else nzip = 0;
+  }
+
+  if (nzip == 0) return 0;
+  return nzip + sizeof(int);
+}
+
+/* ----------------------------------------------------------------------
+   uncompress zipsize bytes of zbuf into page of size pagesize
+------------------------------------------------------------------------- */
+
+void AsyncIO::unzip(char *page, uint64_t pagesize, uint64_t zipsize)
+{
+  int codec = *((int *) zbuf);
+  uint8_t *in = (uint8_t *) zbuf + sizeof(int);
+  uint64_t nin = zipsize - sizeof(int);
+  int flag = 0;
+
+  if (codec == ZIPLZ) {
+    if (lz_decompress(in,nin,(uint8_t *) page,pagesize) < 0) flag = 1;
+  } else if (codec == ZIPZLIB) {
+    if (!inflateflag) {
+      memset(&zinflate,0,sizeof(z_stream));
+      if (inflateInit(&zinflate) != Z_OK)
+	error->one("Could not initialize zlib decompression");
+      inflateflag = 1;
+    }
+    inflateReset(&zinflate);
+    zinflate.next_in = in;
+    zinflate.avail_in = nin;
+    zinflate.next_out = (Bytef *) page;
+    zinflate.avail_out = pagesize;
+    if (inflate(&zinflate,Z_FINISH) != Z_STREAM_END) flag = 1;
+  } else flag = 1;
+
+  if (flag) error->one("Failed to uncompress MR-MPI page");
+}
+
+/* ---------------------------------------------------------------------- */
+
+void AsyncIO::allocate_zip()
+{
+  zbuf = (char *) memory->smalloc_align(bufsize,ALIGNFILE,"AIO:zbuf");
+  lzhash = (uint32_t *)
+    memory->smalloc((1 << LZHASHLOG)*sizeof(uint32_t),"AIO:lzhash");
+}
+
+/* ----------------------------------------------------------------------
+   LZ codec, byte-oriented LZ77 in the LZ4 block layout
+   each sequence = token, literal length bytes, literals,
+     2-byte match offset, match length bytes
+   token = 4 bits literal length, 4 bits match length - LZMINMATCH
+   a length of 15 continues in following bytes, each 255 continues further
+   the last sequence has literals only
+   return compressed size, 0 if it does not fit in maxbytes
+------------------------------------------------------------------------- */
+
+static inline uint32_t lz_read32(const uint8_t *ptr)
+{
+  uint32_t v;
+  memcpy(&v,ptr,sizeof(uint32_t));
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZHASHLOG);
+}
+
+static inline uint8_t *lz_length(uint8_t *op, uint64_t n)
+{
+  while (n >= 255) {
+    *op++ = 255;
+    n -= 255;
+  }
+  *op++ = n;
+  return op;
+}
+
+uint64_t AsyncIO::lz_compress(const uint8_t *src, uint64_t n,
+			      uint8_t *dst, uint64_t maxbytes)
+{
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *iend = src + n;
+  const uint8_t *mflimit = n > LZMINMATCH+8 ? iend - LZMINMATCH - 8 : src;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + maxbytes;
+
+  memset(lzhash,0,(1 << LZHASHLOG)*sizeof(uint32_t));
+
+  while (ip < mflimit) {
+
+    // find a match, skip faster through data that does not match
+
+    const uint8_t *ref;
+    int nmiss = 0;
+    while (1) {
+      uint32_t h = lz_hash(lz_read32(ip));
+      ref = src + lzhash[h];
+      lzhash[h] = ip - src;
+      if (ref < ip && ip - ref <= LZMAXOFFSET &&
+	  lz_read32(ref) == lz_read32(ip)) break;
+      ip += 1 + (nmiss++ >> 6);
+      if (ip >= mflimit) goto last;
+    }
+
+    // extend match backward and forward
+
+    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    const uint8_t *mp = ip + LZMINMATCH;
+    const uint8_t *mref = ref + LZMINMATCH;
+    while (mp < iend && *mp == *mref) {
+      mp++;
+      mref++;
+    }
+
+    uint64_t nlit = ip - anchor;
+    uint64_t nmatch = mp - ip - LZMINMATCH;
+    if (op + 1 + nlit/255 + 1 + nlit + 2 + nmatch/255 + 1 > oend) return 0;
+
+    uint8_t *token = op++;
+    if (nlit >= 15) {
+      *token = 15 << 4;
+      op = lz_length(op,nlit-15);
+    } else *token = nlit << 4;
+    memcpy(op,anchor,nlit);
+    op += nlit;
+
+    uint64_t offset = ip - ref;
+    *op++ = offset & 255;
+    *op++ = offset >> 8;
+
+    if (nmatch >= 15) {
+      *token |= 15;
+      op = lz_length(op,nmatch-15);
+    } else *token |= nmatch;
+
+    ip = anchor = mp;
+  }
+
+ last:
+  uint64_t nlit = iend - anchor;
+  if (op + 1 + nlit/255 + 1 + nlit > oend) return 0;
+  if (nlit >= 15) {
+    *op++ = 15 << 4;
+    op = lz_length(op,nlit-15);
+  } else *op++ = nlit << 4;
+  memcpy(op,anchor,nlit);
+  op += nlit;
+
+  return op - dst;
+}
+
+/* ----------------------------------------------------------------------
+   uncompress N bytes from LZ codec into dst of size maxbytes
+   return uncompressed size, -1 if input is corrupt
+------------------------------------------------------------------------- */
+
+int64_t AsyncIO::lz_decompress(const uint8_t *src, uint64_t n,
+			       uint8_t *dst, uint64_t maxbytes)
+{
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + n;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + maxbytes;
+  uint8_t b;
+
+  while (ip < iend) {
+    int token = *ip++;
+
+    uint64_t nlit = token >> 4;
+    if (nlit == 15)
+      do {
+	if (ip >= iend) return -1;
+	b = *ip++;
+	nlit += b;
+      } while (b == 255);
+    if ((uint64_t) (iend - ip) < nlit || (uint64_t) (oend - op) < nlit)
+      return -1;
+    memcpy(op,ip,nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return -1;
+    uint64_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (uint64_t) (op - dst)) return -1;
+
+    uint64_t nmatch = token & 15;
+    if (nmatch == 15)
+      do {
+	if (ip >= iend) return -1;
+	b = *ip++;
+	nmatch += b;
+      } while (b == 255);
+    nmatch += LZMINMATCH;
+    if ((uint64_t) (oend - op) < nmatch) return -1;
+
+    // overlapping copy when offset < nmatch repeats the last offset bytes
+
+    const uint8_t *match = op - offset;
+    if (offset >= nmatch) memcpy(op,match,nmatch);
+    else if (offset >= 8) {
+      uint64_t i = 0;
+      for (; i + 8 <= nmatch; i += 8) memcpy(op+i,match+i,8);
+      for (; i < nmatch; i++) op[i] = match[i];
+    } else
+      for (uint64_t i = 0; i < nmatch; i++) op[i] = match[i];
+    op += nmatch;
+  }
+
+  return op - dst;
+}
+
+/* ----------------------------------------------------------------------
+   I/O thread, serve queued requests in order
+------------------------------------------------------------------------- */
+
+void *AsyncIO::thread_entry(void *ptr)
+{
+  ((AsyncIO *) ptr)->loop();
+  return NULL;
+}
+
+void AsyncIO::loop()
+{
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (qhead == NULL && !stopflag) pthread_cond_wait(&cond,&lock);
+    if (qhead == NULL) break;
+
+    Buffer *b = qhead;
+    qhead = b->next;
+    if (qhead == NULL) qtail = NULL;
+    pthread_mutex_unlock(&lock);
+
+    ssize_t n;
+    if (b->state == WRITING) n = pwrite(b->fd,b->ptr,b->nbytes,b->offset);
+    else n = pread(b->fd,b->ptr,b->nbytes,b->offset);
+
+    pthread_mutex_lock(&lock);
+    if (n != (ssize_t) b->nbytes) errflag = 1;
+    if (b->state == WRITING || b->stale || errflag) b->state = FREE;
+    else b->state = READY;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void AsyncIO::start()
+{
+  if (pthread_create(&thread,NULL,thread_entry,this))
+    error->one("Could not create MR-MPI I/O thread");
+  started = 1;
+}
+
+/* ----------------------------------------------------------------------
+   return a free buffer for a request on fd, NULL if none, caller holds lock
+   fd holds at most nbuf buffers, a new one is added to the pool if all
+     free buffers are held by other files
+   evict = 1 to reuse a buffer holding a page prefetched on fd
+------------------------------------------------------------------------- */
+
+AsyncIO::Buffer *AsyncIO::acquire(int fd, int evict)
+{
+  int nheld = 0;
+  Buffer *ready = NULL;
+  for (int i = 0; i < npool; i++)
+    if (bufs[i]->state != FREE && bufs[i]->fd == fd) {
+      nheld++;
+      if (bufs[i]->state == READY && ready == NULL) ready = bufs[i];
+    }
+
+  if (nheld >= nbuf) {
+    if (evict && ready) {
+      ready->state = FREE;
+      return ready;
+    }
+    return NULL;
+  }
+
+  for (int i = 0; i < npool; i++)
+    if (bufs[i]->state == FREE) return bufs[i];
+
+  if (npool == maxpool) {
+    maxpool += nbuf;
+    bufs = (Buffer **)
+      memory->srealloc(bufs,maxpool*sizeof(Buffer *),"AIO:bufs");
+  }
+  Buffer *b = new Buffer;
+  b->ptr = NULL;
+  b->state = FREE;
+  b->stale = 0;
+  b->fd = -1;
+  bufs[npool++] = b;
+  return b;
+}
+
+/* ----------------------------------------------------------------------
+   append a request to the FIFO of the I/O thread, caller holds lock
+------------------------------------------------------------------------- */
+
+void AsyncIO::enqueue(Buffer *b)
+{
+  b->next = NULL;
+  if (qtail) qtail->next = b;
+  else qhead = b;
+  qtail = b;
+  pthread_cond_broadcast(&cond);
+}
+
+/* ----------------------------------------------------------------------
+   delete free buffers so the pool shrinks back to nbuf, caller holds lock
+   the I/O thread only holds buffers that are not free
+------------------------------------------------------------------------- */
+
+void AsyncIO::trim()
+{
+  int i = 0;
+  while (i < npool && npool > nbuf) {
+    if (bufs[i]->state != FREE) {
+      i++;
+      continue;
+    }
+    memory->sfree(bufs[i]->ptr);
+    delete bufs[i];
+    bufs[i] = bufs[--npool];
+  }
+}
+
+/* ----------------------------------------------------------------------
+   return 1 if a write or read on fd is still pending, caller holds lock
+------------------------------------------------------------------------- */
+
+int AsyncIO::busy(int fd)
+{
+  for (int i = 0; i < npool; i++)
+    if ((bufs[i]->state == WRITING || bufs[i]->state == READING) &&
+	bufs[i]->fd == fd) return 1;
+  return 0;
+}
+
+/* ----------------------------------------------------------------------
+   drop prefetched data of fd that overlaps a write, caller holds lock
+------------------------------------------------------------------------- */
+
+void AsyncIO::invalidate(int fd, uint64_t offset, uint64_t n)
+{
+  for (int i = 0; i < npool; i++) {
+    Buffer *b = bufs[i];
+    if (b->fd != fd || b->offset >= offset + n || offset >= b->offset + b->nbytes)
+      continue;
+    if (b->state == READY) b->state = FREE;
+    else if (b->state == READING) b->stale = 1;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   wait for the I/O thread to finish a request, caller holds lock
+   add waiting time to stall
+------------------------------------------------------------------------- */
+
+void AsyncIO::wait(double &stall)
+{
+  double time = MPI_Wtime();
+  pthread_cond_wait(&cond,&lock);
+  stall += MPI_Wtime() - time;
+}
+
+/* ----------------------------------------------------------------------
+   round N up to multiple of ALIGNFILE
+------------------------------------------------------------------------- */
+
+uint64_t AsyncIO::roundup(uint64_t n)
+{
+  if (n % ALIGNFILE == 0) return n;
+  return (n/ALIGNFILE + 1) * ALIGNFILE;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void AsyncIO::check()
+{
+  if (errflag) error->one("Failed to read/write MR-MPI page in I/O thread");
+}
@@ -0,0 +1,97 @@
+/* ----------------------------------------------------------------------
+   MR-MPI = MapReduce-MPI library
+   http://www.cs.sandia.gov/~sjplimp/mapreduce.html
+   Steve Plimpton, sjplimp@sandia.gov, Sandia National Laboratories
+
+   Copyright (2009) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the modified Berkeley Software Distribution (BSD) License.
+
+   See the README file in the top-level MapReduce directory.
+------------------------------------------------------------------------- */
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include "stdio.h"
+#include "stdint.h"
+#include "pthread.h"
+#include "zlib.h"
+
+namespace MAPREDUCE_NS {
+
+class AsyncIO {
+ public:
+  AsyncIO(uint64_t, int, class MapReduce *, class Memory *, class Error *);
+  ~AsyncIO();
+
+  void write(FILE *, uint64_t, char *, uint64_t);
+  void read(FILE *, uint64_t, char *, uint64_t);
+  void prefetch(FILE *, uint64_t, uint64_t);
+  void close(FILE *);
+
+  uint64_t write_page(FILE *, uint64_t, char *, uint64_t, uint64_t &);
+  void read_page(FILE *, uint64_t, char *, uint64_t, uint64_t, uint64_t);
+
+ private:
+  class MapReduce *mr;
+  class Memory *memory;
+  class Error *error;
+
+  uint64_t bufsize;             // size of each staging buffer
+  int nbuf;                     // # of staging buffers per file, 0 = sync I/O
+
+  // staging buffers, each holds one page being written or prefetched
+  // a file holds at most nbuf non-free buffers and never waits on another
+  //   file's requests, the pool grows when all buffers are held by others
+
+  struct Buffer {
+    char *ptr;                  // buffer memory, allocated on first use
+    int state;                  // FREE, WRITING, READING, or READY
+    int stale;                  // 1 if a prefetch was overwritten meanwhile
+    int fd;                     // file descriptor of the request
+    uint64_t offset;            // file offset of the request
+    uint64_t nbytes;            // size of the request
+    Buffer *next;               // next request in FIFO of the I/O thread
+  };
+
+  Buffer **bufs;                // pool of buffers
+  int npool,maxpool;            // # of buffers in pool, # allocated in bufs
+  Buffer *qhead,*qtail;         // FIFO of requests for the I/O thread
+  int errflag;                  // 1 if the I/O thread saw a failed read/write
+  int stopflag;                 // 1 when the I/O thread should exit
+  int started;                  // 1 if the I/O thread is running
+
+  char *zbuf;                   // compressed copy of one page
+  uint32_t *lzhash;             // hash table of LZ codec
+  z_stream zdeflate,zinflate;   // zlib streams, reused for each page
+  int deflateflag,inflateflag;  // 1 if zlib stream is initialized
+  int deflatelevel;             // current level of zdeflate
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  static void *thread_entry(void *);
+  void loop();
+  void start();
+  Buffer *acquire(int, int);
+  void enqueue(Buffer *);
+  void trim();
+  int busy(int);
+  void invalidate(int, uint64_t, uint64_t);
+  void wait(double &);
+  void check();
+  uint64_t roundup(uint64_t);
+
+  uint64_t zip(char *, uint64_t, uint64_t);
+  void unzip(char *, uint64_t, uint64_t);
+  void allocate_zip();
+  uint64_t lz_compress(const uint8_t *, uint64_t, uint8_t *, uint64_t);
+  int64_t lz_decompress(const uint8_t *, uint64_t, uint8_t *, uint64_t);
+};
+
+}
+
+#endif
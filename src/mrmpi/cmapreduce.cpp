@@ -38,6 +38,12 @@ void *MR_create_mpi_finalize()
   return (void *) mr;
 }
 
+void *MR_create_fixed(MPI_Comm comm, int keybytes, int valuebytes)
+{
+  MapReduce *mr = new MapReduce(comm,keybytes,valuebytes);
+  return (void *) mr;
+}
+
 void MR_destroy(void *MRptr)
 {
   MapReduce *mr = (MapReduce *) MRptr;
@@ -286,6 +292,12 @@ uint64_t MR_sort_keys(void *MRptr, int (*mycompare)(char *, int, char *, int))
   return mr->sort_keys(mycompare);
 }
 
+uint64_t MR_sort_keys_flag(void *MRptr, int flag)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  return mr->sort_keys(flag);
+}
+
 uint64_t MR_sort_values(void *MRptr, 
 			int (*mycompare)(char *, int, char *, int))
 {
@@ -293,6 +305,12 @@ uint64_t MR_sort_values(void *MRptr,
   return mr->sort_values(mycompare);
 }
 
+uint64_t MR_sort_values_flag(void *MRptr, int flag)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  return mr->sort_values(flag);
+}
+
 uint64_t MR_sort_multivalues(void *MRptr, int (*mycompare)(char *, int, 
 							   char *, int))
 {
@@ -300,6 +318,19 @@ uint64_t MR_sort_multivalues(void *MRptr, int (*mycompare)(char *, int,
   return mr->sort_multivalues(mycompare);
 }
 
+uint64_t MR_sort_keys_global(void *MRptr,
+			     int (*mycompare)(char *, int, char *, int))
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  return mr->sort_keys_global(mycompare);
+}
+
+uint64_t MR_sort_keys_global_flag(void *MRptr, int flag)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  return mr->sort_keys_global(flag);
+}
+
 void MR_kv_stats(void *MRptr, int level)
 {
   MapReduce *mr = (MapReduce *) MRptr;
@@ -324,6 +355,18 @@ void MR_set_mapstyle(void *MRptr, int value)
   mr->mapstyle = value;
 }
 
+void MR_set_mapthreads(void *MRptr, int value)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->mapthreads = value;
+}
+
+void MR_set_mapmaster(void *MRptr, int value)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->mapmaster = value;
+}
+
 void MR_set_all2all(void *MRptr, int value)
 {
   MapReduce *mr = (MapReduce *) MRptr;
@@ -378,6 +421,51 @@ void MR_set_fpath(void *MRptr, char *str)
   mr->set_fpath(str);
 }
 
+void MR_set_fpathstyle(void *MRptr, int value)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->fpathstyle = value;
+}
+
+void MR_set_hugepage(void *MRptr, int value)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->hugepage = value;
+}
+
+void MR_set_zeropage(void *MRptr, int value)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->zeropage = value;
+}
+
+void MR_set_iobuf(void *MRptr, int value)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->iobuf = value;
+}
+
+void MR_set_compresslevel(void *MRptr, int value)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->compresslevel = value;
+}
+
+void MR_set_combiner(void *MRptr,
+		     void (*mycombine)(char *, int, char *, int,
+				       char *, int, void *),
+		     void *APPptr)
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->set_combiner(mycombine,APPptr);
+}
+
+void MR_set_hash(void *MRptr, uint64_t (*myhash)(char *, int))
+{
+  MapReduce *mr = (MapReduce *) MRptr;
+  mr->set_hash(myhash);
+}
+
 void MR_kv_add(void *KVptr, char *key, int keybytes,
 	       char *value, int valuebytes)
 {
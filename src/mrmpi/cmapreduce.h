@@ -24,6 +24,7 @@ extern "C" {
 void *MR_create(MPI_Comm comm);
 void *MR_create_mpi();
 void *MR_create_mpi_finalize();
+void *MR_create_fixed(MPI_Comm comm, int keybytes, int valuebytes);
 void MR_destroy(void *MRptr);
 
 void *MR_copy(void *MRptr);
@@ -99,16 +100,23 @@ int MR_multivalue_block(void *MRptr, int iblock,
 
 uint64_t MR_sort_keys(void *MRptr, 
 		      int (*mycompare)(char *, int, char *, int));
+uint64_t MR_sort_keys_flag(void *MRptr, int flag);
 uint64_t MR_sort_values(void *MRptr,
 			int (*mycompare)(char *, int, char *, int));
+uint64_t MR_sort_values_flag(void *MRptr, int flag);
 uint64_t MR_sort_multivalues(void *MRptr,
 			     int (*mycompare)(char *, int, char *, int));
+uint64_t MR_sort_keys_global(void *MRptr,
+			     int (*mycompare)(char *, int, char *, int));
+uint64_t MR_sort_keys_global_flag(void *MRptr, int flag);
 
 void MR_kv_stats(void *MRptr, int level);
 void MR_kmv_stats(void *MRptr, int level);
 void MR_cummulative_stats(void *MRptr, int level, int reset);
 
 void MR_set_mapstyle(void *MRptr, int value);
+void MR_set_mapthreads(void *MRptr, int value);
+void MR_set_mapmaster(void *MRptr, int value);
 void MR_set_all2all(void *MRptr, int value);
 void MR_set_verbosity(void *MRptr, int value);
 void MR_set_timer(void *MRptr, int value);
@@ -118,6 +126,16 @@ void MR_set_maxpage(void *MRptr, int value);
 void MR_set_keyalign(void *MRptr, int value);
 void MR_set_valuealign(void *MRptr, int value);
 void MR_set_fpath(void *MRptr, char *str);
+void MR_set_fpathstyle(void *MRptr, int value);
+void MR_set_hugepage(void *MRptr, int value);
+void MR_set_zeropage(void *MRptr, int value);
+void MR_set_iobuf(void *MRptr, int value);
+void MR_set_compresslevel(void *MRptr, int value);
+void MR_set_combiner(void *MRptr,
+		     void (*mycombine)(char *, int, char *, int,
+				       char *, int, void *),
+		     void *APPptr);
+void MR_set_hash(void *MRptr, uint64_t (*myhash)(char *, int));
 
 void MR_kv_add(void *KVptr, char *key, int keybytes, 
 	       char *value, int valuebytes);
@@ -4,6 +4,7 @@
 
 #include "stddef.h"
 #include "stdint.h"
+#include "string.h"
 
 #define HASH_LITTLE_ENDIAN 1       // Intel and AMD are little endian
 
@@ -331,3 +332,104 @@ uint32_t hashlittle( const void *key, size_t length, uint32_t initval)
   return h;
 #endif /* PURIFY_HATES_HASHLITTLE */
 }
+
+/*
+-------------------------------------------------------------------------------
+hash64() -- hash a variable-length key into a 64-bit value
+  key    : the key (the unaligned variable-length array of bytes)
+  length : the length of the key, counting by bytes
+  seed   : any 8-byte value
+Returns a 64-bit value, same as XXH64(key, length, seed) of xxHash.
+
+Keys are consumed 32 bytes at a time in 4 independent lanes, then
+8, 4, and 1 bytes at a time, then the result is avalanched.  Much faster
+than hashlittle() on long keys, and all 64 output bits are usable.
+-------------------------------------------------------------------------------
+*/
+
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+#define PRIME64_4 0x85ebca77c2b2ae63ULL
+#define PRIME64_5 0x27d4eb2f165667c5ULL
+
+#define rot64(x,k) (((x)<<(k)) | ((x)>>(64-(k))))
+
+static inline uint64_t read64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(uint64_t));
+  return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(uint32_t));
+  return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = rot64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val)
+{
+  acc ^= round64(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash64(const void *key, size_t length, uint64_t seed)
+{
+  const uint8_t *p = (const uint8_t *) key;
+  const uint8_t *end = p + length;
+  uint64_t h;
+
+  if (length >= 32) {
+    const uint8_t *limit = end - 32;
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    do {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p+8));
+      v3 = round64(v3, read64(p+16));
+      v4 = round64(v4, read64(p+24));
+      p += 32;
+    } while (p <= limit);
+    h = rot64(v1,1) + rot64(v2,7) + rot64(v3,12) + rot64(v4,18);
+    h = merge64(h, v1);
+    h = merge64(h, v2);
+    h = merge64(h, v3);
+    h = merge64(h, v4);
+  } else h = seed + PRIME64_5;
+
+  h += (uint64_t) length;
+
+  while (p + 8 <= end) {
+    h ^= round64(0, read64(p));
+    h = rot64(h,27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) read32(p) * PRIME64_1;
+    h = rot64(h,23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * PRIME64_5;
+    h = rot64(h,11) * PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
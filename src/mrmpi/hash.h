@@ -2,4 +2,66 @@
 // from lookup3.c, by Bob Jenkins, May 2006, Public Domain
 // bob_jenkins@burtleburtle.net
 
+// Hash function hash64()
+// xxHash64 algorithm, by Yann Collet, BSD license
+
+// Key hash hashkey() used by aggregate(), convert() and the combiner
+// one 64-bit hash per key, callers take disjoint bits of it:
+//   aggregate() proc = hi 32 bits, multiply-shifted to nprocs
+//   convert() table slot and tag = lo 32 bits
+//   convert() partition split = hi 32 bits, from the lo end up
+
+#ifndef MR_HASH_H
+#define MR_HASH_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "string.h"
+
 uint32_t hashlittle(const void *key, size_t length, uint32_t);
+uint64_t hash64(const void *key, size_t length, uint64_t seed);
+
+// multiply-xorshift mixer of a 4 or 8 byte integer key, all bits mixed
+
+static inline uint64_t hashmix(uint64_t k)
+{
+  k *= 0x9e3779b97f4a7c15ULL;
+  k ^= k >> 32;
+  k *= 0xd6e8feb86659fd93ULL;
+  k ^= k >> 32;
+  return k;
+}
+
+static inline uint64_t hashkey(const char *key, int keybytes)
+{
+  if (keybytes == sizeof(uint32_t)) {
+    uint32_t k;
+    memcpy(&k, key, sizeof(uint32_t));
+    return hashmix(k);
+  }
+  if (keybytes == sizeof(uint64_t)) {
+    uint64_t k;
+    memcpy(&k, key, sizeof(uint64_t));
+    return hashmix(k);
+  }
+  if (keybytes > 16) return hash64(key, keybytes, 0);
+
+  // keys up to 16 bytes: 2 overlapping words, mixed with the length
+
+  uint64_t a = 0, b = 0;
+  if (keybytes >= 8) {
+    memcpy(&a, key, sizeof(uint64_t));
+    memcpy(&b, key + keybytes - 8, sizeof(uint64_t));
+  } else if (keybytes >= 4) {
+    uint32_t k;
+    memcpy(&k, key, sizeof(uint32_t));
+    a = k;
+    memcpy(&k, key + keybytes - 4, sizeof(uint32_t));
+    b = k;
+  } else {
+    for (int i = 0; i < keybytes; i++) a = (a << 8) | (uint8_t) key[i];
+  }
+  return hashmix(a ^ hashmix(b ^ keybytes));
+}
+
+#endif
@@ -24,6 +24,7 @@ using namespace MAPREDUCE_NS;
 #define MAX(A,B) ((A) > (B)) ? (A) : (B)
 
 #define INTMAX 0x7FFFFFFF
+#define COUNTTAG 3                // tag of setup_sparse(), exchanges use 1,2
 
 /* ---------------------------------------------------------------------- */
 
@@ -38,264 +39,446 @@ Irregular::Irregular(int all2all_caller, Memory *memory_caller,
   MPI_Comm_rank(comm,&me);
   MPI_Comm_size(comm,&nprocs);
 
-  sendbytes = new int[nprocs];
-  sdispls = new int[nprocs];
-  recvbytes = new int[nprocs];
-  rdispls = new int[nprocs];
-  senddatums = new int[nprocs];
-  one = new int[nprocs];
-  for (int i = 0; i < nprocs; i++) one[i] = 1;
-
-  sendprocs = new int[nprocs];
-  recvprocs = new int[nprocs];
   request = new MPI_Request[nprocs];
-  status = new MPI_Status[nprocs];
+
+  for (int i = 0; i < 2; i++) {
+    Slot *sl = &slots[i];
+    sl->sendbytes = new int[nprocs];
+    sl->sdispls = new int[nprocs];
+    sl->recvbytes = new int[nprocs];
+    sl->rdispls = new int[nprocs];
+    sl->counts = new int[2*nprocs];
+    sl->rcounts = new int[2*nprocs];
+    sl->sendprocs = new int[nprocs];
+    sl->recvprocs = new int[nprocs];
+    sl->nbrcounts = new int[6*nprocs];
+    sl->request = new MPI_Request[2*nprocs];
+    sl->nsend = sl->nrecv = 0;
+    sl->nrequest = sl->active = sl->persist = 0;
+    sl->copybuf = sl->recvbuf = NULL;
+  }
+  cursor = new int[nprocs];
+
+  graph = MPI_COMM_NULL;
+  ngraphsrc = ngraphdst = 0;
+  graphsrc = new int[nprocs];
+  graphdst = new int[nprocs];
+  srcindex = new int[nprocs];
+  dstindex = new int[nprocs];
+  for (int i = 0; i < nprocs; i++) srcindex[i] = dstindex[i] = -1;
 }
 
 /* ---------------------------------------------------------------------- */
 
 Irregular::~Irregular()
 {
-  delete [] sendbytes;
-  delete [] sdispls;
-  delete [] recvbytes;
-  delete [] rdispls;
-  delete [] senddatums;
-  delete [] one;
-
-  delete [] sendprocs;
-  delete [] recvprocs;
   delete [] request;
-  delete [] status;
+
+  // skip MPI calls if app already finalized MPI
+
+  int finalized;
+  MPI_Finalized(&finalized);
+
+  for (int i = 0; i < 2; i++) {
+    Slot *sl = &slots[i];
+    if (!finalized) {
+      exchange_wait(i);
+      free_requests(sl);
+    }
+    delete [] sl->sendbytes;
+    delete [] sl->sdispls;
+    delete [] sl->recvbytes;
+    delete [] sl->rdispls;
+    delete [] sl->counts;
+    delete [] sl->rcounts;
+    delete [] sl->sendprocs;
+    delete [] sl->recvprocs;
+    delete [] sl->nbrcounts;
+    delete [] sl->request;
+  }
+  delete [] cursor;
+
+  if (graph != MPI_COMM_NULL && !finalized) MPI_Comm_free(&graph);
+  delete [] graphsrc;
+  delete [] graphdst;
+  delete [] srcindex;
+  delete [] dstindex;
 }
 
 /* ----------------------------------------------------------------------
-   setup irregular communication for all2all or custom
+   setup one exchange of a pipeline, in slot = 0 or 1
+   any previous exchange in the slot must have been waited on
    n = # of datums contributed by this proc
    proclist = which proc each datum is to be sent to
    sizes = byte count of each datum
    recvlimit = max allowed size of received data
+   doneflag = 1 if this proc has no more datums to send in any exchange
+   all2all = 1: Alltoall of send bytes and datums to every proc
+   else: sparse exchange of bytes and datums with only my partners
+   then one Allreduce of fraction, doneflag, and need for a new graph
    return # of datums I recv
-   set fraction = 1.0 if can recv all datums without exceeding two limits
-   else set it to estimated fraction I can recv
-   limit #1 = total volume of send data exceeds INTMAX
-   limit #2 = total volume of recv data exceeds min(recvlimit,INTMAX)
-   2nd limit also insures # of received datums cannot exceed INTMAX
-   extra data is setup for custom communication:
-     sendprocs = list of nsend procs to send to
-     recvprocs = list of nrecv procs to recv from
-     reorder = contiguous send indices for each send, self copy is last
+   set fraction = min across procs, 1.0 if all can send and recv
+     else the estimated fraction that would fit
+   limits are send total <= INTMAX and recv total <= min(recvlimit,INTMAX),
+     2nd limit also insures # of received datums cannot exceed INTMAX
+   set alldone = 1 if all procs set doneflag
 ------------------------------------------------------------------------- */
 
-int Irregular::setup(int n, int *proclist, int *sizes, int *reorder,
-             uint64_t recvlimit, double &fraction)
+int Irregular::setup_async(int slot, int n, int *proclist, int *sizes,
+			   uint64_t recvlimit, int doneflag,
+			   double &fraction, int &alldone)
 {
+  int i,iproc;
+  Slot *sl = &slots[slot];
   recvlimit = MIN(recvlimit,INTMAX);
 
-  // compute sendbytes and sdispls
-
-  for (int i = 0; i < nprocs; i++) sendbytes[i] = 0;
-  for (int i = 0; i < n; i++) sendbytes[proclist[i]] += sizes[i];
-
-  sdispls[0] = 0;
-  uint64_t sendtotal = sendbytes[0];
-  for (int i = 1; i < nprocs; i++) {
-    sdispls[i] = sdispls[i-1] + sendbytes[i-1];
-    sendtotal += sendbytes[i];
+  uint64_t sendtotal = 0;
+  for (i = 0; i < 2*nprocs; i++) sl->counts[i] = 0;
+  for (i = 0; i < n; i++) {
+    sl->counts[2*proclist[i]] += sizes[i];
+    sl->counts[2*proclist[i]+1]++;
+    sendtotal += sizes[i];
   }
+  for (i = 0; i < nprocs; i++) sl->sendbytes[i] = sl->counts[2*i];
 
-  // error return if any proc's send total > INTMAX
+  // recvprocs are ascending, so recv buffer is ordered by proc as for all2all
 
-  uint64_t sendtotalmax;
-  MPI_Allreduce(&sendtotal,&sendtotalmax,1,MPI_UNSIGNED_LONG,MPI_MAX,comm);
-  if (sendtotalmax > INTMAX) {
-    fraction = ((double) INTMAX) / sendtotal;
-    return 0;
-  }
+  uint64_t recvtotal = 0;
+  sl->ndatum = 0;
 
-  // compute recvbytes and rdispls
+  if (all2all == 1) {
+    MPI_Alltoall(sl->counts,2,MPI_INT,sl->rcounts,2,MPI_INT,comm);
+    for (i = 0; i < nprocs; i++) {
+      sl->recvbytes[i] = sl->rcounts[2*i];
+      recvtotal += sl->recvbytes[i];
+      sl->ndatum += sl->rcounts[2*i+1];
+    }
+  } else {
+    setup_sparse(sl);
+    for (i = 0; i < sl->nrecv; i++) {
+      iproc = sl->recvprocs[i];
+      recvtotal += sl->recvbytes[iproc];
+      sl->ndatum += sl->rcounts[2*iproc+1];
+    }
+    sl->recvbytes[me] = sl->sendbytes[me];
+    recvtotal += sl->recvbytes[me];
+    sl->ndatum += sl->counts[2*me+1];
+  }
 
-  MPI_Alltoall(sendbytes,1,MPI_INT,recvbytes,1,MPI_INT,comm);
+  // a graph comm must be rebuilt if any proc has a partner not in it
 
-  rdispls[0] = 0;
-  uint64_t recvtotal = recvbytes[0];
-  for (int i = 1; i < nprocs; i++) {
-    rdispls[i] = rdispls[i-1] + recvbytes[i-1];
-    recvtotal += recvbytes[i];
+  int needgraph = 0;
+  if (all2all == 2) {
+    for (i = 0; i < sl->nsend; i++)
+      if (dstindex[sl->sendprocs[i]] < 0) needgraph = 1;
+    for (i = 0; i < sl->nrecv; i++)
+      if (srcindex[sl->recvprocs[i]] < 0) needgraph = 1;
   }
 
-  // error return if any proc's recv total > min(recvlimit,INTMAX)
-  
-  uint64_t recvtotalmax;
-  MPI_Allreduce(&recvtotal,&recvtotalmax,1,MPI_UNSIGNED_LONG,MPI_MAX,comm);
-  if (recvtotalmax > recvlimit) {
-    fraction = ((double) recvlimit) / recvtotal;
-    return 0;
+  double in[3],out[3];
+  in[0] = 1.0;
+  if (sendtotal > INTMAX) in[0] = ((double) INTMAX) / sendtotal;
+  if (recvtotal > recvlimit)
+    in[0] = MIN(in[0],((double) recvlimit) / recvtotal);
+  in[1] = doneflag;
+  in[2] = -needgraph;
+  MPI_Allreduce(in,out,3,MPI_DOUBLE,MPI_MIN,comm);
+  fraction = out[0];
+  alldone = (out[1] == 1.0);
+  sl->newgraph = (out[2] < 0.0);
+  if (fraction < 1.0 || alldone) return 0;
+
+  sl->sdispls[0] = 0;
+  for (i = 1; i < nprocs; i++)
+    sl->sdispls[i] = sl->sdispls[i-1] + sl->sendbytes[i-1];
+
+  if (all2all == 1) {
+    sl->rdispls[0] = 0;
+    for (i = 1; i < nprocs; i++)
+      sl->rdispls[i] = sl->rdispls[i-1] + sl->recvbytes[i-1];
+  } else {
+    int offset = 0;
+    int selfdone = 0;
+    for (i = 0; i < sl->nrecv; i++) {
+      iproc = sl->recvprocs[i];
+      if (iproc > me && !selfdone) {
+	sl->rdispls[me] = offset;
+	offset += sl->recvbytes[me];
+	selfdone = 1;
+      }
+      sl->rdispls[iproc] = offset;
+      offset += sl->recvbytes[iproc];
+    }
+    if (!selfdone) sl->rdispls[me] = offset;
   }
 
-  // successful setup
-  // compute senddatums
-  // nrecv = total # of datums I receive, guaranteed to be < INTMAX
+  cssize = sendtotal - sl->sendbytes[me];
+  crsize = recvtotal - sl->recvbytes[me];
 
-  cssize = sendtotal - sendbytes[me];
-  crsize = recvtotal - recvbytes[me];
+  return sl->ndatum;
+}
 
-  for (int i = 0; i < nprocs; i++) senddatums[i] = 0;
-  for (int i = 0; i < n; i++) senddatums[proclist[i]]++;
-  MPI_Reduce_scatter(senddatums,&ndatum,one,MPI_INT,MPI_SUM,comm);
+/* ----------------------------------------------------------------------
+   sparse exchange of send bytes and datums with partner procs only
+   non-blocking consensus: Issend a count message to each proc I send to,
+     receive count messages until all mine are matched,
+     then Ibarrier, and keep receiving until the Ibarrier completes
+   cost is O(# of partners), not O(nprocs)
+   set nsend,sendprocs and nrecv,recvprocs,recvbytes,rcounts of slot
+------------------------------------------------------------------------- */
 
-  // if all2all, done
+void Irregular::setup_sparse(Slot *sl)
+{
+  int i,iproc,flag,done;
+  MPI_Status mstatus;
+  MPI_Request barrier;
+
+  sl->nsend = 0;
+  for (i = 1; i <= nprocs; i++) {
+    iproc = (me + i) % nprocs;
+    if (iproc != me && sl->counts[2*iproc+1])
+      sl->sendprocs[sl->nsend++] = iproc;
+  }
 
-  if (all2all) {
-    fraction = 1.0;
-    return ndatum;
+  for (i = 0; i < sl->nsend; i++) {
+    iproc = sl->sendprocs[i];
+    MPI_Issend(&sl->counts[2*iproc],2,MPI_INT,iproc,COUNTTAG,comm,
+	       &request[i]);
   }
 
-  // if custom, setup additional data strucs
-  // sendprocs,recvprocs = lists of procs to send to and recv from
-  // begin lists with iproc > me and wrap around
-  // reorder = contiguous send indices for each proc I send to
-  // let s0 = senddatums[sendprocs[0]], s1 = senddatums[sendprocs[1]], etc
-  // reorder[0:s0-1] = indices of datums in 1st message
-  // reorder[s0:s0+s1-1] = indices of datums in 2nd message, etc
-  // proc2send[i] = which send (0 to nsend-1) goes to proc I
-  // offset[i] = running offset into reorder for each send (0 to nsend-1)
-
-  int *proc2send = new int[nprocs];
-
-  nsend = nrecv = 0;
-  int iproc = me;
-  for (int i = 1; i < nprocs; i++) {
-    iproc++;
-    if (iproc == nprocs) iproc = 0;
-    if (sendbytes[iproc]) {
-      proc2send[iproc] = nsend;
-      sendprocs[nsend++] = iproc;
+  sl->nrecv = 0;
+  int barrierflag = 0;
+
+  while (1) {
+    MPI_Iprobe(MPI_ANY_SOURCE,COUNTTAG,comm,&flag,&mstatus);
+    if (flag) {
+      iproc = mstatus.MPI_SOURCE;
+      MPI_Recv(&sl->rcounts[2*iproc],2,MPI_INT,iproc,COUNTTAG,comm,
+	       MPI_STATUS_IGNORE);
+      sl->recvbytes[iproc] = sl->rcounts[2*iproc];
+      sl->recvprocs[sl->nrecv++] = iproc;
+    }
+    if (barrierflag) {
+      MPI_Test(&barrier,&done,MPI_STATUS_IGNORE);
+      if (done) break;
+    } else {
+      MPI_Testall(sl->nsend,request,&done,MPI_STATUSES_IGNORE);
+      if (done) {
+	MPI_Ibarrier(comm,&barrier);
+	barrierflag = 1;
+      }
     }
-    if (recvbytes[iproc]) recvprocs[nrecv++] = iproc;
   }
 
-  if (sendbytes[me]) {
-    self = 1;
-    proc2send[me] = nsend;
-  } else self = 0;
-  
-  int *offset = new int[nprocs];
-  offset[0] = 0;
-  for (int i = 1; i <= nsend; i++)
-    offset[i] = offset[i-1] + senddatums[sendprocs[i-1]];
-
-  int j;
-  for (int i = 0; i < n; i++) {
-    j = proclist[i];
-    reorder[offset[proc2send[j]]++] = i;
+  // sort send and recv procs ascending, lists are short so insertion sort
+
+  int *lists[2] = {sl->sendprocs,sl->recvprocs};
+  int nlist[2] = {sl->nsend,sl->nrecv};
+  for (int k = 0; k < 2; k++) {
+    int *list = lists[k];
+    for (i = 1; i < nlist[k]; i++) {
+      int value = list[i];
+      int j = i-1;
+      while (j >= 0 && list[j] > value) {
+	list[j+1] = list[j];
+	j--;
+      }
+      list[j+1] = value;
+    }
   }
-
-  delete [] proc2send;
-  delete [] offset;
-
-  fraction = 1.0;
-  return ndatum;
 }
 
 /* ----------------------------------------------------------------------
-   perform irregular communication via all2all or custom
-   n = # of datums contributed by this proc
-   proclist (for all2all) = which proc each datum is to be sent to
-   sizes = byte count of each datum
-   reorder (for custom) = contiguous send indices for each send
-   copy = buffer to pack send datums into
-   recv = buffer to recv all datums into
+   start the exchange setup in slot, returns before data has arrived
+   n datums are contiguous in src, in order, with byte counts in sizes
+   pack them by proc into copy, which must stay intact until exchange_wait()
+   recv = buffer that will hold all datums I recv, ordered by sending proc
 ------------------------------------------------------------------------- */
 
-void Irregular::exchange(int n, int *proclist, char **ptrs, int *sizes, 
-             int *reorder, char *copy, char *recv)
+void Irregular::exchange_start(int slot, int n, int *proclist, int *sizes,
+			       char *src, char *copy, char *recv)
 {
-  if (all2all) 
-    exchange_all2all(n,proclist,ptrs,sizes,copy,recv);
-  else 
-    exchange_custom(n,reorder,ptrs,sizes,copy,recv);
+  int i,iproc;
+  Slot *sl = &slots[slot];
+
+  for (i = 0; i < nprocs; i++) cursor[i] = sl->sdispls[i];
+  for (i = 0; i < n; i++) {
+    iproc = proclist[i];
+    memcpy(&copy[cursor[iproc]],src,sizes[i]);
+    cursor[iproc] += sizes[i];
+    src += sizes[i];
+  }
+
+  if (all2all == 1) {
+    free_requests(sl);
+    MPI_Ialltoallv(copy,sl->sendbytes,sl->sdispls,MPI_BYTE,
+		   recv,sl->recvbytes,sl->rdispls,MPI_BYTE,comm,&sl->request[0]);
+    sl->nrequest = 1;
+    sl->active = 1;
+    return;
+  }
+
+  if (sl->sendbytes[me])
+    memcpy(&recv[sl->rdispls[me]],&copy[sl->sdispls[me]],sl->sendbytes[me]);
+
+  if (all2all == 2) start_neighbor(slot,copy,recv);
+  else start_p2p(slot,copy,recv);
 }
 
 /* ----------------------------------------------------------------------
-   wrapper on MPI_Alltoallv()
-   first copy datums from ptrs into copy buf in correct order via proclist
+   start point-to-point exchange of slot with persistent requests
+   if partners, byte counts, offsets, and buffers are the same as for
+     the previous exchange in this slot, just restart its requests
+   tag by slot so messages of 2 exchanges in flight cannot be confused
 ------------------------------------------------------------------------- */
 
-void Irregular::exchange_all2all(int n, int *proclist, char **ptrs,
-                 int *sizes, char *copy, char *recv)
+void Irregular::start_p2p(int slot, char *copy, char *recv)
 {
   int i,iproc;
-
-  char **cptrs = new char*[nprocs];
-  for (i = 0; i < nprocs; i++)
-    cptrs[i] = &copy[sdispls[i]];
-
-  for (int i = 0; i < n; i++) {
-    iproc = proclist[i];
-    memcpy(cptrs[iproc],ptrs[i],sizes[i]);
-    cptrs[iproc] += sizes[i];
+  Slot *sl = &slots[slot];
+
+  // pattern of previous exchange is in nbrcounts:
+  // nsend (proc,bytes,offset) then nrecv (proc,bytes,offset)
+
+  int *pattern = sl->nbrcounts;
+  int same = sl->persist && copy == sl->copybuf && recv == sl->recvbuf &&
+    sl->nrequest == sl->nsend + sl->nrecv;
+  if (same) {
+    int m = 0;
+    for (i = 0; i < sl->nsend && same; i++) {
+      iproc = sl->sendprocs[i];
+      if (pattern[m] != iproc || pattern[m+1] != sl->sendbytes[iproc] ||
+	  pattern[m+2] != sl->sdispls[iproc]) same = 0;
+      m += 3;
+    }
+    for (i = 0; i < sl->nrecv && same; i++) {
+      iproc = sl->recvprocs[i];
+      if (pattern[m] != iproc || pattern[m+1] != sl->recvbytes[iproc] ||
+	  pattern[m+2] != sl->rdispls[iproc]) same = 0;
+      m += 3;
+    }
   }
 
-  delete [] cptrs;
+  if (!same) {
+    free_requests(sl);
+    int m = 0;
+    for (i = 0; i < sl->nrecv; i++) {
+      iproc = sl->recvprocs[i];
+      MPI_Recv_init(&recv[sl->rdispls[iproc]],sl->recvbytes[iproc],MPI_BYTE,
+		    iproc,slot+1,comm,&sl->request[sl->nrequest++]);
+    }
+    for (i = 0; i < sl->nsend; i++) {
+      iproc = sl->sendprocs[i];
+      MPI_Send_init(&copy[sl->sdispls[iproc]],sl->sendbytes[iproc],MPI_BYTE,
+		    iproc,slot+1,comm,&sl->request[sl->nrequest++]);
+      pattern[m++] = iproc;
+      pattern[m++] = sl->sendbytes[iproc];
+      pattern[m++] = sl->sdispls[iproc];
+    }
+    for (i = 0; i < sl->nrecv; i++) {
+      iproc = sl->recvprocs[i];
+      pattern[m++] = iproc;
+      pattern[m++] = sl->recvbytes[iproc];
+      pattern[m++] = sl->rdispls[iproc];
+    }
+    sl->persist = 1;
+    sl->copybuf = copy;
+    sl->recvbuf = recv;
+  }
 
-  MPI_Alltoallv(copy,sendbytes,sdispls,MPI_BYTE,
-        recv,recvbytes,rdispls,MPI_BYTE,comm);
+  if (sl->nrequest) MPI_Startall(sl->nrequest,sl->request);
+  sl->active = 1;
 }
 
 /* ----------------------------------------------------------------------
-   custom all2all communication
-   post all receives
-   copying datums for one send into copy buf in correct order via indices
-   copy self data while waiting for receives
-   indices are 0 to N-1, contiguous for each proc to send to, self copy is last
+   start exchange of slot via MPI_Ineighbor_alltoallv()
+   graph comm is rebuilt first if setup found a partner not in it,
+     else partners of the graph that are not partners now get 0 bytes
 ------------------------------------------------------------------------- */
 
-void Irregular::exchange_custom(int n, int *indices, char **ptrs, int *sizes,
-                char *copy, char *recv)
+void Irregular::start_neighbor(int slot, char *copy, char *recv)
 {
-  int i,j,iproc;
-  char *ptr;
+  int i,iproc;
+  Slot *sl = &slots[slot];
+
+  free_requests(sl);
+  if (sl->newgraph) build_graph(sl);
 
-  // post all receives
+  int *scounts = sl->nbrcounts;
+  int *sdispls = &scounts[nprocs];
+  int *rcounts = &scounts[2*nprocs];
+  int *rdispls = &scounts[3*nprocs];
 
-  for (int irecv = 0; irecv < nrecv; irecv++) {
-    iproc = recvprocs[irecv];
-    MPI_Irecv(&recv[rdispls[iproc]],recvbytes[iproc],MPI_BYTE,
-              iproc,0,comm,&request[irecv]);
+  for (i = 0; i < ngraphdst; i++) {
+    iproc = graphdst[i];
+    scounts[i] = sl->sendbytes[iproc];
+    sdispls[i] = sl->sdispls[iproc];
   }
+  for (i = 0; i < ngraphsrc; i++) rcounts[i] = rdispls[i] = 0;
+  for (i = 0; i < sl->nrecv; i++) {
+    iproc = sl->recvprocs[i];
+    rcounts[srcindex[iproc]] = sl->recvbytes[iproc];
+    rdispls[srcindex[iproc]] = sl->rdispls[iproc];
+  }
+
+  MPI_Ineighbor_alltoallv(copy,scounts,sdispls,MPI_BYTE,
+			  recv,rcounts,rdispls,MPI_BYTE,graph,&sl->request[0]);
+  sl->nrequest = 1;
+  sl->active = 1;
+}
 
-  // barrier to insure receives are posted
+/* ----------------------------------------------------------------------
+   create graph comm whose edges are the partners of slot, w/out self
+   collective, called by all procs when any proc needs a new graph
+   an old graph with an exchange still in flight is freed when it completes
+------------------------------------------------------------------------- */
 
-  MPI_Barrier(comm);
+void Irregular::build_graph(Slot *sl)
+{
+  int i;
 
-  // send each message, packing copy buf with needed datums
+  if (graph != MPI_COMM_NULL) MPI_Comm_free(&graph);
+  for (i = 0; i < ngraphsrc; i++) srcindex[graphsrc[i]] = -1;
+  for (i = 0; i < ngraphdst; i++) dstindex[graphdst[i]] = -1;
 
-  int index = 0;
-  for (int isend = 0; isend < nsend; isend++) {
-    iproc = sendprocs[isend];
-    ptr = copy;
-    n = senddatums[iproc];
-    for (i = 0; i < n; i++) {
-      j = indices[index++];
-      memcpy(ptr,ptrs[j],sizes[j]);
-      ptr += sizes[j];
-    }
-    MPI_Send(copy,sendbytes[iproc],MPI_BYTE,iproc,0,comm);
+  ngraphsrc = sl->nrecv;
+  ngraphdst = sl->nsend;
+  for (i = 0; i < ngraphsrc; i++) {
+    graphsrc[i] = sl->recvprocs[i];
+    srcindex[graphsrc[i]] = i;
+  }
+  for (i = 0; i < ngraphdst; i++) {
+    graphdst[i] = sl->sendprocs[i];
+    dstindex[graphdst[i]] = i;
   }
 
-  // copy self data directly to recv buf
+  MPI_Dist_graph_create_adjacent(comm,ngraphsrc,graphsrc,MPI_UNWEIGHTED,
+				 ngraphdst,graphdst,MPI_UNWEIGHTED,
+				 MPI_INFO_NULL,0,&graph);
+}
 
-  if (self)
-    ptr = &recv[rdispls[me]];
-    n = senddatums[me];
-    for (i = 0; i < n; i++) {
-      j = indices[index++];
-      memcpy(ptr,ptrs[j],sizes[j]);
-      ptr += sizes[j];
-    }
+/* ----------------------------------------------------------------------
+   wait until the exchange in slot is complete
+   persistent requests stay allocated for a later restart
+------------------------------------------------------------------------- */
+
+void Irregular::exchange_wait(int slot)
+{
+  Slot *sl = &slots[slot];
+  if (sl->active && sl->nrequest)
+    MPI_Waitall(sl->nrequest,sl->request,MPI_STATUSES_IGNORE);
+  sl->active = 0;
+}
 
-  // wait on all incoming messages
+/* ----------------------------------------------------------------------
+   free inactive persistent requests of slot
+------------------------------------------------------------------------- */
 
-  if (nrecv) MPI_Waitall(nrecv,request,status);
+void Irregular::free_requests(Slot *sl)
+{
+  if (sl->persist)
+    for (int i = 0; i < sl->nrequest; i++)
+      if (sl->request[i] != MPI_REQUEST_NULL) MPI_Request_free(&sl->request[i]);
+  sl->persist = 0;
+  sl->nrequest = 0;
 }
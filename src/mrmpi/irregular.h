@@ -24,41 +24,62 @@ class Irregular {
   Irregular(int, class Memory *, class Error *, MPI_Comm);
   ~Irregular();
 
+  int all2all;               // style of communication, see below
   uint64_t cssize,crsize;    // total send/recv bytes for one exchange
 
-  int setup(int, int *, int *, int *, uint64_t, double &);
-  void exchange(int, int *, char **, int *, int *, char *, char *);
+  int setup_async(int, int, int *, int *, uint64_t, int, double &, int &);
+  void exchange_start(int, int, int *, int *, char *, char *, char *);
+  void exchange_wait(int);
 
  private:
   int me,nprocs;
-  int all2all;
   class Memory *memory;
   class Error *error;
   MPI_Comm comm;             // MPI communicator for all communication
 
-  // all2all and custom settings
-
-  int *sendbytes;            // bytes to send to each proc, including self
-  int *sdispls;              // proc offset into clumped send buffer
-  int *recvbytes;            // bytes to recv from each proc, including self
-  int *rdispls;              // proc offset into recv buffer
-  int *senddatums;           // # of datums to send each proc, including self
-  int *one;                  // 1 for each proc, for MPI call
-  int ndatum;                // # of total datums I recv, including self
-
-  // custom settings
-
-  int self;                  // 0 = no data to copy to self, 1 = yes
-  int nsend;                 // # of messages to send w/out self
-  int nrecv;                 // # of messages to recv w/out self
-  int *sendprocs;            // list of procs to send to w/out self
-  int *recvprocs;            // list of procs to recv from w/out self
-  MPI_Request *request;      // MPI requests for posted recvs
-  MPI_Status *status;        // MPI statuses for Waitall
-
-  void exchange_all2all(int, int *, char **, int *, char *, char *);
-  void exchange_custom(int, int *, char **, int *, char *, char *);
-
+  MPI_Request *request;      // MPI requests for sparse setup
+
+  // pipelined exchanges, each of 2 slots can have one in flight
+  // all2all = 0: sparse setup, Isend/Irecv via persistent requests
+  //   that are restarted as long as a slot's pattern repeats
+  // all2all = 1: dense setup, MPI_Ialltoallv()
+  // all2all = 2: sparse setup, MPI_Ineighbor_alltoallv() on a
+  //   graph communicator that is kept while partners stay the same
+
+  struct Slot {
+    int *sendbytes;          // bytes to send to each proc, including self
+    int *sdispls;            // proc offset into packed send buffer
+    int *recvbytes;          // bytes to recv from each proc, including self
+    int *rdispls;            // proc offset into recv buffer
+    int *counts;             // bytes and datums to send to each proc
+    int *rcounts;            // bytes and datums to recv from each proc
+    int ndatum;              // # of total datums I recv, including self
+    int nsend,nrecv;         // # of procs to send to, recv from, w/out self
+    int *sendprocs;          // procs to send to, ascending
+    int *recvprocs;          // procs to recv from, ascending
+    int *nbrcounts;          // per-neighbor send/recv counts and displs,
+                             //   or pattern of persistent requests
+    int newgraph;            // 1 if graph comm must be rebuilt for exchange
+    int nrequest;            // # of MPI requests in request
+    int active;              // 1 if requests are in flight
+    int persist;             // 1 if requests are persistent, kept when idle
+    char *copybuf,*recvbuf;  // buffers the persistent requests are bound to
+    MPI_Request *request;    // Ialltoallv, Ineighbor, or Isend/Irecv requests
+  };
+
+  Slot slots[2];
+  int *cursor;               // running offset into send buffer for each proc
+
+  MPI_Comm graph;            // neighborhood comm for all2all = 2
+  int ngraphsrc,ngraphdst;   // # of procs in graph that send to / recv from me
+  int *graphsrc,*graphdst;   // those procs, ascending
+  int *srcindex,*dstindex;   // index of each proc in graphsrc/graphdst, or -1
+
+  void setup_sparse(Slot *);
+  void start_p2p(int, char *, char *);
+  void start_neighbor(int, char *, char *);
+  void build_graph(Slot *);
+  void free_requests(Slot *);
 };
 
 }
@@ -18,6 +18,7 @@
 #include "stdint.h"
 #include "keymultivalue.h"
 #include "mapreduce.h"
+#include "asyncio.h"
 #include "keyvalue.h"
 #include "spool.h"
 #include "hash.h"
@@ -37,6 +38,7 @@ using namespace MAPREDUCE_NS;
 #define PAGECHUNK 16
 #define MINSPOOLBYTES 16384
 #define INTMAX 0x7FFFFFFF
+#define MAXLOAD 0.75               // max fill fraction of unique key table
 
 enum {KVFILE, KMVFILE, SORTFILE, PARTFILE, SETFILE}; // same as in mapreduce.cpp
 
@@ -59,7 +61,7 @@ KeyMultiValue::KeyMultiValue(MapReduce *mr_caller,
     comm = comm_caller;
     MPI_Comm_rank(comm, &me);
 
-    filename = mr->file_create(KMVFILE);
+    filename = mr->file_create(KMVFILE, filedir);
     fileflag = 0;
     fp = NULL;
 
@@ -82,6 +84,13 @@ KeyMultiValue::KeyMultiValue(MapReduce *mr_caller,
     twolenbytes = 2 * sizeof(int);
     threelenbytes = 3 * sizeof(int);
 
+    // layout of fixed-width KV pairs read by clone(), collapse(), convert()
+
+    kfixed = mr->kfixed;
+    vfixed = mr->vfixed;
+    vfixoffset = mr->vfixoffset;
+    fixbytes = mr->fixbytes;
+
     if (ONEMAX < MINSPOOLBYTES || ONEMAX < ALIGNFILE)
         error->all("KeyMultiValue settings are inconsistent");
 
@@ -94,9 +103,10 @@ KeyMultiValue::KeyMultiValue(MapReduce *mr_caller,
 KeyMultiValue::~KeyMultiValue()
 {
     memory->sfree(pages);
+    if (fp) mr->aio->close(fp);
     if (fileflag) {
         remove(filename);
-        mr->hiwater(1, fsize);
+        mr->hiwater(1, fsize, filedir);
     }
     delete [] filename;
 }
@@ -156,7 +166,7 @@ void KeyMultiValue::complete()
 
     if (fileflag) {
         write_page();
-        fclose(fp);
+        mr->aio->close(fp);
         fp = NULL;
     }
 
@@ -175,7 +185,7 @@ void KeyMultiValue::complete()
 
     if (fileflag) {
         fsize = pages[npage-1].fileoffset + pages[npage-1].filesize;
-        mr->hiwater(0, fsize);
+        mr->hiwater(0, fsize, filedir);
     }
 }
 
@@ -203,7 +213,11 @@ int KeyMultiValue::request_page(int ipage, int writeflag,
 {
     // load page from file if necessary
 
-    if (fileflag) read_page(ipage, writeflag);
+    if (fileflag) {
+        read_page(ipage, writeflag);
+        if (ipage < npage - 1)
+            mr->aio->prefetch(fp, pages[ipage+1].fileoffset, pages[ipage+1].filesize);
+    }
 
     keysize_page = pages[ipage].keysize;
     valuesize_page = pages[ipage].valuesize;
@@ -225,13 +239,27 @@ uint64_t KeyMultiValue::multivalue_blocks(int ipage, int &nblock)
 
 /* ----------------------------------------------------------------------
    write out a changed page of KMV data
+   a compressed page may change size, so it is moved to end of file
    called by MR::sort_multivalues()
 ------------------------------------------------------------------------- */
 
 void KeyMultiValue::overwrite_page(int ipage)
 {
     if (!fileflag) return;
-    write_page();
+
+    if (mr->compresslevel == 0 && pages[ipage].zipsize == 0) {
+        mr->aio->write(fp, pages[ipage].fileoffset, page, pages[ipage].filesize);
+        mr->wsize += pages[ipage].filesize;
+        return;
+    }
+
+    pages[ipage].fileoffset = fsize;
+    pages[ipage].filesize = mr->aio->write_page(fp, fsize, page,
+                                                pages[ipage].alignsize,
+                                                pages[ipage].zipsize);
+    mr->wsize += pages[ipage].filesize;
+    fsize += pages[ipage].filesize;
+    mr->hiwater(0, pages[ipage].filesize, filedir);
 }
 
 /* ----------------------------------------------------------------------
@@ -242,7 +270,7 @@ void KeyMultiValue::overwrite_page(int ipage)
 void KeyMultiValue::close_file()
 {
     if (fp) {
-        fclose(fp);
+        mr->aio->close(fp);
         fp = NULL;
     }
 }
@@ -316,17 +344,7 @@ void KeyMultiValue::clone(KeyValue *kv)
         ptr = page_kv;
 
         for (int i = 0; i < nkey_kv; i++) {
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
-
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key = ptr;
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            value = ptr;
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
+            ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
 
             add(key, keybytes, value, valuebytes);
         }
@@ -397,17 +415,8 @@ void KeyMultiValue::collapse_one(char *key, int keybytes, KeyValue *kv,
         ptr = page_kv;
 
         for (int i = 0; i < nkey_kv; i++) {
-            keybytes_kv = *((int *) ptr);
-            valuebytes_kv = *((int *)(ptr + sizeof(int)));;
-
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key_kv = ptr;
-            ptr += keybytes_kv;
-            ptr = ROUNDUP(ptr, valignm1);
-            value_kv = ptr;
-            ptr += valuebytes_kv;
-            ptr = ROUNDUP(ptr, talignm1);
+            ptr = mr->next_pair(ptr, key_kv, keybytes_kv,
+                                value_kv, valuebytes_kv);
 
             valuesizes[ivalue++] = keybytes_kv;
             memcpy(multivalue, key_kv, keybytes_kv);
@@ -455,11 +464,13 @@ void KeyMultiValue::convert(KeyValue *kv)
 
     // estimate = # of unique keys that can be stored in 2 pages of memunique
     // each unique key requires roughly:
-    //   1 Unique, 1 hash bucket, keyave bytes for the key itself
-    // set nbuckets to power of 2 just smaller than estimate
-    // also limit nbuckets to INTMAX+1 = 2^31
-    //   since are using 32-bit hash and want hashmask & ibucket to be ints
-    // set aside first portion of memunique for nbuckets
+    //   1 Unique, 1/MAXLOAD hash slots + tags, keyave bytes for the key itself
+    // set nslot so table is MAXLOAD full when estimate keys are stored
+    // also limit nslot to INTMAX+1 = 2^31
+    //   since are using 32-bit hash to index slots
+    // maxunique caps # of keys stored, even if keys are smaller than keyave
+    //   since open-addressing table cannot be allowed to fill up
+    // set aside first portion of memunique for slots and tags
     // remainder for Unique data structs + keys
 
     uint64_t uniquesize;
@@ -468,20 +479,18 @@ void KeyMultiValue::convert(KeyValue *kv)
 
     uint64_t n = MAX(kv->nkv, 1);
     double keyave = 1.0 * kv->ksize / n;
-    double oneave = keyave + sizeof(Unique) + sizeof(Unique *);
+    double oneave = keyave + sizeof(Unique) + (sizeof(Unique *) + 1) / MAXLOAD;
     uint64_t estimate = static_cast<uint64_t>(uniquesize / oneave);
     if (estimate == 0) error->one("Cannot hold any unique keys in memory");
 
-    uint64_t nbuckets = 1;
-    while (nbuckets <= estimate) nbuckets *= 2;
-    nbuckets /= 2;
-    nbuckets = MIN(nbuckets, INTMAX);
-    if (nbuckets == INTMAX) nbuckets++;
-    hashmask = nbuckets - 1;
+    nslot = static_cast<uint64_t>(estimate / MAXLOAD) + 1;
+    nslot = MIN(nslot, (uint64_t) INTMAX + 1);
+    maxunique = static_cast<int>(MAXLOAD * nslot);
+    if (maxunique == 0) error->one("Cannot hold any unique keys in memory");
 
-    buckets = (Unique **) memunique;
-    bucketbytes = nbuckets * sizeof(Unique *);
-    ustart = memunique + bucketbytes;
+    slots = (Unique **) memunique;
+    tags = (uint8_t *) (memunique + nslot * sizeof(Unique *));
+    ustart = ROUNDUP((char *) tags + nslot, ualignm1);
     ustop = memunique + uniquesize;
     ukeyoffset = sizeof(Unique);
 
@@ -603,12 +612,12 @@ void KeyMultiValue::convert(KeyValue *kv)
 
 void KeyMultiValue::kv2unique(int ipartition)
 {
-    int i, ispool, nkey_kv, keybytes, valuebytes, ibucket, pagecut, ncut;
+    int i, ispool, nkey_kv, keybytes, valuebytes, pagecut, ncut;
     int nnew, nbits, mask, shift;
-    uint64_t kdummy, vdummy, adummy, sizecut;
-    uint32_t ubucket;
-    char *ptr, *ptr_start, *key, *keyunique, *unext;
-    Unique *uptr, *uprev;
+    uint64_t kdummy, vdummy, adummy, sizecut, islot;
+    uint64_t ukey;
+    char *ptr, *ptr_start, *key, *value, *keyunique, *unext;
+    Unique *uptr;
     Spool *spextra;
     Spool **spools;
 
@@ -617,7 +626,7 @@ void KeyMultiValue::kv2unique(int ipartition)
 
     nunique = 0;
     unext = ustart;
-    memset(buckets, 0, bucketbytes);
+    memset(tags, 0, nslot);
 
     // loop over KV pairs in this partition
     // source of KV pairs is either full KV or a Spool, not both
@@ -639,20 +648,11 @@ void KeyMultiValue::kv2unique(int ipartition)
         ptr = page_kv;
 
         for (i = 0; i < nkey_kv; i++) {
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
-
             ptr_start = ptr;
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key = ptr;
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
-
-            ibucket = hash(key, keybytes);
-            uptr = find(ibucket, key, keybytes, uprev);
+            ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
+
+            ukey = hash(key, keybytes);
+            uptr = find(key, keybytes, ukey, islot);
             count++;
 
             // if key is already in unique list, increment counters
@@ -666,17 +666,17 @@ void KeyMultiValue::kv2unique(int ipartition)
             }
 
             // if space available, add key to unique list
+            // find() returned empty slot where key belongs
 
             uptr = (Unique *) unext;
             unext += ukeyoffset + keybytes;
             unext = ROUNDUP(unext, ualignm1);
 
-            if (unext <= ustop) {
-                if (uprev) uprev->next = uptr;
-                else buckets[ibucket] = uptr;
+            if (unext <= ustop && nunique < maxunique) {
+                slots[islot] = uptr;
+                tags[islot] = 0x80 | (ukey & 0x7f);
                 uptr->nvalue = 1;
                 uptr->mvbytes = valuebytes;
-                uptr->next = NULL;
                 uptr->keybytes = keybytes;
                 keyunique = ((char *) uptr) + ukeyoffset;
                 memcpy(keyunique, key, keybytes);
@@ -691,6 +691,7 @@ void KeyMultiValue::kv2unique(int ipartition)
             // nnew = next larger power-of-2, so can use hash bits to split
             // mask = bitmask on key hash to split into equal subsets
             // use nbits beyond sortbit of current partition
+            // split reuses the key hash already computed for find()
 
             if (full == 0) {
                 full = 1;
@@ -715,7 +716,7 @@ void KeyMultiValue::kv2unique(int ipartition)
 #endif
 
                 mask = nnew - 1;
-                shift = 32 - partitions[ipartition].sortbit - nbits;
+                shift = 32 + partitions[ipartition].sortbit;
 
                 spool_request(nnew, 1);
                 spextra = augment_partition(ipartition);
@@ -729,8 +730,7 @@ void KeyMultiValue::kv2unique(int ipartition)
 
             // add KV pair to appropriate partition
 
-            ubucket = hashlittle(key, keybytes, 0);
-            ispool = (ubucket >> shift) & mask;
+            ispool = (ukey >> shift) & mask;
             spools[ispool]->add(ptr - ptr_start, ptr_start);
         }
     }
@@ -1016,10 +1016,11 @@ void KeyMultiValue::unique2kmv_set(int iset)
 
 void KeyMultiValue::partition2sets(int ipartition)
 {
-    int i, nkey_kv, keybytes, valuebytes, ibucket, ispool;
+    int i, nkey_kv, keybytes, valuebytes, ispool;
     uint64_t kdummy, vdummy, adummy;
-    char *ptr, *ptr_start, *key;
-    Unique *uptr, *udummy;
+    char *ptr, *ptr_start, *key, *value;
+    uint64_t islot;
+    Unique *uptr;
 
     // destination Spools for all KV pairs in partition
 
@@ -1052,19 +1053,9 @@ void KeyMultiValue::partition2sets(int ipartition)
 
         for (i = 0; i < nkey_kv; i++) {
             ptr_start = ptr;
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
-
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key = ptr;
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
-
-            ibucket = hash(key, keybytes);
-            uptr = find(ibucket, key, keybytes, udummy);
+            ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
+
+            uptr = find(key, keybytes, hash(key, keybytes), islot);
             if (!uptr) error->one("Internal find error in partition2sets");
 
             ispool = uptr->set;
@@ -1100,11 +1091,12 @@ void KeyMultiValue::partition2sets(int ipartition)
 
 void KeyMultiValue::kv2kmv(int iset)
 {
-    int i, nkey_kv, keybytes, valuebytes, ibucket;
+    int i, nkey_kv, keybytes, valuebytes;
     uint64_t kdummy, vdummy, adummy;
     char *ptr, *key, *value, *multivalue;
     int *valuesizes;
-    Unique *uptr, *udummy;
+    uint64_t islot;
+    Unique *uptr;
 
     // loop over KV pairs in this set
     // source of KV pairs can be KV, KV + Spool, Spool, or Spool + Spool2
@@ -1130,20 +1122,9 @@ void KeyMultiValue::kv2kmv(int iset)
         ptr = page_kv;
 
         for (i = 0; i < nkey_kv; i++) {
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
-
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key = ptr;
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            value = ptr;
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
-
-            ibucket = hash(key, keybytes);
-            uptr = find(ibucket, key, keybytes, udummy);
+            ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
+
+            uptr = find(key, keybytes, hash(key, keybytes), islot);
             if (!uptr) error->one("Internal find error in kv2kmv");
             if (uptr->set != iset) error->one("Internal set error in kv2kmv");
 
@@ -1237,17 +1218,7 @@ void KeyMultiValue::kv2kmv_extended(int iset)
         ptr = page_kv;
 
         for (i = 0; i < nkey_kv; i++) {
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
-
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key = ptr;
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            value = ptr;
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
+            ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
 
             // if either half-page exceeded, pack two halves together, write page
             // use memmove() since target may overlap source
@@ -1358,43 +1329,73 @@ Spool *KeyMultiValue::create_partition(int ispool)
 }
 
 /* ----------------------------------------------------------------------
-   find a Unique in ibucket that matches key
-   return index of Unique
-   if cannot find key, return NULL
-   if bucket was empty, set prev = NULL
-   else set prev = ptr to last Unique in the bucket
+   find a Unique that matches key with hash value ukey
+   home slot and tag are from lo 32 bits of ukey
+   linear probe from home slot, only compare keys whose tag byte matches
+   4 and 8 byte keys are compared inline as integers
+   return ptr to Unique
+   if cannot find key, return NULL and set islot = empty slot for key
 ------------------------------------------------------------------------- */
 
-KeyMultiValue::Unique *KeyMultiValue::find(int ibucket, char *key,
-        int keybytes, Unique *&uprev)
+KeyMultiValue::Unique *KeyMultiValue::find(char *key, int keybytes,
+        uint64_t ukey, uint64_t &islot)
 {
-    Unique *uptr = buckets[ibucket];
-    if (!uptr) {
-        uprev = NULL;
-        return NULL;
-    }
+    uint8_t tag = 0x80 | (ukey & 0x7f);
+    uint64_t i = ((ukey & 0xffffffff) * nslot) >> 32;
+    Unique *uptr;
 
-    char *keyunique;
-    while (uptr) {
-        keyunique = ((char *) uptr) + ukeyoffset;
-        if (keybytes == uptr->keybytes && memcmp(key, keyunique, keybytes) == 0)
-            return uptr;
-        uprev = uptr;
-        uptr = uptr->next;
+    if (keybytes == sizeof(uint32_t)) {
+        uint32_t k, kunique;
+        memcpy(&k, key, sizeof(uint32_t));
+        while (tags[i]) {
+            if (tags[i] == tag) {
+                uptr = slots[i];
+                memcpy(&kunique, (char *) uptr + ukeyoffset, sizeof(uint32_t));
+                if (uptr->keybytes == keybytes && kunique == k) return uptr;
+            }
+            if (++i == nslot) i = 0;
+        }
+
+    } else if (keybytes == sizeof(uint64_t)) {
+        uint64_t k, kunique;
+        memcpy(&k, key, sizeof(uint64_t));
+        while (tags[i]) {
+            if (tags[i] == tag) {
+                uptr = slots[i];
+                memcpy(&kunique, (char *) uptr + ukeyoffset, sizeof(uint64_t));
+                if (uptr->keybytes == keybytes && kunique == k) return uptr;
+            }
+            if (++i == nslot) i = 0;
+        }
+
+    } else {
+        while (tags[i]) {
+            if (tags[i] == tag) {
+                uptr = slots[i];
+                if (uptr->keybytes == keybytes &&
+                        memcmp(key, (char *) uptr + ukeyoffset, keybytes) == 0)
+                    return uptr;
+            }
+            if (++i == nslot) i = 0;
+        }
     }
 
+    islot = i;
     return NULL;
 }
 
 /* ----------------------------------------------------------------------
-   hash a key to a bucket
+   hash a key for the unique key table and partition splits
+   user hash set by MapReduce::set_hash() or hashkey()
+   table uses lo 32 bits, splits use hi 32 bits from the lo end up,
+     aggregate() uses the hi end of the hi 32 bits to pick procs
+     so keys of a proc or a partition do not cluster in the table
 ------------------------------------------------------------------------- */
 
-int KeyMultiValue::hash(char *key, int keybytes)
+uint64_t KeyMultiValue::hash(char *key, int keybytes)
 {
-    uint32_t ubucket = hashlittle(key, keybytes, 0);
-    int ibucket = ubucket & hashmask;
-    return ibucket;
+    if (mr->apphash) return mr->apphash(key, keybytes);
+    return hashkey(key, keybytes);
 }
 
 /* ----------------------------------------------------------------------
@@ -1426,6 +1427,7 @@ void KeyMultiValue::create_page()
                              nvalue * sizeof(int) + keysize + valuesize;
     pages[npage].alignsize = alignsize;
     pages[npage].filesize = roundup(alignsize, ALIGNFILE);
+    pages[npage].zipsize = 0;
     pages[npage].nvalue_total = 0;
     pages[npage].nblock = 0;
 
@@ -1437,8 +1439,7 @@ void KeyMultiValue::create_page()
 }
 
 /* ----------------------------------------------------------------------
-   write in-memory page to disk
-   do a seek since may be overwriting an arbitrary page due to sort
+   write in-memory page to disk, compressed if MR compresslevel is set
 ------------------------------------------------------------------------- */
 
 void KeyMultiValue::write_page()
@@ -1451,8 +1452,9 @@ void KeyMultiValue::write_page()
     }
 
     uint64_t fileoffset = pages[npage].fileoffset;
-    fseek(fp, fileoffset, SEEK_SET);
-    fwrite(page, pages[npage].filesize, 1, fp);
+    pages[npage].filesize = mr->aio->write_page(fp, fileoffset, page,
+                                                pages[npage].alignsize,
+                                                pages[npage].zipsize);
     mr->wsize += pages[npage].filesize;
 }
 
@@ -1471,8 +1473,8 @@ void KeyMultiValue::read_page(int ipage, int writeflag)
     }
 
     uint64_t fileoffset = pages[ipage].fileoffset;
-    fseek(fp, fileoffset, SEEK_SET);
-    fread(page, pages[ipage].filesize, 1, fp);
+    mr->aio->read_page(fp, fileoffset, page, pagesize,
+                       pages[ipage].filesize, pages[ipage].zipsize);
     mr->rsize += pages[ipage].filesize;
 }
 
@@ -66,6 +66,9 @@ class KeyMultiValue {
   int talignm1,ualignm1;
   int twolenbytes;                   // size of key & value lengths
   int threelenbytes;                 // size of nvalue & key & value lengths
+  int kfixed,vfixed;                 // fixed sizes of KV pairs read, 0 if not
+  int vfixoffset;                    // offset of value in fixed-width KV pair
+  int fixbytes;                      // size of fixed-width KV pair
 
   // in-memory page
 
@@ -82,8 +85,9 @@ class KeyMultiValue {
     uint64_t valuesize;         // exact size of multivalues
     uint64_t exactsize;         // exact size of all data in page
     uint64_t alignsize;         // aligned size of all data in page
-    uint64_t filesize;          // rounded-up alignsize for file I/O
+    uint64_t filesize;          // rounded-up size of page in file
     uint64_t fileoffset;        // summed filesize of all previous pages
+    uint64_t zipsize;           // compressed size, 0 if uncompressed
     uint64_t nvalue_total;      // total # of values for multi-page KMV header
     int nkey;                   // # of KMV pairs
     int nblock;                 // # of value blocks for multi-page KMV header
@@ -102,17 +106,16 @@ class KeyMultiValue {
     uint64_t mvbytes;        // total size of values associated with this key
     int *soffset;            // ptr to start of value sizes in KMV page
     char *voffset;           // ptr to start of values in KMV page
-    Unique *next;            // ptr to next key in this hash bucket
     int keybytes;            // size of this key
     int set;                 // which KMV set this key will be part of
   };
 
-  // hash of unique keys
+  // open-addressing hash of unique keys, linear probing
 
-  Unique **buckets;     // ptr to 1st key in each hash bucket
-  int hashmask;         // bit mask for mapping hashed key into hash buckets
-                        // nbuckets = hashmask + 1
-  uint64_t bucketbytes; // byte size of hash buckets
+  Unique **slots;       // ptr to key stored in each slot
+  uint8_t *tags;        // 7 hash bits + high bit per slot, 0 if slot empty
+  uint64_t nslot;       // # of slots in table
+  int maxunique;        // max # of unique keys before table is too full
 
   char *memunique;      // ptr to where memory for hash+Uniques starts
   char *ustart;         // ptr to where memory for Uniques starts
@@ -122,6 +125,7 @@ class KeyMultiValue {
 
   int fileflag;         // 1 if file exists, 0 if not
   char *filename;       // filename to store KMV if needed
+  int filedir;          // MR fpath dir that holds the file
   FILE *fp;             // file ptr
 
   // partitions of KV data per unique list
@@ -130,7 +134,8 @@ class KeyMultiValue {
     class KeyValue *kv;      // primary KV storing pairs for this partition
     class Spool *sp;         // secondary Spool of pairs if re-partitioned
     class Spool *sp2;        // tertiary Spool of pairs if re-partitioned
-    int sortbit;             // bit from hi-end that partitioning was done on
+    int sortbit;             // bit from lo-end of hi 32 key hash bits
+                             //   that partitioning was done on
   };
 
   Partition *partitions;
@@ -179,8 +184,8 @@ class KeyMultiValue {
   class Spool *augment_partition(int);
   class Spool *create_partition(int);
   char *chunk_allocate();
-  Unique *find(int, char *, int, Unique *&);
-  int hash(char *, int);
+  Unique *find(char *, int, uint64_t, uint64_t &);
+  uint64_t hash(char *, int);
 
   void init_page();
   void create_page();
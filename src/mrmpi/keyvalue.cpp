@@ -18,7 +18,9 @@
 #include "stdint.h"
 #include "keyvalue.h"
 #include "mapreduce.h"
+#include "asyncio.h"
 #include "memory.h"
+#include "hash.h"
 #include "error.h"
 
 using namespace MAPREDUCE_NS;
@@ -31,6 +33,8 @@ using namespace MAPREDUCE_NS;
 #define ALIGNFILE 512              // same as in mapreduce.cpp
 #define PAGECHUNK 16
 #define INTMAX 0x7FFFFFFF
+#define MAXLOAD 0.75               // max fill fraction of combiner table
+#define SLOTFRAC 4                 // 1/SLOTFRAC of combiner page for slots
 
 enum {KVFILE, KMVFILE, SORTFILE, PARTFILE, SETFILE}; // same as in mapreduce.cpp
 
@@ -46,7 +50,7 @@ KeyValue::KeyValue(MapReduce *mr_caller, int memkalign, int memvalign,
     comm = comm_caller;
     MPI_Comm_rank(comm, &me);
 
-    filename = mr->file_create(KVFILE);
+    filename = mr->file_create(KVFILE, filedir);
     fileflag = 0;
     fp = NULL;
 
@@ -66,8 +70,19 @@ KeyValue::KeyValue(MapReduce *mr_caller, int memkalign, int memvalign,
 
     twolenbytes = 2 * sizeof(int);
 
+    // fixed-width pair layout was set by MR::allocate()
+
+    kfixed = mr->kfixed;
+    vfixed = mr->vfixed;
+    vfixoffset = mr->vfixoffset;
+    fixbytes = mr->fixbytes;
+
     nkv = ksize = vsize = esize = fsize = 0;
     init_page();
+
+    parent = NULL;
+    parentlock = NULL;
+    combiner = NULL;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -75,9 +90,10 @@ KeyValue::KeyValue(MapReduce *mr_caller, int memkalign, int memvalign,
 KeyValue::~KeyValue()
 {
     memory->sfree(pages);
+    if (fp) mr->aio->close(fp);
     if (fileflag) {
         remove(filename);
-        mr->hiwater(1, fsize);
+        mr->hiwater(1, fsize, filedir);
     }
     delete [] filename;
 }
@@ -113,7 +129,8 @@ void KeyValue::truncate(int pagecut, int ncut, uint64_t sizecut)
     else {
         npage = pagecut + 1;
         pages[pagecut].alignsize = sizecut;
-        pages[pagecut].filesize = roundup(sizecut, ALIGNFILE);
+        if (pages[pagecut].zipsize == 0)
+            pages[pagecut].filesize = roundup(sizecut, ALIGNFILE);
         pages[pagecut].nkey = ncut;
     }
 }
@@ -168,7 +185,7 @@ void KeyValue::append()
 
     if (fileflag) {
         read_page(ipage, 1);
-        mr->hiwater(1, fsize);
+        mr->hiwater(1, fsize, filedir);
     }
 
     // set in-memory settings from virtual page settings
@@ -196,7 +213,7 @@ void KeyValue::complete()
 
     if (fileflag) {
         write_page();
-        fclose(fp);
+        mr->aio->close(fp);
         fp = NULL;
     }
 
@@ -215,7 +232,7 @@ void KeyValue::complete()
 
     if (fileflag) {
         fsize = pages[npage-1].fileoffset + pages[npage-1].filesize;
-        mr->hiwater(0, fsize);
+        mr->hiwater(0, fsize, filedir);
     }
 
     // msize is max across all procs, for entire KV
@@ -259,12 +276,14 @@ int KeyValue::request_page(int ipage, uint64_t &keysize_page,
 
     if (fileflag) read_page(ipage, 0);
 
-    // close file if last page
+    // close file if last page, else prefetch next page
 
     if (ipage == npage - 1 && fileflag) {
-        fclose(fp);
+        mr->aio->close(fp);
         fp = NULL;
     }
+    else if (fileflag)
+        mr->aio->prefetch(fp, pages[ipage+1].fileoffset, pages[ipage+1].filesize);
 
     keysize_page = pages[ipage].keysize;
     valuesize_page = pages[ipage].valuesize;
@@ -280,13 +299,13 @@ int KeyValue::request_page(int ipage, uint64_t &keysize_page,
 
 void KeyValue::add(char *key, int keybytes, char *value, int valuebytes)
 {
+    if (kfixed && (keybytes != kfixed || valuebytes != vfixed))
+        error->one("Key/value pair does not match fixed key/value sizes");
+    if (combiner && combine(key, keybytes, value, valuebytes)) return;
+
     char *iptr = &page[alignsize];
-    char *kptr = iptr + twolenbytes;
-    kptr = ROUNDUP(kptr, kalignm1);
-    char *vptr = kptr + keybytes;
-    vptr = ROUNDUP(vptr, valignm1);
-    char *nptr = vptr + valuebytes;
-    nptr = ROUNDUP(nptr, talignm1);
+    char *kptr, *vptr;
+    char *nptr = mr->place_pair(iptr, keybytes, valuebytes, kptr, vptr);
     int kvbytes = nptr - iptr;
 
     // size of KV pair cannot exceed int size
@@ -303,16 +322,15 @@ void KeyValue::add(char *key, int keybytes, char *value, int valuebytes)
             error->one("Single key/value pair exceeds page size");
         }
 
-        create_page();
-        write_page();
-        npage++;
-        init_page();
+        flush_page();
         add(key, keybytes, value, valuebytes);
         return;
     }
 
-    *((int *) iptr) = keybytes;
-    *((int *)(iptr + sizeof(int))) = valuebytes;
+    if (!kfixed) {
+        *((int *) iptr) = keybytes;
+        *((int *)(iptr + sizeof(int))) = valuebytes;
+    }
     memcpy(kptr, key, keybytes);
     memcpy(vptr, value, valuebytes);
 
@@ -370,10 +388,7 @@ void KeyValue::add(KeyValue *kv)
 {
     if (kv == this) error->all("Cannot perform KeyValue add on self");
 
-    int kalign_other = kv->kalign;
-    int valign_other = kv->valign;
-
-    // which add() to call depends on same or different alignment
+    // which add() to call depends on same or different layout
 
     int nkey_other;
     uint64_t keysize_other, valuesize_other, alignsize_other;
@@ -384,10 +399,11 @@ void KeyValue::add(KeyValue *kv)
     for (int ipage = 0; ipage < npage_other; ipage++) {
         nkey_other = kv->request_page(ipage, keysize_other, valuesize_other,
                                       alignsize_other);
-        if (kalign == kalign_other && valign == valign_other)
+        if (kalign == kv->kalign && valign == kv->valign &&
+                kfixed == kv->kfixed && vfixed == kv->vfixed)
             add(nkey_other, page_other, keysize_other, valuesize_other, alignsize_other);
         else
-            add(nkey_other, page_other, kalign_other, valign_other);
+            add(nkey_other, page_other, kv);
     }
 
     msize = MAX(msize, kv->msize);
@@ -404,24 +420,22 @@ void KeyValue::add(KeyValue *kv)
 void KeyValue::add(int n, char *buf)
 {
     int keybytes, valuebytes;
+    char *key, *value;
+
+    if (kfixed) {
+        add(n, buf, (uint64_t) n * kfixed, (uint64_t) n * vfixed,
+            (uint64_t) n * fixbytes);
+        return;
+    }
 
     uint64_t keysize_buf = 0;
     uint64_t valuesize_buf = 0;
     char *ptr = buf;
 
     for (int i = 0; i < n; i++) {
-        keybytes = *((int *) ptr);
-        valuebytes = *((int *)(ptr + sizeof(int)));;
-
+        ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
         keysize_buf += keybytes;
         valuesize_buf += valuebytes;
-
-        ptr += twolenbytes;
-        ptr = ROUNDUP(ptr, kalignm1);
-        ptr += keybytes;
-        ptr = ROUNDUP(ptr, valignm1);
-        ptr += valuebytes;
-        ptr = ROUNDUP(ptr, talignm1);
     }
 
     uint64_t alignsize_buf = ptr - buf;
@@ -433,18 +447,14 @@ void KeyValue::add(int n, char *buf)
    determine 2 sizes and call add() with sizes
    input buf should never be own in-memory page
    input buf has same alignment as me
-   called by MR::merge()
+   called by MR::merge_runs()
 ------------------------------------------------------------------------- */
 
 void KeyValue::add(char *ptr)
 {
-    int keybytes = *((int *) ptr);
-    int valuebytes = *((int *)(ptr + sizeof(int)));;
-    ptr += twolenbytes;
-    ptr = ROUNDUP(ptr, kalignm1);
-    char *key = ptr;
-    ptr += keybytes;
-    char *value = ROUNDUP(ptr, valignm1);
+    int keybytes, valuebytes;
+    char *key, *value;
+    mr->next_pair(ptr, key, keybytes, value, valuebytes);
     add(key, keybytes, value, valuebytes);
 }
 
@@ -461,7 +471,7 @@ void KeyValue::add(int n, char *buf,
 {
     int nkeychunk, keybytes, valuebytes, kvbytes;
     uint64_t keychunk, valuechunk, chunksize;
-    char *ptr, *ptr_begin, *ptr_end, *ptr_start;
+    char *ptr, *ptr_begin, *ptr_end, *ptr_start, *key, *value;
 
     // break data into chunks that fit into current and successive pages
     // full page = pagesize exceeded or INTMAX KV pairs
@@ -476,17 +486,20 @@ void KeyValue::add(int n, char *buf,
         nkeychunk = 0;
         keychunk = valuechunk = 0;
 
-        while (1) {
+        // fixed-width pairs: breakpoint is # of whole pairs that fit
+
+        if (kfixed) {
+            uint64_t nfit = (pagesize - alignsize) / fixbytes;
+            nkeychunk = MIN(nfit, (uint64_t) nlimit);
+            keychunk = (uint64_t) nkeychunk * kfixed;
+            valuechunk = (uint64_t) nkeychunk * vfixed;
+            ptr_start = ptr + (uint64_t) nkeychunk * fixbytes;
+            kvbytes = fixbytes;
+        }
+
+        while (!kfixed) {
             ptr_start = ptr;
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
-
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
+            ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
             kvbytes = ptr - ptr_start;
 
             if (ptr > ptr_end) break;
@@ -511,10 +524,7 @@ void KeyValue::add(int n, char *buf,
         valuesize += valuechunk;
         alignsize += chunksize;
 
-        create_page();
-        write_page();
-        npage++;
-        init_page();
+        flush_page();
 
         n -= nkeychunk;
         keysize_buf -= keychunk;
@@ -536,41 +546,213 @@ void KeyValue::add(int n, char *buf,
 /* ----------------------------------------------------------------------
    add N KV pairs from another buffer with specified sizes
    input buf should never be own in-memory page
-   input buf has different alignment from me so must add one by one
+   input buf has layout of kvbuf, which has different alignment
+     or fixed sizes from me, so must add one by one
    called by add(kv)
 ------------------------------------------------------------------------- */
 
-void KeyValue::add(int n, char *buf, int kalign_buf, int valign_buf)
+void KeyValue::add(int n, char *buf, KeyValue *kvbuf)
 {
     int keybytes, valuebytes;
     char *key, *value;
 
-    int talign_buf = MAX(kalign_buf, valign_buf);
-    talign_buf = MAX(talign_buf, sizeof(int));
-
-    int kalignm1_buf = kalign_buf - 1;
-    int valignm1_buf = valign_buf - 1;
-    int talignm1_buf = talign_buf - 1;
-
+    MapReduce *mr_buf = kvbuf->mr;
     char *ptr = buf;
 
     for (int i = 0; i < n; i++) {
-        keybytes = *((int *) ptr);
-        valuebytes = *((int *)(ptr + sizeof(int)));;
-
-        ptr += twolenbytes;
-        ptr = ROUNDUP(ptr, kalignm1_buf);
-        key = ptr;
-        ptr += keybytes;
-        ptr = ROUNDUP(ptr, valignm1_buf);
-        value = ptr;
-        ptr += valuebytes;
-        ptr = ROUNDUP(ptr, talignm1_buf);
-
+        ptr = mr_buf->next_pair(ptr, key, keybytes, value, valuebytes);
         add(key, keybytes, value, valuebytes);
     }
 }
 
+/* ----------------------------------------------------------------------
+   start folding added pairs into a combiner table held in memblock
+   appcombine(key,keybytes,value,valuebytes,value2,valuebytes2,appptr)
+     folds value2 into value in place, value length does not change
+   called by MR::map() and MR::open() when a combiner is set
+------------------------------------------------------------------------- */
+
+void KeyValue::combine_start(void (*appcombine)(char *, int, char *, int,
+                                                char *, int, void *),
+                             void *appptr, uint64_t memsize, char *memblock)
+{
+    // first 1/SLOTFRAC of memblock is slots and tags, rest is stored pairs
+    // limit ncslot to INTMAX+1 = 2^31 since 32-bit hash indexes slots
+
+    ncslot = memsize / SLOTFRAC / (sizeof(char *) + 1);
+    ncslot = MIN(ncslot, (uint64_t) INTMAX + 1);
+    maxcombine = static_cast<int>(MAXLOAD * ncslot);
+    if (maxcombine == 0) error->one("Combiner page is too small");
+
+    cslots = (char **) memblock;
+    ctags = (uint8_t *) (memblock + ncslot * sizeof(char *));
+    cstart = ROUNDUP((char *) ctags + ncslot, talignm1);
+    cstop = memblock + memsize;
+
+    combiner = appcombine;
+    combineptr = appptr;
+    ncombine = 0;
+    cnext = cstart;
+    ckeysize = cvaluesize = 0;
+    cmsize = 0;
+    memset(ctags, 0, ncslot);
+}
+
+/* ----------------------------------------------------------------------
+   flush combiner table to KV and stop combining
+   called by MR::map() and MR::close() before complete()
+------------------------------------------------------------------------- */
+
+void KeyValue::combine_stop()
+{
+    combine_flush();
+    combiner = NULL;
+}
+
+/* ----------------------------------------------------------------------
+   fold a pair into the combiner table
+   if key with same value length is stored, call combiner on the 2 values
+   else store a copy of the pair, flushing the table first if it is full
+   return 1 if pair was taken, 0 if too big for table so caller adds it
+------------------------------------------------------------------------- */
+
+int KeyValue::combine(char *key, int keybytes, char *value, int valuebytes)
+{
+    uint32_t ukey;
+    if (mr->apphash) ukey = mr->apphash(key, keybytes);
+    else ukey = hashkey(key, keybytes);
+
+    uint8_t tag = 0x80 | (ukey & 0x7f);
+    uint64_t i = ((uint64_t) ukey * ncslot) >> 32;
+    char *iptr, *kptr, *vptr;
+
+    while (ctags[i]) {
+        if (ctags[i] == tag) {
+            iptr = cslots[i];
+            if (kfixed || (*((int *) iptr) == keybytes &&
+                           *((int *)(iptr + sizeof(int))) == valuebytes)) {
+                mr->place_pair(iptr, keybytes, valuebytes, kptr, vptr);
+                if (memcmp(kptr, key, keybytes) == 0) {
+                    combiner(kptr, keybytes, vptr, valuebytes,
+                             value, valuebytes, combineptr);
+                    return 1;
+                }
+            }
+        }
+        if (++i == ncslot) i = 0;
+    }
+
+    // new key, store it in empty slot i
+    // if table is full, flush it and re-insert into empty table
+
+    iptr = cnext;
+    char *nptr = mr->place_pair(iptr, keybytes, valuebytes, kptr, vptr);
+    int kvbytes = nptr - iptr;
+
+    if (ncombine == maxcombine || nptr > cstop) {
+        if (cstart + kvbytes > cstop) return 0;
+        combine_flush();
+        return combine(key, keybytes, value, valuebytes);
+    }
+
+    if (!kfixed) {
+        *((int *) iptr) = keybytes;
+        *((int *)(iptr + sizeof(int))) = valuebytes;
+    }
+    memcpy(kptr, key, keybytes);
+    memcpy(vptr, value, valuebytes);
+
+    cslots[i] = iptr;
+    ctags[i] = tag;
+    ncombine++;
+    cnext = nptr;
+    ckeysize += keybytes;
+    cvaluesize += valuebytes;
+    cmsize = MAX(cmsize, kvbytes);
+    return 1;
+}
+
+/* ----------------------------------------------------------------------
+   add all pairs in combiner table to KV and empty the table
+------------------------------------------------------------------------- */
+
+void KeyValue::combine_flush()
+{
+    if (ncombine) {
+        add(ncombine, cstart, ckeysize, cvaluesize, cnext - cstart);
+        msize = MAX(msize, cmsize);
+        memset(ctags, 0, ncslot);
+    }
+
+    ncombine = 0;
+    cnext = cstart;
+    ckeysize = cvaluesize = 0;
+    cmsize = 0;
+}
+
+/* ----------------------------------------------------------------------
+   move in-memory page of a thread-private KV into me
+   kvsrc is left with an empty in-memory page
+   if my page has room, copy kvsrc page into it, so partial pages at end
+     of a threaded map() do not each become a page on disk
+   else write my page to disk and swap page buffers with kvsrc, no copy
+   called by flush_page() of kvsrc and by MR::map_threads()
+------------------------------------------------------------------------- */
+
+void KeyValue::splice(KeyValue *kvsrc)
+{
+    if (kvsrc->nkey == 0) return;
+
+    if (nkey && alignsize + kvsrc->alignsize <= pagesize &&
+            (uint64_t) nkey + kvsrc->nkey <= INTMAX) {
+        add(kvsrc->nkey, kvsrc->page, kvsrc->keysize, kvsrc->valuesize,
+            kvsrc->alignsize);
+        msize = MAX(msize, kvsrc->msize);
+        kvsrc->init_page();
+        return;
+    }
+
+    if (nkey) {
+        create_page();
+        write_page();
+        npage++;
+    }
+
+    char *page_hold = page;
+    int memtag_hold = memtag;
+    page = kvsrc->page;
+    memtag = kvsrc->memtag;
+    kvsrc->page = page_hold;
+    kvsrc->memtag = memtag_hold;
+
+    nkey = kvsrc->nkey;
+    keysize = kvsrc->keysize;
+    valuesize = kvsrc->valuesize;
+    alignsize = kvsrc->alignsize;
+    msize = MAX(msize, kvsrc->msize);
+    kvsrc->init_page();
+}
+
+/* ----------------------------------------------------------------------
+   in-memory page is full, write it to disk and start a new one
+   a thread-private KV instead splices its page into its parent KV
+------------------------------------------------------------------------- */
+
+void KeyValue::flush_page()
+{
+    if (parent) {
+        pthread_mutex_lock(parentlock);
+        parent->splice(this);
+        pthread_mutex_unlock(parentlock);
+        return;
+    }
+
+    create_page();
+    write_page();
+    npage++;
+    init_page();
+}
+
 /* ----------------------------------------------------------------------
    create virtual page entry for in-memory page
 ------------------------------------------------------------------------- */
@@ -597,10 +779,12 @@ void KeyValue::create_page()
     pages[npage].nkey = nkey;
     pages[npage].keysize = keysize;
     pages[npage].valuesize = valuesize;
-    pages[npage].exactsize = ((uint64_t) nkey) * twolenbytes +
-                             keysize + valuesize;
+    if (kfixed) pages[npage].exactsize = keysize + valuesize;
+    else pages[npage].exactsize = ((uint64_t) nkey) * twolenbytes +
+                                  keysize + valuesize;
     pages[npage].alignsize = alignsize;
     pages[npage].filesize = roundup(alignsize, ALIGNFILE);
+    pages[npage].zipsize = 0;
 
     if (npage)
         pages[npage].fileoffset =
@@ -610,7 +794,7 @@ void KeyValue::create_page()
 }
 
 /* ----------------------------------------------------------------------
-   write in-memory page to disk
+   write in-memory page to disk, compressed if MR compresslevel is set
    do a seek since may be overwriting an arbitrary page due to append
 ------------------------------------------------------------------------- */
 
@@ -627,8 +811,9 @@ void KeyValue::write_page()
     }
 
     uint64_t fileoffset = pages[npage].fileoffset;
-    fseek(fp, fileoffset, SEEK_SET);
-    fwrite(page, pages[npage].filesize, 1, fp);
+    pages[npage].filesize = mr->aio->write_page(fp, fileoffset, page,
+                                                pages[npage].alignsize,
+                                                pages[npage].zipsize);
     mr->wsize += pages[npage].filesize;
 }
 
@@ -646,8 +831,8 @@ void KeyValue::read_page(int ipage, int writeflag)
     }
 
     uint64_t fileoffset = pages[ipage].fileoffset;
-    fseek(fp, fileoffset, SEEK_SET);
-    fread(page, pages[ipage].filesize, 1, fp);
+    mr->aio->read_page(fp, fileoffset, page, pagesize,
+                       pages[ipage].filesize, pages[ipage].zipsize);
     mr->rsize += pages[ipage].filesize;
 }
 
@@ -670,7 +855,7 @@ void KeyValue::print(int nstride, int kflag, int vflag)
 {
     int keybytes, valuebytes;
     uint64_t dummy1, dummy2, dummy3;
-    char *ptr, *key, *value, *ptr_start;
+    char *ptr, *key, *value;
 
     int istride = 0;
 
@@ -678,18 +863,7 @@ void KeyValue::print(int nstride, int kflag, int vflag)
         nkey = request_page(ipage, dummy1, dummy2, dummy3);
         ptr = page;
         for (int i = 0; i < nkey; i++) {
-            ptr_start = ptr;
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
-
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key = ptr;
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            value = ptr;
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
+            ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
 
             istride++;
             if (istride != nstride) continue;
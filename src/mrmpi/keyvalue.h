@@ -17,11 +17,15 @@
 #include "mpi.h"
 #include "stdio.h"
 #include "stdint.h"
+#include "pthread.h"
 
 namespace MAPREDUCE_NS {
 
+template <class K, class V> class TypedMapReduce;
+
 class KeyValue {
   friend class MapReduce;
+  template <class K, class V> friend class TypedMapReduce;
 
  public:
   uint64_t nkv;                   // # of KV pairs in entire KV on this proc
@@ -53,6 +57,10 @@ class KeyValue {
   void add(int, char *, int, char *, int);
   void add(int, char *, int *, char *, int *);
 
+  void combine_start(void (*)(char *, int, char *, int, char *, int, void *),
+                     void *, uint64_t, char *);
+  void combine_stop();
+
   void print(int, int, int);
   
 
@@ -69,6 +77,12 @@ class KeyValue {
   int kalignm1,valignm1,talignm1;   // alignments-1 for masking
   int twolenbytes;                  // size of single key,value lengths
 
+  // fixed-width pairs, no lengths stored, pair I is at I*fixbytes in page
+
+  int kfixed,vfixed;                // key & value sizes, 0 if variable-width
+  int vfixoffset;                   // offset of value within pair
+  int fixbytes;                     // size of one pair
+
   // in-memory page
 
   int nkey;                         // # of KV pairs in page
@@ -83,8 +97,9 @@ class KeyValue {
     uint64_t valuesize;             // exact size of values
     uint64_t exactsize;             // exact size of all data in page
     uint64_t alignsize;             // aligned size of all data in page
-    uint64_t filesize;              // rounded-up alignsize for file I/O
+    uint64_t filesize;              // rounded-up size of page in file
     uint64_t fileoffset;            // summed filesize of all previous pages
+    uint64_t zipsize;               // compressed size, 0 if uncompressed
     int nkey;                       // # of KV pairs
   };
 
@@ -94,18 +109,41 @@ class KeyValue {
   // file info
 
   char *filename;                   // filename to store KV if needed
+  int filedir;                      // MR fpath dir that holds the file
   FILE *fp;                         // file ptr
   int fileflag;                     // 1 if file exists, 0 if not
 
+  // thread-private KV in threaded map(), full pages are spliced into parent
+
+  KeyValue *parent;                 // KV receiving my pages, NULL if none
+  pthread_mutex_t *parentlock;      // serializes splices into parent
+
+  // map-side combiner table, active between combine_start() and stop()
+  // pairs are stored in KV page layout, hashed by key with linear probing
+
+  void (*combiner)(char *, int, char *, int, char *, int, void *);
+  void *combineptr;                 // user data ptr passed to combiner
+  char **cslots;                    // ptr to pair stored in each slot
+  uint8_t *ctags;                   // 7 hash bits + high bit, 0 if empty
+  uint64_t ncslot;                  // # of slots in table
+  int ncombine,maxcombine;          // # of pairs in table, max before flush
+  char *cstart,*cnext,*cstop;       // stored pairs, next free byte, end
+  uint64_t ckeysize,cvaluesize;     // exact size of key & value data in table
+  int cmsize;                       // size of largest pair in table
+
   // private methods
 
   void add(KeyValue *);
   void add(int, char *);
   void add(char *);
   void add(int, char *, uint64_t, uint64_t, uint64_t);
-  void add(int, char *, int, int);
+  void add(int, char *, KeyValue *);
+  int combine(char *, int, char *, int);
+  void combine_flush();
+  void splice(KeyValue *);
 
   void init_page();
+  void flush_page();
   void create_page();
   void write_page();
   void read_page(int, int);
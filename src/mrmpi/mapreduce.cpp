@@ -17,12 +17,15 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "stdint.h"
+#include "math.h"
 #include "sys/types.h"
 #include "sys/stat.h"
+#include "sys/statvfs.h"
 #include "mapreduce.h"
 #include "keyvalue.h"
 #include "keymultivalue.h"
 #include "spool.h"
+#include "asyncio.h"
 #include "irregular.h"
 #include "hash.h"
 #include "memory.h"
@@ -38,6 +41,7 @@ int MapReduce::instances_ever = 0;
 int MapReduce::mpi_finalize_flag = 0;
 uint64_t MapReduce::rsize = 0;
 uint64_t MapReduce::wsize = 0;
+double MapReduce::iostall = 0.0;
 uint64_t MapReduce::cssize = 0;
 uint64_t MapReduce::crsize = 0;
 double MapReduce::commtime = 0.0;
@@ -59,6 +63,12 @@ int compare_standalone(const void *, const void *);
 #define MBYTES 64
 #define ALIGNKV 4
 #define INTMAX 0x7FFFFFFF
+#define MERGEBUF 262144     // min bytes of read buffer per run in sort merge
+#define MAXMERGE 256        // max # of runs merged at once, each has open file
+#define SAMPLES 256         // avg # of keys sampled per proc in global sort
+#define CHUNKFRAC 4         // mapstyle 2 chunk = 1/CHUNKFRAC of even share of tasks left
+#define BCASTCHUNK 4194304  // max bytes per chunk of broadcast() thru shared memory
+#define NRUNCLASS 64        // same as size of runhead in mapreduce.h
 
 enum {KVFILE, KMVFILE, SORTFILE, PARTFILE, SETFILE};
 
@@ -80,6 +90,30 @@ MapReduce::MapReduce(MPI_Comm caller)
     defaults();
 }
 
+/* ----------------------------------------------------------------------
+   construct using caller's MPI communicator, with fixed-width KV pairs
+   every KV pair has a keybytes key and a valuebytes value
+   KV pages then store pairs densely with no lengths, indexed by arithmetic
+------------------------------------------------------------------------- */
+
+MapReduce::MapReduce(MPI_Comm caller, int keybytes, int valuebytes)
+{
+    instances_now++;
+    instances_ever++;
+    instance_me = instances_ever;
+
+    comm = caller;
+    MPI_Comm_rank(comm, &me);
+    MPI_Comm_size(comm, &nprocs);
+
+    defaults();
+
+    if (keybytes <= 0 || valuebytes < 0)
+        error->all("Invalid fixed key/value sizes");
+    kfixed = keybytes;
+    vfixed = valuebytes;
+}
+
 /* ----------------------------------------------------------------------
    construct without MPI communicator, use MPI_COMM_WORLD
    perform MPI_Init() if not already initialized
@@ -144,21 +178,49 @@ MapReduce::MapReduce(double dummy)
 
 MapReduce::~MapReduce()
 {
-    delete [] fpath;
+    // stats query the page allocator, so print them before it is freed
+
+    if (verbosity) mr_stats(verbosity);
 
     for (int i = 0; i < npage; i++)
-        if (memcount[i]) memory->sfree(memptr[i]);
+        if (memcount[i]) 
+            memory->sfree_page(memptr[i], memcount[i] * pagesize, hugeflag);
     memory->sfree(memptr);
     memory->sfree(memused);
     memory->sfree(memcount);
+    memory->sfree(freebits);
+    memory->sfree(linkbits);
+    memory->sfree(runlen);
+    memory->sfree(runnext);
+    memory->sfree(runprev);
 
-    delete memory;
-    delete error;
     delete kv;
     delete kmv;
+    delete aio;
+    delete irregular;
+
+    // skip MPI calls if app already finalized MPI
+
+    int finalized;
+    MPI_Finalized(&finalized);
+    if (!finalized) {
+        if (nodecomm != MPI_COMM_NULL) MPI_Comm_free(&nodecomm);
+        if (leadercomm != MPI_COMM_NULL) MPI_Comm_free(&leadercomm);
+    }
+
+    pthread_mutex_destroy(&tasklock);
+    pthread_mutex_destroy(&splicelock);
+
+    // KV and KMV destructors update fdirs sizes when removing their files
+
+    delete [] fpath;
+    for (int i = 0; i < nfdir; i++) delete [] fdirs[i].path;
+    memory->sfree(fdirs);
+
+    delete memory;
+    delete error;
 
     instances_now--;
-    if (verbosity) mr_stats(verbosity);
     if (instances_now == 0 && verbosity) cummulative_stats(verbosity, 1);
     if (mpi_finalize_flag && instances_now == 0) MPI_Finalize();
 }
@@ -173,6 +235,8 @@ void MapReduce::defaults()
     error = new Error(comm);
 
     mapstyle = 0;
+    mapthreads = 1;
+    mapmaster = 0;
     all2all = 1;
     verbosity = 0;
     timer = 0;
@@ -186,6 +250,10 @@ void MapReduce::defaults()
     minpage = 0;
     maxpage = 0;
     keyalign = valuealign = ALIGNKV;
+    hugepage = 1;
+    zeropage = 0;
+    iobuf = 2;
+    compresslevel = 0;
 
 #ifdef MRMPI_FPATH
 #define _QUOTEME(x) #x
@@ -198,24 +266,56 @@ void MapReduce::defaults()
     fpath = new char[2];
     strcpy(fpath, ".");
 #endif
+    fpathstyle = 0;
+    appcombine = NULL;
+    appcombineptr = NULL;
+    combinetag = -1;
+    apphash = NULL;
+    appproc = NULL;
+    pthread_mutex_init(&tasklock, NULL);
+    pthread_mutex_init(&splicelock, NULL);
+    sortflag = 0;
+    sortobj = NULL;
+    sortorder = NULL;
+    nsplit = 0;
+    splitbuf = NULL;
+    splitlen = NULL;
+    splitptr = NULL;
+    splitrank = NULL;
+    fdirs = NULL;
+    nfdir = ntier = 0;
+    fpath_parse();
 
     collateflag = 0;
     fcounter_kv = fcounter_kmv = fcounter_sort =
                                      fcounter_part = fcounter_set = 0;
 
     twolenbytes = 2 * sizeof(int);
+    kfixed = vfixed = 0;
+    vfixoffset = fixbytes = 0;
     kmv_block_valid = 0;
 
     allocated = 0;
     memptr = NULL;
     memused = NULL;
     memcount = NULL;
+    freebits = NULL;
+    linkbits = NULL;
+    nmapword = 0;
+    nfree = npeak = nfailcontig = 0;
+    runlen = runnext = runprev = NULL;
+    for (int i = 0; i < NRUNCLASS; i++) runhead[i] = -1;
+    runmask = 0;
     npage = 0;
+    hugeflag = 0;
     fsize = 0;
     fsizemax = 0;
 
     kv = NULL;
     kmv = NULL;
+    aio = NULL;
+    irregular = NULL;
+    nodecomm = leadercomm = MPI_COMM_NULL;
 
     if (sizeof(uint64_t) != 8 || sizeof(char *) != 8)
         error->all("Not compiled for 8-byte integers and pointers");
@@ -236,15 +336,23 @@ MapReduce *MapReduce::copy()
     if (timer) start_timer();
     if (verbosity) file_stats(0);
 
-    MapReduce *mrnew = new MapReduce(comm);
+    MapReduce *mrnew;
+    if (kfixed) mrnew = new MapReduce(comm, kfixed, vfixed);
+    else mrnew = new MapReduce(comm);
 
     mrnew->mapstyle = mapstyle;
+    mrnew->mapthreads = mapthreads;
+    mrnew->mapmaster = mapmaster;
     mrnew->all2all = all2all;
     mrnew->verbosity = verbosity;
     mrnew->timer = timer;
     mrnew->memsize = memsize;
     mrnew->minpage = minpage;
     mrnew->maxpage = maxpage;
+    mrnew->hugepage = hugepage;
+    mrnew->zeropage = zeropage;
+    mrnew->iobuf = iobuf;
+    mrnew->compresslevel = compresslevel;
 
     if (allocated) {
         mrnew->keyalign = kalign;
@@ -255,10 +363,10 @@ MapReduce *MapReduce::copy()
         mrnew->valuealign = valuealign;
     }
 
-    delete [] mrnew->fpath;
-    int n = strlen(fpath) + 1;
-    mrnew->fpath = new char[n];
-    strcpy(mrnew->fpath, fpath);
+    mrnew->set_fpath(fpath);
+    mrnew->fpathstyle = fpathstyle;
+    mrnew->set_combiner(appcombine, appcombineptr);
+    mrnew->set_hash(apphash);
 
     if (kv) mrnew->copy_kv(kv);
     if (kmv) mrnew->copy_kmv(kmv);
@@ -341,15 +449,18 @@ uint64_t MapReduce::add(MapReduce *mr)
 
 uint64_t MapReduce::aggregate(int (*hash)(char *, int))
 {
-    int i, nkey_send, keybytes, valuebytes, nkey_recv;
-    int start, stop, done, mydone;
-    int memtag_cdpage, memtag_epage, memtag_fpage, memtag_gpage;
-    uint64_t dummy, dummy1, dummy2, dummy3;
-    double timestart, fraction, minfrac;
-    char *ptr, *key;
-    int *proclist, *kvsizes, *reorder;
-    char **kvptrs;
+    appproc = hash;
+    if (hash) return aggregate(&app_proc, this);
+    return aggregate(NULL, NULL);
+}
+
+/* ----------------------------------------------------------------------
+   aggregate with hash(key,keybytes,hashptr) returning proc of each key
+   hashptr = user data ptr passed to hash, e.g. a function object
+------------------------------------------------------------------------- */
 
+uint64_t MapReduce::aggregate(int (*hash)(char *, int, void *), void *hashptr)
+{
     if (kv == NULL) error->all("Cannot aggregate without KeyValue");
     if (timer) start_timer();
     if (verbosity) file_stats(0);
@@ -359,16 +470,60 @@ uint64_t MapReduce::aggregate(int (*hash)(char *, int))
         return kv->nkv;
     }
 
+    aggregate_kv(hash, hashptr);
+
+    stats("Aggregate", 0);
+
+    uint64_t nkeyall;
+    MPI_Allreduce(&kv->nkv, &nkeyall, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
+    return nkeyall;
+}
+
+/* ----------------------------------------------------------------------
+   call user hash of aggregate() or collate() that takes no data ptr
+   ptr = MR whose appproc holds the hash
+------------------------------------------------------------------------- */
+
+int MapReduce::app_proc(char *key, int keybytes, void *ptr)
+{
+    return ((MapReduce *) ptr)->appproc(key, keybytes);
+}
+
+/* ----------------------------------------------------------------------
+   move each KV pair to the proc returned by hash(key,keybytes,hashptr)
+   hash = NULL = hi 32 bits of set_hash() function or hashkey(),
+     multiply-shifted to a proc
+   called by aggregate() and sort_keys_global()
+------------------------------------------------------------------------- */
+
+void MapReduce::aggregate_kv(int (*hash)(char *, int, void *), void *hashptr)
+{
+    int i, slot, keybytes, valuebytes, alldone;
+    int memtag_cdpage, memtag_epage, memtag_fpage, memtag_gpage;
+    uint64_t dummy, dummy1, dummy2, dummy3, ukey;
+    double timestart, fraction;
+    char *ptr, *key, *value;
+
     // new KV that will be created
 
     KeyValue *kvnew = new KeyValue(this, kalign, valign, memory, error, comm);
     kvnew->set_page();
 
     // irregular communicator
+    // kept across calls so persistent requests and graph comm can be reused
 
-    Irregular *irregular = new Irregular(all2all, memory, error, comm);
+    if (irregular && irregular->all2all != all2all) {
+        delete irregular;
+        irregular = NULL;
+    }
+    if (irregular == NULL)
+        irregular = new Irregular(all2all, memory, error, comm);
 
     // pages of workspace memory, including extra allocated pages
+    // exchanges are pipelined, 2 can be in flight at once, each in a slot
+    // cdpage = recv buffer of one page for each slot
+    // epage = proc and size of each KV pair in page being sent
+    // fpage,gpage = packed send buffer for each slot
 
     uint64_t twopage;
     char *cdpage = mymalloc(2, twopage, memtag_cdpage);
@@ -376,109 +531,134 @@ uint64_t MapReduce::aggregate(int (*hash)(char *, int))
     char *fpage = mymalloc(1, dummy, memtag_fpage);
     char *gpage = mymalloc(1, dummy, memtag_gpage);
 
-    // maxpage = max # of pages in any proc's KV
+    char *recvbuf[2] = {cdpage, cdpage + pagesize};
+    char *sendbuf[2] = {fpage, gpage};
+    int nrecv[2] = {0, 0};
+    int inflight[2] = {0, 0};
+
+    int *proclist = (int *) epage;
+    int *kvsizes = proclist;
 
     char *page_send;
     int npage_send = kv->request_info(&page_send);
-    int maxpage;
-    MPI_Allreduce(&npage_send, &maxpage, 1, MPI_INT, MPI_MAX, comm);
 
-    // loop over pages, perform irregular comm on each
+    // each pass thru loop is one exchange of KV pairs among all procs
+    // hash and pack next exchange while previous one is in flight
+    // start,stop = range of KV pairs in current page sent by this exchange
+    // ptr = 1st KV pair to send in current page
+    // no proc can receive more than 1 page at once, else scale back stop
+    // only 2 collectives per exchange, in setup_async()
+    // done when all procs have sent all KV pairs from all their pages
+
+    int ipage = 0;
+    int nkey_send = 0;
+    int start = 0;
+    int stop;
+    char *ptr_start = page_send;
+    slot = 0;
 
-    for (int ipage = 0; ipage < maxpage; ipage++) {
-
-        // load page of KV pairs
-
-        if (ipage < npage_send)
-            nkey_send = kv->request_page(ipage, dummy1, dummy2, dummy3);
-        else nkey_send = 0;
+    while (1) {
 
-        // set ptrs to workspace memory
+        // finish exchange from 2 passes ago, which used this slot
 
-        proclist = (int *) epage;
-        kvsizes = &proclist[nkey_send];
-        reorder = &proclist[2 * ((uint64_t) nkey_send)];
-        kvptrs = (char **) fpage;
+        if (inflight[slot]) {
+            timestart = MPI_Wtime();
+            irregular->exchange_wait(slot);
+            inflight[slot] = 0;
+            commtime += MPI_Wtime() - timestart;
+            kvnew->add(nrecv[slot], recvbuf[slot]);
+        }
 
+        // when current page is all sent, load next page of KV pairs
         // hash each key to a proc ID
-        // via user-provided hash function or hashlittle()
-
-        ptr = page_send;
-
-        for (i = 0; i < nkey_send; i++) {
-            kvptrs[i] = ptr;
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
-
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key = ptr;
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
+        // via user-provided hash function or 64-bit key hash
+
+        if (start == nkey_send && ipage < npage_send) {
+            nkey_send = kv->request_page(ipage++, dummy1, dummy2, dummy3);
+            kvsizes = &proclist[nkey_send];
+            ptr = page_send;
+
+            for (i = 0; i < nkey_send; i++) {
+                char *ptr_kv = ptr;
+                ptr = next_pair(ptr, key, keybytes, value, valuebytes);
+
+                kvsizes[i] = ptr - ptr_kv;
+                if (hash)   /// user defined hash function
+                    proclist[i] = hash(key, keybytes, hashptr) % nprocs;
+                else {      /// default hash function
+                    if (apphash) ukey = apphash(key, keybytes);
+                    else ukey = hashkey(key, keybytes);
+                    proclist[i] = ((ukey >> 32) * nprocs) >> 32;
+                }
+            }
 
-            kvsizes[i] = ptr - kvptrs[i];
-            if (hash)   /// user defined hash function
-                proclist[i] = hash(key, keybytes) % nprocs;
-            else        /// default hash function
-                proclist[i] = hashlittle(key, keybytes, nprocs) % nprocs;
+            start = 0;
+            ptr_start = page_send;
         }
 
-        // perform irregular comm of each proc's page of KV pairs
-        // add received KV pairs to kvnew
-        // no proc can receive more than 2 pages at once, else scale back
-        // iterate until entire page is communicated by every proc
+        // attempt to send all remaining KV pairs of current page
+        // if overflows any proc, then scale back stop until succeed
+        // 0.9 is a conservative round-down factor
+        // scale back always succeeds:
+        //   a proc with pairs to send keeps at least 1, so the max # sent
+        //   by any proc drops each time, once it is 1 and still overflows,
+        //   only the lowest proc with pairs left sends its 1st pair,
+        //   and a single pair always fits in the 1-page recv buffer
 
-        start = 0;
+        timestart = MPI_Wtime();
         stop = nkey_send;
-
-        done = 0;
-        while (!done) {
-
-            // attempt to communicate all KVs from start to stop
-            // if overflows any proc, then scale back stop until succeed
-            // if setup returns any fraction < 1.0, reset stop and try again
-            // 0.9 is a conservative round-down factor
-            // NOTE: is scale back guaranteed to eventually be successful?
-            //       is this loop guaranteed to make progress (comm something)?
-            //       what if all procs want to send 1 big datum to proc 0 but
-            //       call cannot do it together?
-            //       then all might round down to 0 ??
-
-            timestart = MPI_Wtime();
-
-            while (1) {
-                nkey_recv = irregular->setup(stop - start, &proclist[start],
-                                             &kvsizes[start], &reorder[start],
-                                             twopage, fraction);
-
-                MPI_Allreduce(&fraction, &minfrac, 1, MPI_DOUBLE, MPI_MIN, comm);
-                if (minfrac < 1.0)
-                    stop = static_cast<int>(start + 0.9 * minfrac * (stop - start));
-                else break;
+        int mydone = (start == nkey_send && ipage == npage_send);
+        int nkey_recv, nsend, nsendmax, first;
+
+        while (1) {
+            nkey_recv = irregular->setup_async(slot, stop - start,
+                                               &proclist[start],
+                                               &kvsizes[start], pagesize,
+                                               mydone, fraction, alldone);
+            if (alldone || fraction == 1.0) break;
+
+            nsend = stop - start;
+            MPI_Allreduce(&nsend, &nsendmax, 1, MPI_INT, MPI_MAX, comm);
+            if (nsendmax > 1) {
+                stop = static_cast<int>(start + 0.9 * fraction * nsend);
+                if (stop == start && nsend) stop = start + 1;
             }
-
-            irregular->exchange(stop - start, &proclist[start], &kvptrs[start],
-                                &kvsizes[start], &reorder[start], gpage, cdpage);
-            cssize += irregular->cssize;
-            crsize += irregular->crsize;
+            else {
+                nsend = (start < nkey_send) ? me : nprocs;
+                MPI_Allreduce(&nsend, &first, 1, MPI_INT, MPI_MIN, comm);
+                stop = (me == first) ? start + 1 : start;
+            }
+        }
+        if (alldone) {
             commtime += MPI_Wtime() - timestart;
+            break;
+        }
 
-            kvnew->add(nkey_recv, cdpage);
+        irregular->exchange_start(slot, stop - start, &proclist[start],
+                                  &kvsizes[start], ptr_start,
+                                  sendbuf[slot], recvbuf[slot]);
+        cssize += irregular->cssize;
+        crsize += irregular->crsize;
+        commtime += MPI_Wtime() - timestart;
 
-            // set start/stop to remainder of page and iterate
-            // if all procs are at end of page, then done
+        nrecv[slot] = nkey_recv;
+        inflight[slot] = 1;
 
-            start = stop;
-            stop = nkey_send;
-            if (start == stop) mydone = 1;
-            else mydone = 0;
-            MPI_Allreduce(&mydone, &done, 1, MPI_INT, MPI_MIN, comm);
-        }
+        for (i = start; i < stop; i++) ptr_start += kvsizes[i];
+        start = stop;
+        slot = 1 - slot;
+    }
+
+    // finish last exchange, the other slot was finished at top of loop
+
+    slot = 1 - slot;
+    if (inflight[slot]) {
+        timestart = MPI_Wtime();
+        irregular->exchange_wait(slot);
+        commtime += MPI_Wtime() - timestart;
+        kvnew->add(nrecv[slot], recvbuf[slot]);
     }
 
-    delete irregular;
     myfree(memtag_cdpage);
     myfree(memtag_epage);
     myfree(memtag_fpage);
@@ -488,23 +668,19 @@ uint64_t MapReduce::aggregate(int (*hash)(char *, int))
     delete kv;
     kv = kvnew;
     kv->complete();
-
-    stats("Aggregate", 0);
-
-    uint64_t nkeyall;
-    MPI_Allreduce(&kv->nkv, &nkeyall, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
-    return nkeyall;
 }
 
 /* ----------------------------------------------------------------------
    broadcast the KV on proc root to all other procs
+   sizes of all pages are sent up front, then page data is pipelined
+   if any node has several procs, node leaders receive pages into a
+     shared-memory window that the other procs on the node read from
+   else pages are received directly into the new KV's page buffers
 ------------------------------------------------------------------------- */
 
 uint64_t MapReduce::broadcast(int root)
 {
-    int npage_kv, memtag;
-    char *buf;
-    uint64_t dummy, sizes[4];
+    int npage_kv;
 
     if (kv == NULL) error->all("Cannot broadcast without KeyValue");
     if (root < 0 || root >= nprocs) error->all("Invalid root for broadcast");
@@ -518,36 +694,48 @@ uint64_t MapReduce::broadcast(int root)
         return nkeyall;
     }
 
-    // on non-root procs, delete existing KV and create empty KV
-
     double timestart = MPI_Wtime();
 
+    // node and leader comms, created on first use and kept between calls
+
+    if (nodecomm == MPI_COMM_NULL) {
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                            &nodecomm);
+        MPI_Comm_rank(nodecomm, &nodeme);
+        MPI_Comm_size(nodecomm, &nodeprocs);
+        MPI_Comm_split(comm, nodeme == 0 ? 0 : MPI_UNDEFINED, me, &leadercomm);
+        MPI_Allreduce(&nodeprocs, &nodeshared, 1, MPI_INT, MPI_MAX, comm);
+        nodeshared = nodeshared > 1;
+    }
+
+    // on non-root procs, delete existing KV and create empty KV
+    // sizes = nkey, keysize, valuesize, alignsize of each page of root's KV
+
     if (me != root) {
         myfree(kv->memtag);
         delete kv;
         kv = new KeyValue(this, kalign, valign, memory, error, comm);
         kv->set_page();
-        buf = mymalloc(1, dummy, memtag);
     }
-    else npage_kv = kv->request_info(&buf);
+    else npage_kv = kv->npage;
 
     MPI_Bcast(&npage_kv, 1, MPI_INT, root, comm);
 
-    // broadcast KV data, one page at a time, non-root procs add to their KV
-
-    for (int ipage = 0; ipage < npage_kv; ipage++) {
-        if (me == root)
-            sizes[0] = kv->request_page(ipage, sizes[1], sizes[2], sizes[3]);
-        MPI_Bcast(sizes, 4, MPI_UNSIGNED_LONG, root, comm);
-        MPI_Bcast(buf, sizes[3], MPI_BYTE, root, comm);
-        if (me == root) cssize += sizes[3];
-        else {
-            crsize += sizes[3];
-            kv->add(sizes[0], buf, sizes[1], sizes[2], sizes[3]);
+    uint64_t *sizes = (uint64_t *)
+        memory->smalloc(4 * (uint64_t) npage_kv * sizeof(uint64_t), "MR:sizes");
+    if (me == root)
+        for (int ipage = 0; ipage < npage_kv; ipage++) {
+            sizes[4*ipage] = kv->pages[ipage].nkey;
+            sizes[4*ipage+1] = kv->pages[ipage].keysize;
+            sizes[4*ipage+2] = kv->pages[ipage].valuesize;
+            sizes[4*ipage+3] = kv->pages[ipage].alignsize;
         }
-    }
+    MPI_Bcast(sizes, 4*npage_kv, MPI_UNSIGNED_LONG, root, comm);
+
+    if (nodeshared) broadcast_shared(root, npage_kv, sizes);
+    else broadcast_direct(root, npage_kv, sizes);
 
-    if (me != root) myfree(memtag);
+    memory->sfree(sizes);
 
     commtime += MPI_Wtime() - timestart;
     if (me != root) kv->complete();
@@ -560,6 +748,222 @@ uint64_t MapReduce::broadcast(int root)
     return nkeyall;
 }
 
+/* ----------------------------------------------------------------------
+   broadcast pages when every node has a single proc
+   2 page buffers per proc, page I+1 is in flight while page I is handled
+   non-root procs receive straight into the buffer that becomes a KV page
+------------------------------------------------------------------------- */
+
+void MapReduce::broadcast_direct(int root, int npage_kv, uint64_t *sizes)
+{
+    int memtag_extra;
+    uint64_t dummy;
+    MPI_Request request;
+
+    char *buf[2];
+    buf[0] = kv->page;
+    buf[1] = mymalloc(1, dummy, memtag_extra);
+
+    char *ptr = NULL;
+    if (npage_kv) {
+        if (me == root) ptr = broadcast_load(0, buf[0]);
+        else ptr = buf[0];
+        MPI_Ibcast(ptr, sizes[3], MPI_BYTE, root, comm, &request);
+    }
+
+    for (int ipage = 0; ipage < npage_kv; ipage++) {
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        char *ptr_page = ptr;
+
+        if (ipage+1 < npage_kv) {
+            char *next = buf[(ipage+1) % 2];
+            if (me == root) ptr = broadcast_load(ipage+1, next);
+            else ptr = next;
+            MPI_Ibcast(ptr, sizes[4*(ipage+1)+3], MPI_BYTE, root, comm,
+                       &request);
+        }
+
+        if (me == root) cssize += sizes[4*ipage+3];
+        else {
+            crsize += sizes[4*ipage+3];
+            broadcast_install(ipage, npage_kv, sizes, ptr_page);
+        }
+    }
+
+    // last page may have been received into extra buffer
+    // if so, it becomes the KV page and the KV's old page is freed
+
+    if (me != root && kv->page != buf[0]) {
+        int memtag_kv = kv->memtag;
+        kv->set_page(pagesize, buf[1], memtag_extra);
+        memtag_extra = memtag_kv;
+    }
+    myfree(memtag_extra);
+}
+
+/* ----------------------------------------------------------------------
+   broadcast pages when some node has several procs
+   pages move in chunks thru 2 chunk slots of a node's shared memory
+   root copies each chunk into its node's slot, node leaders broadcast
+     it into their node's slot, other procs copy it into their KV page
+   chunk I+1 is in flight while chunk I is copied out
+   1 node barrier per chunk: chunk I is in the slots and chunk I-1 is
+     copied out of them, plus 1 on root's node once root fills a slot
+------------------------------------------------------------------------- */
+
+void MapReduce::broadcast_shared(int root, int npage_kv, uint64_t *sizes)
+{
+    int rootnode, leaderroot;
+    MPI_Request request;
+    uint64_t dummy1, dummy2, dummy3;
+
+    // rootnode = 1 if root is on my node
+    // leaderroot = rank of leader of root's node in leader comm
+
+    int flag = (me == root);
+    MPI_Allreduce(&flag, &rootnode, 1, MPI_INT, MPI_MAX, nodecomm);
+    if (leadercomm != MPI_COMM_NULL) {
+        int ileader = -1;
+        if (rootnode) MPI_Comm_rank(leadercomm, &ileader);
+        MPI_Allreduce(&ileader, &leaderroot, 1, MPI_INT, MPI_MAX, leadercomm);
+    }
+
+    // 2 chunk slots in memory shared by my node, allocated by node leader
+
+    uint64_t chunksize = MIN(pagesize, BCASTCHUNK);
+    MPI_Aint winsize = (nodeme == 0) ? 2 * chunksize : 0;
+    char *base;
+    int disp;
+    MPI_Win win;
+    MPI_Win_allocate_shared(winsize, 1, MPI_INFO_NULL, nodecomm, &base, &win);
+    MPI_Win_shared_query(win, 0, &winsize, &disp, &base);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+
+    // chunk I of the whole KV = bytes offset to offset+n of page ipage
+    // root reads each page of a KV file into its page before chunking it
+
+    int nchunk = 0;
+    for (int ipage = 0; ipage < npage_kv; ipage++)
+        nchunk += (sizes[4*ipage+3] + chunksize - 1) / chunksize;
+
+    char *page_hold = kv->page;
+    char *ptr_page = page_hold;
+    int ipage = -1;
+    uint64_t offset = 0;
+    uint64_t n = 0;
+
+    for (int ichunk = -1; ichunk < nchunk; ichunk++) {
+
+        // chunk ichunk is in slots of all nodes, wait for chunk ichunk+1
+
+        if (ichunk >= 0) {
+            if (nodeme == 0) MPI_Wait(&request, MPI_STATUS_IGNORE);
+            MPI_Win_sync(win);
+            MPI_Barrier(nodecomm);
+            MPI_Win_sync(win);
+        }
+
+        // next chunk, skip over pages with no data
+        // root copies next chunk into its slot, loading a new page if needed
+
+        int ipage_next = ipage;
+        uint64_t offset_next = offset + n;
+        if (ipage < 0 || offset_next == sizes[4*ipage+3]) {
+            ipage_next++;
+            offset_next = 0;
+            while (ipage_next < npage_kv && sizes[4*ipage_next+3] == 0)
+                ipage_next++;
+        }
+
+        if (ichunk+1 < nchunk) {
+            uint64_t n_next =
+                MIN(chunksize, sizes[4*ipage_next+3] - offset_next);
+            char *slot_next = base + ((ichunk+1) % 2) * chunksize;
+            if (me == root) {
+                if (offset_next == 0 && kv->fileflag)
+                    kv->request_page(ipage_next, dummy1, dummy2, dummy3);
+                memcpy(slot_next, page_hold + offset_next, n_next);
+                cssize += n_next;
+            }
+            if (rootnode) {
+                MPI_Win_sync(win);
+                MPI_Barrier(nodecomm);
+                MPI_Win_sync(win);
+            }
+            if (nodeme == 0)
+                MPI_Ibcast(slot_next, n_next, MPI_BYTE, leaderroot,
+                           leadercomm, &request);
+        }
+
+        // copy chunk ichunk into my KV page
+        // install pages completed by it and any empty pages that follow
+
+        if (ichunk >= 0 && me != root) {
+            memcpy(ptr_page + offset, base + (ichunk % 2) * chunksize, n);
+            crsize += n;
+        }
+
+        if (me != root) {
+            int ilast = (ichunk+1 < nchunk) ? ipage_next : npage_kv;
+            if (ipage_next != ipage) {
+                if (ipage >= 0)
+                    broadcast_install(ipage, npage_kv, sizes, ptr_page);
+                for (int i = ipage+1; i < ilast; i++)
+                    broadcast_install(i, npage_kv, sizes, ptr_page);
+            }
+        }
+
+        if (ichunk+1 < nchunk) {
+            ipage = ipage_next;
+            offset = offset_next;
+            n = MIN(chunksize, sizes[4*ipage+3] - offset);
+        }
+    }
+
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+}
+
+/* ----------------------------------------------------------------------
+   read page ipage of root's KV into buf, return ptr to its data
+   a KV with no file has a single page, already in KV memory
+------------------------------------------------------------------------- */
+
+char *MapReduce::broadcast_load(int ipage, char *buf)
+{
+    uint64_t dummy1, dummy2, dummy3;
+
+    if (!kv->fileflag) return kv->page;
+
+    char *page_hold = kv->page;
+    kv->page = buf;
+    kv->request_page(ipage, dummy1, dummy2, dummy3);
+    kv->page = page_hold;
+    return buf;
+}
+
+/* ----------------------------------------------------------------------
+   add received page ipage in buf to my KV as a full page, no copy
+   all but the last page are written to the KV file from buf
+   the last page stays in buf, which becomes the KV page
+------------------------------------------------------------------------- */
+
+void MapReduce::broadcast_install(int ipage, int npage_kv, uint64_t *sizes,
+                                  char *buf)
+{
+    kv->nkey = sizes[4*ipage];
+    kv->keysize = sizes[4*ipage+1];
+    kv->valuesize = sizes[4*ipage+2];
+    kv->alignsize = sizes[4*ipage+3];
+    kv->page = buf;
+
+    if (ipage == npage_kv-1) return;
+
+    kv->create_page();
+    kv->write_page();
+    kv->npage++;
+}
+
 /* ----------------------------------------------------------------------
    clone KV to KMV so that KMV pairs are one-to-one copies of KV pairs
    each proc clones only its data
@@ -599,6 +1003,7 @@ uint64_t MapReduce::close()
     if (timer) start_timer();
     if (verbosity) file_stats(0);
 
+    combine_stop(kv);
     kv->complete();
 
     stats("Complete", 0);
@@ -645,6 +1050,17 @@ uint64_t MapReduce::collapse(char *key, int keybytes)
 ------------------------------------------------------------------------- */
 
 uint64_t MapReduce::collate(int (*hash)(char *, int))
+{
+    appproc = hash;
+    if (hash) return collate(&app_proc, this);
+    return collate(NULL, NULL);
+}
+
+/* ----------------------------------------------------------------------
+   collate with hash(key,keybytes,hashptr) returning proc of each key
+------------------------------------------------------------------------- */
+
+uint64_t MapReduce::collate(int (*hash)(char *, int, void *), void *hashptr)
 {
     if (kv == NULL) error->all("Cannot collate without KeyValue");
     if (timer) start_timer();
@@ -656,7 +1072,7 @@ uint64_t MapReduce::collate(int (*hash)(char *, int))
     verbosity = timer = 0;
     
     ////////////////
-    aggregate(hash);
+    aggregate(hash, hashptr);
     convert();
     ////////////////
 
@@ -908,8 +1324,6 @@ uint64_t MapReduce::gather(int numprocs)
 uint64_t MapReduce::map(int nmap, void (*appmap)(int, KeyValue *, void *),
                         void *appptr, int addflag)
 {
-    MPI_Status status;
-
     if (timer) start_timer();
     if (verbosity) file_stats(0);
 
@@ -932,12 +1346,20 @@ uint64_t MapReduce::map(int nmap, void (*appmap)(int, KeyValue *, void *),
         kv->append();
     }
 
+    // nthread > 1 = this proc's tasks run on a pool of threads
     // nprocs = 1 = all tasks to single processor
     // mapstyle 0 = chunk of tasks to each proc
     // mapstyle 1 = strided tasks to each proc
     // mapstyle 2 = master/slave assignment of tasks
+    // mapstyle 3 = chunk of tasks to each proc, idle procs steal tasks
 
-    if (nprocs == 1) {
+    int nthread = map_nthreads();
+    if (nthread == 1) combine_start(kv);
+
+    if (nthread > 1) {
+        map_threads(nthread, nmap, appmap, appptr);
+    }
+    else if (nprocs == 1) {
         for (int itask = 0; itask < nmap; itask++)
             appmap(itask, kv, appptr);
 
@@ -956,48 +1378,23 @@ uint64_t MapReduce::map(int nmap, void (*appmap)(int, KeyValue *, void *),
 
     }
     else if (mapstyle == 2) {
-        if (me == 0) {
-            int doneflag = -1;
-            int ndone = 0;
-            int itask = 0;
-            for (int iproc = 1; iproc < nprocs; iproc++) {
-                if (itask < nmap) {
-                    MPI_Send(&itask, 1, MPI_INT, iproc, 0, comm);
-                    itask++;
-                }
-                else {
-                    MPI_Send(&doneflag, 1, MPI_INT, iproc, 0, comm);
-                    ndone++;
-                }
-            }
-            while (ndone < nprocs - 1) {
-                int iproc, tmp;
-                MPI_Recv(&tmp, 1, MPI_INT, MPI_ANY_SOURCE, 0, comm, &status);
-                iproc = status.MPI_SOURCE;
-
-                if (itask < nmap) {
-                    MPI_Send(&itask, 1, MPI_INT, iproc, 0, comm);
-                    itask++;
-                }
-                else {
-                    MPI_Send(&doneflag, 1, MPI_INT, iproc, 0, comm);
-                    ndone++;
-                }
-            }
-        }
-        else {
-            while (1) {
-                int itask;
-                MPI_Recv(&itask, 1, MPI_INT, 0, 0, comm, &status);
-                if (itask < 0) break;
-                appmap(itask, kv, appptr);
-                MPI_Send(&itask, 1, MPI_INT, 0, 0, comm);
-            }
-        }
+        chunk_start(nmap);
+        int itask;
+        while ((itask = next_task()) >= 0)
+            appmap(itask, kv, appptr);
+
+    }
+    else if (mapstyle == 3) {
+        steal_start(nmap);
+        int itask;
+        while ((itask = next_task()) >= 0)
+            appmap(itask, kv, appptr);
+        steal_stop();
 
     }
     else error->all("Invalid mapstyle setting");
 
+    combine_stop(kv);
     kv->complete();
 
     stats("Map", 0);
@@ -1008,41 +1405,352 @@ uint64_t MapReduce::map(int nmap, void (*appmap)(int, KeyValue *, void *),
 }
 
 /* ----------------------------------------------------------------------
-   create a KV via a parallel map operation for list of files in file
-   make one call to appmap() for each file in file
-   mapstyle determines how tasks are partitioned to processors
+   # of threads to run this proc's map() tasks on
+   mapstyle 2 master runs no tasks unless mapmaster is set
+   mapstyle 2 and 3 procs get tasks via MPI from any thread,
+     so MPI must have been initialized with MPI_THREAD_SERIALIZED or higher
 ------------------------------------------------------------------------- */
 
-uint64_t MapReduce::map(char *file,
-                        void (*appmap)(int, char *, KeyValue *, void *),
-                        void *appptr, int addflag)
+int MapReduce::map_nthreads()
 {
-    int n;
-    char line[MAXLINE];
-    MPI_Status status;
+    if (mapthreads <= 1) return 1;
+    if (nprocs == 1 || mapstyle == 0 || mapstyle == 1) return mapthreads;
+    if (mapstyle == 2 && me == 0 && !mapmaster) return 1;
+    if (mapstyle != 2 && mapstyle != 3) return 1;
+
+    int provided;
+    MPI_Query_thread(&provided);
+    if (provided < MPI_THREAD_SERIALIZED) return 1;
+    return mapthreads;
+}
 
-    if (timer) start_timer();
-    if (verbosity) file_stats(0);
+/* ----------------------------------------------------------------------
+   run this proc's map() tasks on nthread threads, including caller
+   each thread calls appmap() with its own KV, so appmap() must be thread-safe
+   full pages of thread KVs are handed off to MR kv as they fill
+   remaining partial pages are spliced into kv in thread order at the end
+   each thread holds 1 page for its KV and 1 for its combiner table if set,
+     so map() uses up to 2*nthread pages more than a serial map(),
+     they are counted against maxpage like any other page
+------------------------------------------------------------------------- */
 
-    if (!allocated) allocate();
-    if (kmv) myfree(kmv->memtag);
-    delete kmv;
-    kmv = NULL;
+void MapReduce::map_threads(int nthread, int nmap,
+                            void (*appmap)(int, KeyValue *, void *),
+                            void *appptr)
+{
+    // task range for this proc, mapstyle 2 fetches chunks of tasks from proc 0
+    // mapstyle 3 claims tasks from its own and other procs' chunks
 
-    if (addflag == 0) {
-        if (kv) myfree(kv->memtag);
-        delete kv;
-        kv = new KeyValue(this, kalign, valign, memory, error, comm);
-        kv->set_page();
+    if (nprocs == 1) {
+        tasknext = 0;
+        taskstop = nmap;
+        taskstride = 1;
     }
-    else if (kv == NULL) {
-        kv = new KeyValue(this, kalign, valign, memory, error, comm);
-        kv->set_page();
+    else if (mapstyle == 0) {
+        uint64_t nmap64 = nmap;
+        tasknext = me * nmap64 / nprocs;
+        taskstop = (me + 1) * nmap64 / nprocs;
+        taskstride = 1;
     }
-    else {
-        kv->append();
+    else if (mapstyle == 1) {
+        tasknext = me;
+        taskstop = nmap;
+        taskstride = nprocs;
     }
-
+    else if (mapstyle == 2) chunk_start(nmap);
+    else steal_start(nmap);
+
+    mapfunc = appmap;
+    mapptr = appptr;
+
+    // KVs and combiner tables are allocated here, not in threads,
+    //   since MR page allocation is not thread-safe
+
+    MapThread *threads = new MapThread[nthread];
+    for (int i = 0; i < nthread; i++) {
+        KeyValue *kvt = new KeyValue(this, kalign, valign, memory, error, comm);
+        kvt->set_page();
+        kvt->parent = kv;
+        kvt->parentlock = &splicelock;
+        threads[i].mr = this;
+        threads[i].kv = kvt;
+        threads[i].combinetag = -1;
+        if (appcombine) {
+            uint64_t combinesize;
+            char *combinepage = mymalloc(1, combinesize, threads[i].combinetag);
+            kvt->combine_start(appcombine, appcombineptr,
+                               combinesize, combinepage);
+        }
+    }
+
+    // caller is thread 0
+
+    pthread_t *pthreads = new pthread_t[nthread];
+    for (int i = 1; i < nthread; i++)
+        if (pthread_create(&pthreads[i], NULL, map_thread_entry, &threads[i]))
+            error->one("Could not create map thread");
+    map_thread_entry(&threads[0]);
+    for (int i = 1; i < nthread; i++) pthread_join(pthreads[i], NULL);
+    delete [] pthreads;
+
+    // flush combiner tables and splice partial pages into kv
+
+    for (int i = 0; i < nthread; i++) {
+        KeyValue *kvt = threads[i].kv;
+        if (threads[i].combinetag >= 0) {
+            kvt->combine_stop();
+            myfree(threads[i].combinetag);
+        }
+        kv->splice(kvt);
+        myfree(kvt->memtag);
+        delete kvt;
+    }
+    delete [] threads;
+
+    if (nprocs > 1 && mapstyle == 3) steal_stop();
+}
+
+/* ----------------------------------------------------------------------
+   body of one map thread, run tasks until none are left
+------------------------------------------------------------------------- */
+
+void *MapReduce::map_thread_entry(void *ptr)
+{
+    MapThread *thread = (MapThread *) ptr;
+    MapReduce *mr = thread->mr;
+
+    int itask;
+    while ((itask = mr->next_task()) >= 0)
+        mr->mapfunc(itask, thread->kv, mr->mapptr);
+    return NULL;
+}
+
+/* ----------------------------------------------------------------------
+   return next map() task for any thread on this proc, -1 if no more
+   when the current task range is used up, get a new one:
+     mapstyle 2 master serves requests and takes 1 task if mapmaster is set
+     mapstyle 2 worker takes its prefetched chunk from proc 0
+     mapstyle 3 claims a new range via steal_tasks()
+------------------------------------------------------------------------- */
+
+int MapReduce::next_task()
+{
+    int itask = -1;
+
+    pthread_mutex_lock(&tasklock);
+
+    if (tasknext >= taskstop && nprocs > 1) {
+        if (mapstyle == 2 && me == 0) chunk_serve();
+        else if (mapstyle == 2) chunk_fetch();
+        else if (mapstyle == 3) steal_tasks();
+    }
+    if (tasknext < taskstop) {
+        itask = tasknext;
+        tasknext += taskstride;
+    }
+
+    pthread_mutex_unlock(&tasklock);
+    return itask;
+}
+
+/* ----------------------------------------------------------------------
+   setup for mapstyle 2 master/slave assignment of nmap tasks
+   proc 0 hands out chunks of tasks, each a 1/CHUNKFRAC share of the tasks
+     left per proc, so chunks shrink as the remaining work shrinks
+   a worker asks for its next chunk when it starts the current one,
+     so the reply is there when it is needed
+   a chunk of 0 tasks tells a worker it is done
+------------------------------------------------------------------------- */
+
+void MapReduce::chunk_start(int nmap)
+{
+    tasknmap = nmap;
+    tasknext = taskstop = 0;
+    taskstride = 1;
+    if (nprocs == 1) return;
+
+    if (me == 0) {
+        taskassign = 0;
+        taskndone = 0;
+    }
+    else {
+        int request = 0;
+        MPI_Send(&request, 1, MPI_INT, 0, 0, comm);
+        MPI_Irecv(taskchunk, 2, MPI_INT, 0, 0, comm, &taskrequest);
+    }
+}
+
+/* ----------------------------------------------------------------------
+   mapstyle 2 worker: make prefetched chunk the current task range
+   request the chunk after it, unless told there are no more tasks
+------------------------------------------------------------------------- */
+
+void MapReduce::chunk_fetch()
+{
+    if (taskrequest == MPI_REQUEST_NULL) return;
+    MPI_Wait(&taskrequest, MPI_STATUS_IGNORE);
+    if (taskchunk[1] == 0) return;
+
+    tasknext = taskchunk[0];
+    taskstop = tasknext + taskchunk[1];
+
+    int request = 0;
+    MPI_Send(&request, 1, MPI_INT, 0, 0, comm);
+    MPI_Irecv(taskchunk, 2, MPI_INT, 0, 0, comm, &taskrequest);
+}
+
+/* ----------------------------------------------------------------------
+   mapstyle 2 master: answer chunk requests from workers
+   if mapmaster is set, answer those already waiting via MPI_Iprobe(),
+     then claim 1 task for myself so requests are polled between tasks
+   else, or once all tasks are handed out, answer requests until
+     every worker has been told it is done
+   all tasks are handed out by then, so return with no task range
+------------------------------------------------------------------------- */
+
+void MapReduce::chunk_serve()
+{
+    int request,flag,chunk[2];
+    MPI_Status status;
+
+    int nworker = nprocs - 1 + (mapmaster ? 1 : 0);
+
+    while (taskndone < nprocs - 1) {
+        if (mapmaster && taskassign < (uint64_t) tasknmap) {
+            MPI_Iprobe(MPI_ANY_SOURCE, 0, comm, &flag, &status);
+            if (!flag) {
+                tasknext = taskassign++;
+                taskstop = taskassign;
+                return;
+            }
+        }
+
+        MPI_Recv(&request, 1, MPI_INT, MPI_ANY_SOURCE, 0, comm, &status);
+        uint64_t nleft = tasknmap - taskassign;
+        uint64_t n = nleft / (CHUNKFRAC * nworker);
+        if (n == 0 && nleft) n = 1;
+        chunk[0] = taskassign;
+        chunk[1] = n;
+        taskassign += n;
+        if (n == 0) taskndone++;
+        MPI_Send(chunk, 2, MPI_INT, status.MPI_SOURCE, 0, comm);
+    }
+}
+
+/* ----------------------------------------------------------------------
+   setup for mapstyle 3 work stealing of nmap tasks
+   each proc owns the same chunk of tasks as in mapstyle 0
+   taskclaimed = # of tasks claimed from my chunk, exposed in a window
+   claiming is an atomic MPI_Fetch_and_op() add on the owner's counter,
+     so owner and thieves never claim the same task
+------------------------------------------------------------------------- */
+
+void MapReduce::steal_start(int nmap)
+{
+    tasknmap = nmap;
+    taskclaimed = 0;
+    taskvictim = 0;
+    tasknext = taskstop = 0;
+    taskstride = 1;
+
+    MPI_Win_create(&taskclaimed, sizeof(int64_t), sizeof(int64_t),
+                   MPI_INFO_NULL, comm, &taskwin);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, taskwin);
+}
+
+/* ----------------------------------------------------------------------
+   claim next range of tasks into tasknext,taskstop
+   claim 1 task at a time from my own chunk, so others can steal the rest
+   when it is exhausted, steal 1/nprocs of what is left in each other
+     proc's chunk in turn, starting with me+1
+   small steals keep a thief from taking a run of expensive tasks
+     that no other proc can then share
+   a chunk seen exhausted stays exhausted, so one pass over procs suffices
+   leave tasknext = taskstop if no tasks are left anywhere
+------------------------------------------------------------------------- */
+
+void MapReduce::steal_tasks()
+{
+    int64_t nclaim, claimed;
+
+    while (taskvictim < nprocs) {
+        int iproc = (me + taskvictim) % nprocs;
+        int64_t lo = iproc * (int64_t) tasknmap / nprocs;
+        int64_t n = (iproc + 1) * (int64_t) tasknmap / nprocs - lo;
+
+        if (taskvictim == 0) nclaim = 1;
+        else {
+            MPI_Fetch_and_op(&nclaim, &claimed, MPI_INT64_T, iproc, 0,
+                             MPI_NO_OP, taskwin);
+            MPI_Win_flush(iproc, taskwin);
+            if (claimed >= n) {
+                taskvictim++;
+                continue;
+            }
+            nclaim = (n - claimed + nprocs - 1) / nprocs;
+        }
+
+        MPI_Fetch_and_op(&nclaim, &claimed, MPI_INT64_T, iproc, 0,
+                         MPI_SUM, taskwin);
+        MPI_Win_flush(iproc, taskwin);
+        if (claimed < n) {
+            tasknext = lo + claimed;
+            if (claimed + nclaim < n) taskstop = lo + claimed + nclaim;
+            else taskstop = lo + n;
+            return;
+        }
+        taskvictim++;
+    }
+}
+
+/* ----------------------------------------------------------------------
+   end mapstyle 3 work stealing
+   MPI_Win_free() waits until all procs are done claiming from my chunk
+------------------------------------------------------------------------- */
+
+void MapReduce::steal_stop()
+{
+    MPI_Win_unlock_all(taskwin);
+    MPI_Win_free(&taskwin);
+}
+
+/* ----------------------------------------------------------------------
+   create a KV via a parallel map operation for list of files in file
+   make one call to appmap() for each file in file
+   mapstyle determines how tasks are partitioned to processors
+------------------------------------------------------------------------- */
+
+uint64_t MapReduce::map(char *file,
+                        void (*appmap)(int, char *, KeyValue *, void *),
+                        void *appptr, int addflag)
+{
+    int n;
+    char line[MAXLINE];
+
+    if (timer) start_timer();
+    if (verbosity) file_stats(0);
+
+    if (!allocated) allocate();
+    if (kmv) myfree(kmv->memtag);
+    delete kmv;
+    kmv = NULL;
+
+    if (addflag == 0) {
+        if (kv) myfree(kv->memtag);
+        delete kv;
+        kv = new KeyValue(this, kalign, valign, memory, error, comm);
+        kv->set_page();
+    }
+    else if (kv == NULL) {
+        kv = new KeyValue(this, kalign, valign, memory, error, comm);
+        kv->set_page();
+    }
+    else {
+        kv->append();
+    }
+
+    combine_start(kv);
+
     // open file and extract filenames
     // bcast each filename to all procs
     // trim whitespace from beginning and end of filename
@@ -1093,6 +1801,7 @@ uint64_t MapReduce::map(char *file,
     // mapstyle 0 = chunk of tasks to each proc
     // mapstyle 1 = strided tasks to each proc
     // mapstyle 2 = master/slave assignment of tasks
+    // mapstyle 3 = chunk of tasks to each proc, idle procs steal tasks
 
     if (nprocs == 1) {
         for (int itask = 0; itask < nmap; itask++)
@@ -1113,45 +1822,18 @@ uint64_t MapReduce::map(char *file,
 
     }
     else if (mapstyle == 2) {
-        if (me == 0) {
-            int doneflag = -1;
-            int ndone = 0;
-            int itask = 0;
-            for (int iproc = 1; iproc < nprocs; iproc++) {
-                if (itask < nmap) {
-                    MPI_Send(&itask, 1, MPI_INT, iproc, 0, comm);
-                    itask++;
-                }
-                else {
-                    MPI_Send(&doneflag, 1, MPI_INT, iproc, 0, comm);
-                    ndone++;
-                }
-            }
-            while (ndone < nprocs - 1) {
-                int iproc, tmp;
-                MPI_Recv(&tmp, 1, MPI_INT, MPI_ANY_SOURCE, 0, comm, &status);
-                iproc = status.MPI_SOURCE;
-
-                if (itask < nmap) {
-                    MPI_Send(&itask, 1, MPI_INT, iproc, 0, comm);
-                    itask++;
-                }
-                else {
-                    MPI_Send(&doneflag, 1, MPI_INT, iproc, 0, comm);
-                    ndone++;
-                }
-            }
+        chunk_start(nmap);
+        int itask;
+        while ((itask = next_task()) >= 0)
+            appmap(itask, files[itask], kv, appptr);
 
-        }
-        else {
-            while (1) {
-                int itask;
-                MPI_Recv(&itask, 1, MPI_INT, 0, 0, comm, &status);
-                if (itask < 0) break;
-                appmap(itask, files[itask], kv, appptr);
-                MPI_Send(&itask, 1, MPI_INT, 0, 0, comm);
-            }
-        }
+    }
+    else if (mapstyle == 3) {
+        steal_start(nmap);
+        int itask;
+        while ((itask = next_task()) >= 0)
+            appmap(itask, files[itask], kv, appptr);
+        steal_stop();
 
     }
     else error->all("Invalid mapstyle setting");
@@ -1161,6 +1843,7 @@ uint64_t MapReduce::map(char *file,
     for (int i = 0; i < nmap; i++) delete [] files[i];
     memory->sfree(files);
 
+    combine_stop(kv);
     kv->complete();
 
     stats("Map", 0);
@@ -1447,6 +2130,36 @@ uint64_t MapReduce::map(MapReduce *mr,
                         void (*appmap)(uint64_t, char *, int, char *, int,
                                        KeyValue *, void *),
                         void *appptr, int addflag)
+{
+    KeyValue *kv_src = mr->kv;
+    KeyValue *kv_dest = map_kv_start(mr, addflag);
+
+    int nkey_kv, keybytes, valuebytes;
+    uint64_t dummy1, dummy2, dummy3;
+    char *page_kv, *ptr, *key, *value;
+    int npage_kv = kv_src->request_info(&page_kv);
+    uint64_t n = 0;
+
+    for (int ipage = 0; ipage < npage_kv; ipage++) {
+        nkey_kv = kv_src->request_page(ipage, dummy1, dummy2, dummy3);
+        ptr = page_kv;
+
+        for (int i = 0; i < nkey_kv; i++) {
+            ptr = mr->next_pair(ptr, key, keybytes, value, valuebytes);
+            appmap(n++, key, keybytes, value, valuebytes, kv_dest, appptr);
+        }
+    }
+
+    return map_kv_stop(mr, kv_src, kv_dest);
+}
+
+/* ----------------------------------------------------------------------
+   setup for map() of an existing MR's KV
+   return KeyValue object which stores new KV pairs
+   also called by templated TypedMapReduce::map()
+------------------------------------------------------------------------- */
+
+KeyValue *MapReduce::map_kv_start(MapReduce *mr, int addflag)
 {
     if (mr->kv == NULL)
         error->all("MapReduce passed to map() does not have KeyValue");
@@ -1494,32 +2207,20 @@ uint64_t MapReduce::map(MapReduce *mr,
         }
     }
 
-    int nkey_kv, keybytes, valuebytes;
-    uint64_t dummy1, dummy2, dummy3;
-    char *page_kv, *ptr, *key, *value;
-    int npage_kv = kv_src->request_info(&page_kv);
-    uint64_t n = 0;
-
-    for (int ipage = 0; ipage < npage_kv; ipage++) {
-        nkey_kv = kv_src->request_page(ipage, dummy1, dummy2, dummy3);
-        ptr = page_kv;
-
-        for (int i = 0; i < nkey_kv; i++) {
-            keybytes = *((int *) ptr);
-            valuebytes = *((int *)(ptr + sizeof(int)));;
+    combine_start(kv_dest);
+    return kv_dest;
+}
 
-            ptr += twolenbytes;
-            ptr = ROUNDUP(ptr, kalignm1);
-            key = ptr;
-            ptr += keybytes;
-            ptr = ROUNDUP(ptr, valignm1);
-            value = ptr;
-            ptr += valuebytes;
-            ptr = ROUNDUP(ptr, talignm1);
+/* ----------------------------------------------------------------------
+   wrapup of map() of an existing MR's KV
+   kv_src = KV of mr that was mapped, deleted if mr = this
+   kv_dest = KV returned by map_kv_start(), becomes my KV
+------------------------------------------------------------------------- */
 
-            appmap(n++, key, keybytes, value, valuebytes, kv_dest, appptr);
-        }
-    }
+uint64_t MapReduce::map_kv_stop(MapReduce *mr, KeyValue *kv_src,
+                                KeyValue *kv_dest)
+{
+    combine_stop(kv_dest);
 
     if (mr == this) {
         myfree(kv_src->memtag);
@@ -1559,6 +2260,8 @@ void MapReduce::open(int addflag)
     else {
         kv->append();
     }
+
+    combine_start(kv);
 }
 
 /* ----------------------------------------------------------------------
@@ -1758,6 +2461,24 @@ int MapReduce::multivalue_block(int iblock,
     return nvalues;
 }
 
+/* ----------------------------------------------------------------------
+   sort keys in a KV to create a new KV
+   flag = built-in order of keys, negative for descending order
+     1 = int, 2 = uint64_t, 3 = float, 4 = double,
+     5 = strcmp() of strings, 6 = memcmp() of byte strings
+   fixed-width keys are radix sorted
+   each proc sorts only its data
+------------------------------------------------------------------------- */
+
+uint64_t MapReduce::sort_keys(int flag)
+{
+    if (flag == 0 || flag < -6 || flag > 6)
+        error->all("Invalid sort_keys flag");
+    sortflag = flag;
+    compare = compare_builtin;
+    return sort_pairs(0);
+}
+
 /* ----------------------------------------------------------------------
    sort keys in a KV to create a new KV
    use appcompare() to compare 2 keys
@@ -1766,37 +2487,364 @@ int MapReduce::multivalue_block(int iblock,
 
 uint64_t MapReduce::sort_keys(int (*appcompare)(char *, int, char *, int))
 {
-    if (kv == NULL) error->all("Cannot sort_keys without KeyValue");
-    if (timer) start_timer();
-    if (verbosity) file_stats(0);
+    compare = appcompare;
+    return sort_pairs(0);
+}
+
+/* ----------------------------------------------------------------------
+   sort values in a KV to create a new KV
+   flag = built-in order of values, same as for sort_keys(int)
+   each proc sorts only its data
+------------------------------------------------------------------------- */
+
+uint64_t MapReduce::sort_values(int flag)
+{
+    if (flag == 0 || flag < -6 || flag > 6)
+        error->all("Invalid sort_values flag");
+    sortflag = flag;
+    compare = compare_builtin;
+    return sort_pairs(1);
+}
+
+/* ----------------------------------------------------------------------
+   sort values in a KV to create a new KV
+   use appcompare() to compare 2 values
+   each proc sorts only its data
+------------------------------------------------------------------------- */
+
+uint64_t MapReduce::sort_values(int (*appcompare)(char *, int, char *, int))
+{
+    compare = appcompare;
+    return sort_pairs(1);
+}
+
+/* ----------------------------------------------------------------------
+   sort keys across all procs to create a new KV
+   flag = built-in order of keys, same as for sort_keys(int)
+   proc 0 has the smallest keys, proc P-1 the largest
+------------------------------------------------------------------------- */
+
+uint64_t MapReduce::sort_keys_global(int flag)
+{
+    if (flag == 0 || flag < -6 || flag > 6)
+        error->all("Invalid sort_keys_global flag");
+    sortflag = flag;
+    compare = compare_builtin;
+    return sort_global();
+}
+
+/* ----------------------------------------------------------------------
+   sort keys across all procs to create a new KV
+   use appcompare() to compare 2 keys
+   proc 0 has the smallest keys, proc P-1 the largest
+------------------------------------------------------------------------- */
+
+uint64_t MapReduce::sort_keys_global(int (*appcompare)(char *, int,
+                                                        char *, int))
+{
+    compare = appcompare;
+    return sort_global();
+}
+
+/* ----------------------------------------------------------------------
+   parallel sample sort of keys in a KV
+   choose P-1 splitter keys from samples of every proc's keys,
+   send each KV pair to the proc whose key range holds its key,
+   then sort each proc's KV pairs
+   compare and sortflag are already set by caller
+------------------------------------------------------------------------- */
+
+uint64_t MapReduce::sort_global()
+{
+    if (kv == NULL) error->all("Cannot sort_keys_global without KeyValue");
+    if (timer) start_timer();
+    if (verbosity) file_stats(0);
+
+    mrptr = this;
+
+    if (nprocs > 1) {
+        sample_splitters();
+        splitnext = me;
+        aggregate_kv(&splitter_proc, this);
+        memory->sfree(splitbuf);
+        memory->sfree(splitlen);
+        memory->sfree(splitptr);
+        memory->sfree(splitrank);
+        splitbuf = NULL;
+        splitlen = NULL;
+        splitptr = NULL;
+        splitrank = NULL;
+        nsplit = 0;
+    }
+
+    sort_kv(0);
+
+    sortflag = 0;
+    sortorder = NULL;
+
+    stats("Sort_keys_global", 0);
+    fcounter_sort = 0;
+
+    uint64_t nkeyall;
+    MPI_Allreduce(&kv->nkv, &nkeyall, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
+    return nkeyall;
+}
+
+/* ----------------------------------------------------------------------
+   choose nsplit = P-1 splitter keys, same on all procs
+   each proc contributes evenly spaced keys of its KV,
+     SAMPLES per proc on average, in proportion to its # of KV pairs
+   proc 0 sorts all samples and picks every (nsample/P)th one
+------------------------------------------------------------------------- */
+
+void MapReduce::sample_splitters()
+{
+    int i, j, keybytes, valuebytes;
+    uint64_t dummy1, dummy2, dummy3;
+    char *ptr, *key, *value;
+
+    uint64_t nall;
+    MPI_Allreduce(&kv->nkv, &nall, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
+
+    uint64_t nsample = 0;
+    if (nall) nsample = (uint64_t) ((double) SAMPLES * nprocs * kv->nkv / nall);
+    if (nsample > kv->nkv) nsample = kv->nkv;
+    if (nsample == 0 && kv->nkv) nsample = 1;
+
+    // copy key of every sampled KV pair into sbuf, sample I = pair
+    //   (2I+1)*nkv/(2*nsample) in order of my KV
+
+    int *slen = (int *) memory->smalloc(nsample * sizeof(int), "MR:slen");
+    char *sbuf = NULL;
+    int sbytes = 0;
+    int maxbytes = 0;
+
+    char *page_kv;
+    int npage_kv = kv->request_info(&page_kv);
+    uint64_t ientry = 0;
+    uint64_t isample = 0;
+    uint64_t next = nsample ? kv->nkv / (2 * nsample) : 0;
+
+    for (int ipage = 0; ipage < npage_kv && isample < nsample; ipage++) {
+        int nkey_kv = kv->request_page(ipage, dummy1, dummy2, dummy3);
+        ptr = page_kv;
+
+        // fixed-width pairs are skipped without reading the page
+
+        for (i = 0; i < nkey_kv && isample < nsample; i++, ientry++) {
+            ptr = next_pair(ptr, key, keybytes, value, valuebytes);
+            if (ientry < next) continue;
+
+            if (sbytes + keybytes > maxbytes) {
+                maxbytes = 2 * (sbytes + keybytes);
+                sbuf = (char *) memory->srealloc(sbuf, maxbytes, "MR:sbuf");
+            }
+            memcpy(&sbuf[sbytes], key, keybytes);
+            sbytes += keybytes;
+            slen[isample++] = keybytes;
+            next = (2 * isample + 1) * kv->nkv / (2 * nsample);
+        }
+    }
+
+    // gather all samples on proc 0
+
+    int nme = nsample;
+    int *counts = NULL;
+    int *displs = NULL;
+    int *bcounts = NULL;
+    int *bdispls = NULL;
+    int *alllen = NULL;
+    char *allbuf = NULL;
+    int ntotal = 0;
+    int nbytes = 0;
+
+    if (me == 0) {
+        counts = (int *) memory->smalloc(4 * nprocs * sizeof(int), "MR:counts");
+        displs = &counts[nprocs];
+        bcounts = &counts[2 * nprocs];
+        bdispls = &counts[3 * nprocs];
+    }
+    MPI_Gather(&nme, 1, MPI_INT, counts, 1, MPI_INT, 0, comm);
+    MPI_Gather(&sbytes, 1, MPI_INT, bcounts, 1, MPI_INT, 0, comm);
+
+    if (me == 0) {
+        for (i = 0; i < nprocs; i++) {
+            displs[i] = ntotal;
+            ntotal += counts[i];
+            bdispls[i] = nbytes;
+            nbytes += bcounts[i];
+        }
+        alllen = (int *) memory->smalloc(ntotal * sizeof(int), "MR:alllen");
+        allbuf = (char *) memory->smalloc(nbytes, "MR:allbuf");
+    }
+    MPI_Gatherv(slen, nme, MPI_INT, alllen, counts, displs, MPI_INT, 0, comm);
+    MPI_Gatherv(sbuf, sbytes, MPI_BYTE, allbuf, bcounts, bdispls, MPI_BYTE,
+                0, comm);
+
+    memory->sfree(slen);
+    memory->sfree(sbuf);
+
+    // proc 0 sorts samples via qsort() of order array
+    // splitter J = sample at position (J+1)*ntotal/P in sorted order
+    // pack splitter lengths and keys into splitbuf
+
+    nsplit = nprocs - 1;
+    splitlen = (int *) memory->smalloc(nsplit * sizeof(int), "MR:splitlen");
+    splitptr = (char **) memory->smalloc(nsplit * sizeof(char *), "MR:splitptr");
+    splitrank = (int *) memory->smalloc(2 * nsplit * sizeof(int), "MR:splitrank");
+    splitbuf = NULL;
+
+    if (me == 0) {
+        int *order = (int *) memory->smalloc(ntotal * sizeof(int), "MR:order");
+        dptr = (char **) memory->smalloc(ntotal * sizeof(char *), "MR:dptr");
+        slength = alllen;
+
+        ptr = allbuf;
+        for (i = 0; i < ntotal; i++) {
+            order[i] = i;
+            dptr[i] = ptr;
+            ptr += alllen[i];
+        }
+        qsort(order, ntotal, sizeof(int), compare_standalone);
+
+        // splitrank = range of sorted samples equal to each splitter
+
+        nbytes = 0;
+        if (ntotal)
+            for (j = 0; j < nsplit; j++) {
+                int isplit = (uint64_t) (j + 1) * ntotal / nprocs;
+                i = order[isplit];
+                splitlen[j] = alllen[i];
+                nbytes += alllen[i];
+
+                int lo = 0;
+                int hi = isplit;
+                while (lo < hi) {
+                    int mid = (lo + hi) / 2;
+                    if (compare_wrapper(order[mid], i) < 0) lo = mid + 1;
+                    else hi = mid;
+                }
+                splitrank[2 * j] = lo;
+                lo = isplit + 1;
+                hi = ntotal;
+                while (lo < hi) {
+                    int mid = (lo + hi) / 2;
+                    if (compare_wrapper(order[mid], i) <= 0) lo = mid + 1;
+                    else hi = mid;
+                }
+                splitrank[2 * j + 1] = lo;
+            }
+        splitbuf = (char *) memory->smalloc(nbytes, "MR:splitbuf");
+        ptr = splitbuf;
+        if (ntotal)
+            for (j = 0; j < nsplit; j++) {
+                i = order[(uint64_t) (j + 1) * ntotal / nprocs];
+                memcpy(ptr, dptr[i], alllen[i]);
+                ptr += alllen[i];
+            }
+
+        memory->sfree(order);
+        memory->sfree(dptr);
+        memory->sfree(alllen);
+        memory->sfree(allbuf);
+        memory->sfree(counts);
+    }
+
+    // no KV pairs on any proc means no splitters, all pairs stay on proc 0
+
+    MPI_Bcast(&ntotal, 1, MPI_INT, 0, comm);
+    nsampleall = ntotal;
+    if (ntotal == 0) {
+        nsplit = 0;
+        return;
+    }
+
+    MPI_Bcast(&nbytes, 1, MPI_INT, 0, comm);
+    if (me) splitbuf = (char *) memory->smalloc(nbytes, "MR:splitbuf");
+    MPI_Bcast(splitlen, nsplit, MPI_INT, 0, comm);
+    MPI_Bcast(splitrank, 2 * nsplit, MPI_INT, 0, comm);
+    MPI_Bcast(splitbuf, nbytes, MPI_BYTE, 0, comm);
+
+    ptr = splitbuf;
+    for (j = 0; j < nsplit; j++) {
+        splitptr[j] = ptr;
+        ptr += splitlen[j];
+    }
+}
+
+/* ----------------------------------------------------------------------
+   return proc that owns key in a global sort, called by aggregate_kv()
+   proc I owns keys between splitters I-1 and I
+   a key equal to one or more splitters can go to any proc bounded by
+     those splitters, so spread duplicate keys across those procs
+     in proportion to how many equal samples fell in each proc's range
+------------------------------------------------------------------------- */
+
+int MapReduce::splitter_proc(char *key, int keybytes, void *ptr)
+{
+    MapReduce *mr = (MapReduce *) ptr;
+    int lo, hi, mid;
 
-    compare = appcompare;
-    sort_kv(0);
+    // first = # of splitters < key
 
-    stats("Sort_keys", 0);
-    fcounter_sort = 0;
+    lo = 0;
+    hi = mr->nsplit;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (mr->compare(mr->splitptr[mid], mr->splitlen[mid], key, keybytes) < 0)
+            lo = mid + 1;
+        else hi = mid;
+    }
+    int first = lo;
 
-    uint64_t nkeyall;
-    MPI_Allreduce(&kv->nkv, &nkeyall, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
-    return nkeyall;
+    // last = # of splitters <= key
+
+    hi = mr->nsplit;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (mr->compare(mr->splitptr[mid], mr->splitlen[mid], key, keybytes) <= 0)
+            lo = mid + 1;
+        else hi = mid;
+    }
+    int last = lo;
+
+    if (first == last) return first;
+
+    // cycle thru ranks of equal samples, owner of rank V is smallest proc P
+    //   with (P+1)*nsampleall/nprocs > V, same as splitter choice
+
+    int ntotal = mr->nsampleall;
+    int nprocs = mr->nprocs;
+    int v = mr->splitrank[2 * first] +
+        mr->splitnext++ % (mr->splitrank[2 * first + 1] -
+                           mr->splitrank[2 * first]);
+    int proc = ((uint64_t) (v + 1) * nprocs + ntotal - 1) / ntotal - 1;
+    proc = MAX(proc, first);
+    proc = MIN(proc, last);
+    return proc;
 }
 
 /* ----------------------------------------------------------------------
-   sort values in a KV to create a new KV
-   use appcompare() to compare 2 values
-   each proc sorts only its data
+   sort keys (flag = 0) or values (flag = 1) in a KV to create a new KV
+   compare and sortflag/sortorder are already set by caller
 ------------------------------------------------------------------------- */
 
-uint64_t MapReduce::sort_values(int (*appcompare)(char *, int, char *, int))
+uint64_t MapReduce::sort_pairs(int flag)
 {
-    if (kv == NULL) error->all("Cannot sort_values without KeyValue");
+    if (kv == NULL) {
+        if (flag == 0) error->all("Cannot sort_keys without KeyValue");
+        else error->all("Cannot sort_values without KeyValue");
+    }
     if (timer) start_timer();
     if (verbosity) file_stats(0);
 
-    compare = appcompare;
-    sort_kv(1);
+    sort_kv(flag);
+
+    sortflag = 0;
+    sortorder = NULL;
 
-    stats("Sort_values", 0);
+    if (flag == 0) stats("Sort_keys", 0);
+    else stats("Sort_values", 0);
     fcounter_sort = 0;
 
     uint64_t nkeyall;
@@ -1892,7 +2940,7 @@ uint64_t MapReduce::sort_multivalues(int (*appcompare)(char *, int,
             ptr2 = scratch;
             for (j = 0; j < nvalues; j++) {
                 k = order[j];
-                memcpy(ptr2, &dptr[k], slength[k]);
+                memcpy(ptr2, dptr[k], slength[k]);
                 ptr2 += slength[k];
             }
             memcpy(multivalue, scratch, mvaluebytes);
@@ -1912,7 +2960,7 @@ uint64_t MapReduce::sort_multivalues(int (*appcompare)(char *, int,
     myfree(memtag1);
     myfree(memtag2);
 
-    stats("Sort_multivalues", 0);
+    stats("Sort_multivalues", 1);
 
     uint64_t nkeyall;
     MPI_Allreduce(&kmv->nkmv, &nkeyall, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
@@ -1926,97 +2974,147 @@ uint64_t MapReduce::sort_multivalues(int (*appcompare)(char *, int,
 
 void MapReduce::sort_kv(int flag)
 {
-    int nkey_kv, memtag, memtag1, memtag2, memtag_twopage, src1, src2;
+    int i, j, nkey_kv, memtag, memtag1, memtag2, memtag_twopage;
     uint64_t dummy, dummy1, dummy2, dummy3;
     char *page_kv;
-    void *src1ptr, *src2ptr, *destptr;
 
     mrptr = this;
     int npage_kv = kv->request_info(&page_kv);
     memtag = kv->memtag;
 
+    // nwork = pages of sort workspace, 2 records of 16 bytes per pair
+    // a variable-width pair is big enough for twopage to hold them,
+    //   a fixed-width pair may be as small as 8 bytes
+
+    int nwork = 2;
+    if (kfixed) nwork = MAX(2, (32 + fixbytes - 1) / fixbytes);
+
     // KV has single page
     // sort into newpage, assign newpage to KV, and return
+    // complete_dummy() matches complete() of procs with multi-page KVs
 
     if (npage_kv == 1) {
-        char *twopage = mymalloc(2, dummy, memtag_twopage);
+        char *twopage = mymalloc(nwork, dummy, memtag_twopage);
         char *newpage = mymalloc(1, dummy, memtag1);
         nkey_kv = kv->request_page(0, dummy1, dummy2, dummy3);
         sort_onepage(flag, nkey_kv, page_kv, newpage, twopage);
         myfree(memtag_twopage);
         myfree(memtag);
         kv->set_page(pagesize, newpage, memtag1);
+        kv->complete_dummy();
         return;
     }
 
     // KV has multiple pages
-    // perform merge sort, two sources at a time into destination
-    // each pass thru while loop increments I by 2 and N by 1
-    // sources can be sorted page or Spool file
-    // destination can be Spool file or final sorted KV
+    // sort each page and spill it as a sorted run to its own Spool file
+    // then merge all runs at once into final KV via a loser tree
+    // twopage,page1,page2 are split into equal-size read buffers, one per run
+    // if there are more runs than buffers, first merge groups of runs
+    //   into longer runs until they fit, via Spool files in page_kv
 
-    char *twopage = mymalloc(2, dummy, memtag_twopage);
+    char *twopage = mymalloc(nwork, dummy, memtag_twopage);
     char *page1 = mymalloc(1, dummy, memtag1);
     char *page2 = mymalloc(1, dummy, memtag2);
 
-    Spool **spools = new Spool*[2*npage_kv];
-    int n = npage_kv;
-    int i = 0;
-
-    while (i < n) {
-        if (i < npage_kv) {
-            kv->set_page(pagesize, page_kv, memtag);
-            nkey_kv = kv->request_page(i++, dummy1, dummy2, dummy3);
-            sort_onepage(flag, nkey_kv, page_kv, page1, twopage);
-            src1ptr = (void *) page1;
-            src1 = nkey_kv;
-        }
-        else {
-            spools[i]->set_page(pagesize, page1);
-            src1ptr = (void *) spools[i++];
-            src1 = 0;
-        }
-        if (i < npage_kv) {
-            kv->set_page(pagesize, page_kv, memtag);
-            nkey_kv = kv->request_page(i++, dummy1, dummy2, dummy3);
-            sort_onepage(flag, nkey_kv, page_kv, page2, twopage);
-            src2ptr = (void *) page2;
-            src2 = nkey_kv;
-        }
-        else {
-            spools[i]->set_page(pagesize, page2);
-            src2ptr = (void *) spools[i++];
-            src2 = 0;
-        }
+    // bufsize = size of each read buffer and of each Spool page in a run
+    // start with buffers for all runs if they are at least MERGEBUF
+    // bufsize >= msize, so every KV pair fits in one buffer
+
+    uint64_t minbuf = MIN(MERGEBUF, pagesize);
+    minbuf = MAX(minbuf, kv->msize);
+    int nwant = MIN(npage_kv, MAXMERGE);
+    uint64_t bufsize;
+    int nslice = merge_slices(nwant, minbuf, bufsize);
+
+    Spool **runs = new Spool*[npage_kv];
+    char *ptr, *str;
+    int len, nbytes;
+
+    for (i = 0; i < npage_kv; i++) {
+        nkey_kv = kv->request_page(i, dummy1, dummy2, dummy3);
+        sort_onepage(flag, nkey_kv, page_kv, page1, twopage);
+
+        runs[i] = new Spool(SORTFILE, this, memory, error);
+        runs[i]->set_page(bufsize, page2);
 
-        if (i < n) {
-            spools[n] = new Spool(SORTFILE, this, memory, error);
-            spools[n]->set_page(pagesize, page_kv);
-            destptr = (void *) spools[n];
-            merge(flag, src1, src1ptr, src2, src2ptr, 0, destptr);
-            if (!src1) delete spools[i-2];
-            if (!src2) delete spools[i-1];
-            spools[n++]->complete();
+        ptr = page1;
+        for (j = 0; j < nkey_kv; j++) {
+            len = extract(flag, ptr, str, nbytes);
+            runs[i]->add(len, ptr);
+            ptr += len;
         }
-        else {
-            delete kv;
-            kv = new KeyValue(this, kalign, valign, memory, error, comm);
-            kv->set_page(pagesize, page_kv, memtag);
-            destptr = (void *) kv;
-            merge(flag, src1, src1ptr, src2, src2ptr, 1, destptr);
-            if (!src1) delete spools[i-2];
-            if (!src2) delete spools[i-1];
-            kv->complete();
+        runs[i]->complete();
+    }
+
+    // all pages are now in runs, replace KV with an empty KV
+
+    delete kv;
+    kv = new KeyValue(this, kalign, valign, memory, error, comm);
+    kv->set_page(pagesize, page_kv, memtag);
+
+    char **bufs = new char*[nslice];
+    int nper = pagesize / bufsize;
+    for (j = 0; j < nper; j++) {
+        bufs[j] = &twopage[j * bufsize];
+        bufs[nper + j] = &twopage[pagesize + j * bufsize];
+        bufs[2 * nper + j] = &page1[j * bufsize];
+        bufs[3 * nper + j] = &page2[j * bufsize];
+    }
+
+    // merge passes until all runs can be merged together
+    // each pass merges groups of nslice runs into one longer run
+
+    int nrun = npage_kv;
+    int nmerge = MIN(nslice, MAXMERGE);
+
+    while (nrun > nmerge) {
+        int nnew = 0;
+        for (i = 0; i < nrun; i += nmerge) {
+            int n = MIN(nmerge, nrun - i);
+            if (n == 1) {
+                runs[nnew++] = runs[i];
+                continue;
+            }
+            Spool *spool = new Spool(SORTFILE, this, memory, error);
+            spool->set_page(bufsize, page_kv);
+            merge_runs(flag, n, &runs[i], bufs, bufsize, 0, spool);
+            for (j = 0; j < n; j++) delete runs[i + j];
+            spool->complete();
+            runs[nnew++] = spool;
         }
+        nrun = nnew;
     }
 
-    delete [] spools;
+    merge_runs(flag, nrun, runs, bufs, bufsize, 1, kv);
+    for (i = 0; i < nrun; i++) delete runs[i];
+    kv->complete();
+
+    delete [] runs;
+    delete [] bufs;
 
     myfree(memtag_twopage);
     myfree(memtag1);
     myfree(memtag2);
 }
 
+/* ----------------------------------------------------------------------
+   choose size of read buffers for merging runs
+   each of 4 pages is split into nper buffers, 4*nper >= nwant if possible
+   bufsize = buffer size, multiple of ALIGNFILE and >= minbuf
+   return # of buffers
+------------------------------------------------------------------------- */
+
+int MapReduce::merge_slices(int nwant, uint64_t minbuf, uint64_t &bufsize)
+{
+    minbuf = roundup(minbuf, ALIGNFILE);
+    int nper = (nwant + 3) / 4;
+    while (nper > 1 && pagesize / nper / ALIGNFILE * ALIGNFILE < minbuf)
+        nper--;
+    bufsize = pagesize / nper / ALIGNFILE * ALIGNFILE;
+    if (bufsize < minbuf) bufsize = pagesize;
+    return 4 * nper;
+}
+
 /* ----------------------------------------------------------------------
    sort keys or values in one page of a KV to create a new KV
    flag = 0 for sort keys, flag = 1 for sort values
@@ -2031,6 +3129,11 @@ void MapReduce::sort_onepage(int flag, int nkey_kv,
     int keybytes, valuebytes;
     char *ptr, *key, *value;
 
+    if (sortflag && pagesize / talign <= UINT32_MAX) {
+        sort_builtin(flag, nkey_kv, pagesrc, pagedest, twopage);
+        return;
+    }
+
     // setup 3 arrays from twopage of memory
     // order = ordering of keys or values in KV, initially 0 to N-1
     // slength = length of each key or value
@@ -2045,18 +3148,7 @@ void MapReduce::sort_onepage(int flag, int nkey_kv,
 
     for (i = 0; i < nkey_kv; i++) {
         order[i] = i;
-
-        keybytes = *((int *) ptr);
-        valuebytes = *((int *)(ptr + sizeof(int)));;
-
-        ptr += twolenbytes;
-        ptr = ROUNDUP(ptr, kalignm1);
-        key = ptr;
-        ptr += keybytes;
-        ptr = ROUNDUP(ptr, valignm1);
-        value = ptr;
-        ptr += valuebytes;
-        ptr = ROUNDUP(ptr, talignm1);
+        ptr = next_pair(ptr, key, keybytes, value, valuebytes);
 
         if (flag == 0) {
             slength[i] = keybytes;
@@ -2068,10 +3160,20 @@ void MapReduce::sort_onepage(int flag, int nkey_kv,
         }
     }
 
-    // sort keys or values via qsort()
+    // sort keys or values via qsort() or templated comparator
     // simply creates new order array
 
-    qsort(order, nkey_kv, sizeof(int), compare_standalone);
+    if (sortorder) sortorder(sortobj, order, dptr, slength, nkey_kv);
+    else qsort(order, nkey_kv, sizeof(int), compare_standalone);
+
+    // fixed-width pairs: pair I is at I*fixbytes, copy whole pairs
+
+    if (kfixed) {
+        for (i = 0; i < nkey_kv; i++)
+            memcpy(pagedest + (uint64_t) i * fixbytes,
+                   pagesrc + (uint64_t) order[i] * fixbytes, fixbytes);
+        return;
+    }
 
     // dptr = start of each KV pair
     // slength = length of entire KV pair
@@ -2080,16 +3182,7 @@ void MapReduce::sort_onepage(int flag, int nkey_kv,
 
     for (i = 0; i < nkey_kv; i++) {
         dptr[i] = ptr;
-        keybytes = *((int *) ptr);
-        valuebytes = *((int *)(ptr + sizeof(int)));;
-
-        ptr += twolenbytes;
-        ptr = ROUNDUP(ptr, kalignm1);
-        ptr += keybytes;
-        ptr = ROUNDUP(ptr, valignm1);
-        ptr += valuebytes;
-        ptr = ROUNDUP(ptr, talignm1);
-
+        ptr = next_pair(ptr, key, keybytes, value, valuebytes);
         slength[i] = ptr - dptr[i];
     }
 
@@ -2104,104 +3197,273 @@ void MapReduce::sort_onepage(int flag, int nkey_kv,
 }
 
 /* ----------------------------------------------------------------------
-   merge of 2 sources into a destination
-   flag = 0 for key sort, flag = 1 for value sort
-   src1,src2 can each be Spool file (src = 0) or KV page (src = nkey_kv)
-   dest can be Spool file (dest = 0)  or final KV (dest = 1)
+   sort keys or values in one page by built-in sortflag order
+   flag = 0 for sort keys, flag = 1 for sort values
+   each sort record holds the KV pair offset in units of talign
 ------------------------------------------------------------------------- */
 
-void MapReduce::merge(int flag, int src1, void *src1ptr,
-                      int src2, void *src2ptr, int dest, void *destptr)
+void MapReduce::sort_builtin(int flag, int nkey_kv,
+                             char *pagesrc, char *pagedest, char *twopage)
 {
-    int result, ientry1, ientry2, nbytes1, nbytes2, ipage1, ipage2;
-    int npage1, npage2, nentry1, nentry2;
-    char *str1, *str2, *page1, *page2;
-    Spool *sp1, *sp2, *spdest;
-    KeyValue *kvdest;
+    int style = abs(sortflag);
+    if (style == 1 || style == 3)
+        sort_radix<uint32_t>(flag, nkey_kv, pagesrc, pagedest, twopage);
+    else if (style == 2 || style == 4)
+        sort_radix<uint64_t>(flag, nkey_kv, pagesrc, pagedest, twopage);
+    else sort_strings(flag, nkey_kv, pagesrc, pagedest, twopage);
+}
+
+/* ----------------------------------------------------------------------
+   LSD radix sort of fixed-width keys or values, 8 bits per pass
+   each datum is mapped to an unsigned T with the same order:
+     sign bit flipped for int, all bits flipped for negative float/double,
+     all bits inverted for descending order
+   passes where all records share one digit are skipped
+   two arrays of records fit in twopage, see sort_kv()
+------------------------------------------------------------------------- */
+
+template <class T>
+void MapReduce::sort_radix(int flag, int nkey_kv,
+                           char *pagesrc, char *pagedest, char *twopage)
+{
+    struct Record {
+        T key;
+        uint32_t offset;
+    };
+
+    int i, nbytes, len, pass;
+    char *ptr, *str;
+    T u;
+
+    Record *rec = (Record *) twopage;
+    Record *tmp = rec + nkey_kv;
+    int style = abs(sortflag);
+    const T topbit = ((T) 1) << (8*sizeof(T) - 1);
+
+    uint64_t count[sizeof(T)][256];
+    memset(count, 0, sizeof(count));
 
-    if (src1) {
-        npage1 = 1;
-        page1 = (char *) src1ptr;
-        nentry1 = src1;
+    ptr = pagesrc;
+    for (i = 0; i < nkey_kv; i++) {
+        rec[i].offset = (ptr - pagesrc) / talign;
+        ptr += extract(flag, ptr, str, nbytes);
+        if (nbytes != sizeof(T))
+            error->one("Sort_keys/values flag does not match "
+                       "key or value size");
+
+        memcpy(&u, str, sizeof(T));
+        if (style == 1) u ^= topbit;
+        else if (style == 3 || style == 4) u = (u & topbit) ? ~u : u | topbit;
+        if (sortflag < 0) u = ~u;
+        rec[i].key = u;
+
+        for (pass = 0; pass < (int) sizeof(T); pass++)
+            count[pass][(u >> (8*pass)) & 0xFF]++;
     }
-    else {
-        sp1 = (Spool *) src1ptr;
-        npage1 = sp1->request_info(&page1);
-        nentry1 = sp1->request_page(0);
+
+    for (pass = 0; pass < (int) sizeof(T); pass++) {
+        uint64_t *bucket = count[pass];
+        if (bucket[(rec[0].key >> (8*pass)) & 0xFF] == (uint64_t) nkey_kv)
+            continue;
+
+        uint64_t sum = 0;
+        for (i = 0; i < 256; i++) {
+            uint64_t n = bucket[i];
+            bucket[i] = sum;
+            sum += n;
+        }
+        for (i = 0; i < nkey_kv; i++)
+            tmp[bucket[(rec[i].key >> (8*pass)) & 0xFF]++] = rec[i];
+
+        Record *swap = rec;
+        rec = tmp;
+        tmp = swap;
     }
-    if (src2) {
-        npage2 = 1;
-        page2 = (char *) src2ptr;
-        nentry2 = src2;
+
+    // reorder KV pairs into dest page
+
+    char *dest = pagedest;
+    for (i = 0; i < nkey_kv; i++) {
+        ptr = pagesrc + ((uint64_t) rec[i].offset) * talign;
+        len = extract(flag, ptr, str, nbytes);
+        memcpy(dest, ptr, len);
+        dest += len;
     }
-    else {
-        sp2 = (Spool *) src2ptr;
-        npage2 = sp2->request_info(&page2);
-        nentry2 = sp2->request_page(0);
+}
+
+/* ----------------------------------------------------------------------
+   sort strings (sortflag = 5) or byte strings (sortflag = 6)
+   records hold the first 8 bytes big-endian so most comparisons
+     are a single integer compare, full compare only on ties
+------------------------------------------------------------------------- */
+
+void MapReduce::sort_strings(int flag, int nkey_kv,
+                             char *pagesrc, char *pagedest, char *twopage)
+{
+    struct Record {
+        uint64_t prefix;
+        uint32_t offset;
+    };
+
+    struct Less {
+        MapReduce *mr;
+        int flag;
+        char *page;
+        bool operator()(const Record &a, const Record &b) const {
+            if (a.prefix != b.prefix) return a.prefix < b.prefix;
+            char *str1, *str2;
+            int n1, n2;
+            mr->extract(flag, page + ((uint64_t) a.offset) * mr->talign,
+                        str1, n1);
+            mr->extract(flag, page + ((uint64_t) b.offset) * mr->talign,
+                        str2, n2);
+            return compare_builtin(str1, n1, str2, n2) < 0;
+        }
+    };
+
+    int i, j, nbytes, len;
+    char *ptr, *str;
+
+    Record *rec = (Record *) twopage;
+
+    ptr = pagesrc;
+    for (i = 0; i < nkey_kv; i++) {
+        rec[i].offset = (ptr - pagesrc) / talign;
+        ptr += extract(flag, ptr, str, nbytes);
+
+        uint64_t prefix = 0;
+        for (j = 0; j < 8; j++) {
+            prefix <<= 8;
+            if (j < nbytes && (sortflag == 6 || sortflag == -6 || str[j]))
+                prefix |= (unsigned char) str[j];
+            else if (j < nbytes) nbytes = j;
+        }
+        if (sortflag < 0) prefix = ~prefix;
+        rec[i].prefix = prefix;
     }
 
-    if (dest) kvdest = (KeyValue *) destptr;
-    else spdest = (Spool *) destptr;
+    Less less = {this, flag, pagesrc};
+    std::sort(rec, rec + nkey_kv, less);
+
+    // reorder KV pairs into dest page
+
+    char *dest = pagedest;
+    for (i = 0; i < nkey_kv; i++) {
+        ptr = pagesrc + ((uint64_t) rec[i].offset) * talign;
+        len = extract(flag, ptr, str, nbytes);
+        memcpy(dest, ptr, len);
+        dest += len;
+    }
+}
+
+/* ----------------------------------------------------------------------
+   merge N sorted runs into a destination
+   flag = 0 for key sort, flag = 1 for value sort
+   runs are Spool files, each read thru its own buffer of bufsize
+   dest can be Spool file (dest = 0) or final KV (dest = 1)
+   loser tree: tree[0] = run with smallest current entry,
+     tree[K] = loser of the match at internal node K = 1 to N-1,
+     run I is leaf N+I, node K has children 2K and 2K+1
+   ties go to the lower run, so equal entries keep their page order
+------------------------------------------------------------------------- */
+
+void MapReduce::merge_runs(int flag, int nrun, Spool **spools, char **bufs,
+                           uint64_t bufsize, int dest, void *destptr)
+{
+    int i, k, w, a, b;
+    MergeRun *r;
+
+    MergeRun *runs =
+        (MergeRun *) memory->smalloc(nrun * sizeof(MergeRun), "MR:runs");
+    int *tree = (int *) memory->smalloc(nrun * sizeof(int), "MR:tree");
+    int *winner = (int *) memory->smalloc(2 * nrun * sizeof(int), "MR:tree");
+
+    for (i = 0; i < nrun; i++) {
+        r = &runs[i];
+        r->spool = spools[i];
+        r->spool->set_page(bufsize, bufs[i]);
+        r->npage = r->spool->request_info(&r->page);
+        r->ipage = 0;
+        r->nentry = r->spool->request_page(0);
+        r->ientry = 0;
+        r->ptr = r->page;
+        if (r->nentry) r->len = extract(flag, r->ptr, r->str, r->nbytes);
+        else r->ptr = NULL;
+    }
 
-    ipage1 = ipage2 = 0;
-    ientry1 = ientry2 = 0;
+    // build tree bottom up, winner[K] = winner of the match at node K
+
+    for (i = 0; i < nrun; i++) winner[nrun + i] = i;
+    for (k = nrun - 1; k >= 1; k--) {
+        a = winner[2 * k];
+        b = winner[2 * k + 1];
+        if (merge_less(runs, a, b)) {
+            winner[k] = a;
+            tree[k] = b;
+        }
+        else {
+            winner[k] = b;
+            tree[k] = a;
+        }
+    }
+    tree[0] = winner[1];
+    memory->sfree(winner);
 
-    char *ptr1 = page1;
-    char *ptr2 = page2;
-    int len1 = extract(flag, ptr1, str1, nbytes1);
-    int len2 = extract(flag, ptr2, str2, nbytes2);
+    KeyValue *kvdest;
+    Spool *spdest;
+    if (dest) kvdest = (KeyValue *) destptr;
+    else spdest = (Spool *) destptr;
 
-    int done = 0;
+    // output winner, advance its run, replay matches from its leaf to root
 
     while (1) {
-        if (done == 0) result = compare(str1, nbytes1, str2, nbytes2);
-
-        if (result <= 0) {
-            if (dest) kvdest->add(ptr1);
-            else spdest->add(len1, ptr1);
-            ptr1 += len1;
-            ientry1++;
-
-            if (ientry1 == nentry1) {
-                ipage1++;
-                if (ipage1 < npage1) {
-                    nentry1 = sp1->request_page(ipage1);
-                    ientry1 = 0;
-                    ptr1 = page1;
-                    len1 = extract(flag, ptr1, str1, nbytes1);
-                }
-                else {
-                    done++;
-                    if (done == 2) break;
-                    result = 1;
-                }
+        w = tree[0];
+        r = &runs[w];
+        if (r->ptr == NULL) break;
+
+        if (dest) kvdest->add(r->ptr);
+        else spdest->add(r->len, r->ptr);
+
+        r->ptr += r->len;
+        r->ientry++;
+        if (r->ientry == r->nentry) {
+            r->ipage++;
+            if (r->ipage < r->npage) {
+                r->nentry = r->spool->request_page(r->ipage);
+                r->ientry = 0;
+                r->ptr = r->page;
             }
-            else len1 = extract(flag, ptr1, str1, nbytes1);
+            else r->ptr = NULL;
         }
+        if (r->ptr) r->len = extract(flag, r->ptr, r->str, r->nbytes);
 
-        if (result >= 0) {
-            if (dest) kvdest->add(ptr2);
-            else spdest->add(len2, ptr2);
-            ptr2 += len2;
-            ientry2++;
-
-            if (ientry2 == nentry2) {
-                ipage2++;
-                if (ipage2 < npage2) {
-                    nentry2 = sp2->request_page(ipage2);
-                    ientry2 = 0;
-                    ptr2 = page2;
-                    len2 = extract(flag, ptr2, str2, nbytes2);
-                }
-                else {
-                    done++;
-                    if (done == 2) break;
-                    result = -1;
-                }
+        for (k = (nrun + w) / 2; k >= 1; k /= 2)
+            if (merge_less(runs, tree[k], w)) {
+                a = tree[k];
+                tree[k] = w;
+                w = a;
             }
-            else len2 = extract(flag, ptr2, str2, nbytes2);
-        }
+        tree[0] = w;
     }
+
+    memory->sfree(runs);
+    memory->sfree(tree);
+}
+
+/* ----------------------------------------------------------------------
+   return 1 if current entry of run A sorts before that of run B
+   an exhausted run sorts after all entries
+------------------------------------------------------------------------- */
+
+int MapReduce::merge_less(MergeRun *runs, int a, int b)
+{
+    MergeRun *ra = &runs[a];
+    MergeRun *rb = &runs[b];
+    if (ra->ptr == NULL) return 0;
+    if (rb->ptr == NULL) return 1;
+    int result = compare(ra->str, ra->nbytes, rb->str, rb->nbytes);
+    if (result) return result < 0;
+    return a < b;
 }
 
 /* ----------------------------------------------------------------------
@@ -2213,18 +3475,9 @@ void MapReduce::merge(int flag, int src1, void *src1ptr,
 
 int MapReduce::extract(int flag, char *ptr_start, char *&str, int &nbytes)
 {
-    char *ptr = ptr_start;
-    int keybytes = *((int *) ptr);
-    int valuebytes = *((int *)(ptr + sizeof(int)));;
-
-    ptr += twolenbytes;
-    ptr = ROUNDUP(ptr, kalignm1);
-    char *key = ptr;
-    ptr += keybytes;
-    ptr = ROUNDUP(ptr, valignm1);
-    char *value = ptr;
-    ptr += valuebytes;
-    ptr = ROUNDUP(ptr, talignm1);
+    char *key, *value;
+    int keybytes, valuebytes;
+    char *ptr = next_pair(ptr_start, key, keybytes, value, valuebytes);
 
     if (flag == 0) {
         str = key;
@@ -2258,6 +3511,64 @@ int MapReduce::compare_wrapper(int i, int j)
     return compare(dptr[i], slength[i], dptr[j], slength[j]);
 }
 
+/* ----------------------------------------------------------------------
+   comparison for built-in sortflag of MR currently sorting
+   used when merging sorted pages
+------------------------------------------------------------------------- */
+
+int MapReduce::compare_builtin(char *p1, int len1, char *p2, int len2)
+{
+    int flag = mrptr->sortflag;
+    int result = 0;
+
+    switch (abs(flag)) {
+    case 1: {
+        int i1, i2;
+        memcpy(&i1, p1, sizeof(int));
+        memcpy(&i2, p2, sizeof(int));
+        result = (i1 > i2) - (i1 < i2);
+        break;
+    }
+    case 2: {
+        uint64_t u1, u2;
+        memcpy(&u1, p1, sizeof(uint64_t));
+        memcpy(&u2, p2, sizeof(uint64_t));
+        result = (u1 > u2) - (u1 < u2);
+        break;
+    }
+    case 3: {
+        float f1, f2;
+        memcpy(&f1, p1, sizeof(float));
+        memcpy(&f2, p2, sizeof(float));
+        result = (f1 > f2) - (f1 < f2);
+        if (result == 0 && signbit(f1) != signbit(f2))
+            result = signbit(f1) ? -1 : 1;
+        break;
+    }
+    case 4: {
+        double d1, d2;
+        memcpy(&d1, p1, sizeof(double));
+        memcpy(&d2, p2, sizeof(double));
+        result = (d1 > d2) - (d1 < d2);
+        if (result == 0 && signbit(d1) != signbit(d2))
+            result = signbit(d1) ? -1 : 1;
+        break;
+    }
+    case 5:
+        result = strcmp(p1, p2);
+        result = (result > 0) - (result < 0);
+        break;
+    case 6:
+        result = memcmp(p1, p2, MIN(len1, len2));
+        result = (result > 0) - (result < 0);
+        if (result == 0) result = (len1 > len2) - (len1 < len2);
+        break;
+    }
+
+    if (flag < 0) return -result;
+    return result;
+}
+
 /* ----------------------------------------------------------------------
    print stats for KV
 ------------------------------------------------------------------------- */
@@ -2352,19 +3663,25 @@ void MapReduce::cummulative_stats(int level, int reset)
     uint64_t size[2] = {rsize, wsize};
     uint64_t allsize[2];
     MPI_Allreduce(size, allsize, 2, MPI_UNSIGNED_LONG, MPI_SUM, comm);
+    double allstall;
+    MPI_Allreduce(&iostall, &allstall, 1, MPI_DOUBLE, MPI_SUM, comm);
 
     if (allsize[0] || allsize[1]) {
-        if (me == 0) printf("Cummulative I/O = %.3g Mb read, %.3g Mb write\n",
-                                allsize[0] / mbyte, allsize[1] / mbyte);
+        if (me == 0) printf("Cummulative I/O = %.3g Mb read, %.3g Mb write, "
+                                "%.3g secs stalled\n",
+                                allsize[0] / mbyte, allsize[1] / mbyte,
+                                allstall / nprocs);
 
         if (level == 2) {
             write_histo(size[0] / mbyte, "  Read (Mb):");
             write_histo(size[1] / mbyte, "  Write (Mb):");
+            write_histo(iostall, "  Stall (secs):");
         }
     }
 
     if (reset) {
         rsize = wsize = 0;
+        iostall = 0.0;
         cssize = crsize = 0;
     }
 }
@@ -2381,6 +3698,181 @@ void MapReduce::set_fpath(const char *str)
     int n = strlen(str) + 1;
     fpath = new char[n];
     strcpy(fpath, str);
+    fpath_parse();
+}
+
+/* ----------------------------------------------------------------------
+   set or clear (NULL) the map-side combiner used by map() and open()
+   appcombine(key,keybytes,value,valuebytes,value2,valuebytes2,appptr)
+     folds value2 into value in place, e.g. adds a count or sum
+     must be associative and commutative, value length does not change
+   pairs emitted by appmap() are folded by key into a 1-page table
+     and flushed to the KV when the table fills and when map() or close() ends
+   only pairs with the same key and value length are folded
+------------------------------------------------------------------------- */
+
+void MapReduce::set_combiner(void (*appcombine_caller)(char *, int, char *,
+                                                       int, char *, int,
+                                                       void *),
+                             void *appptr)
+{
+    appcombine = appcombine_caller;
+    appcombineptr = appptr;
+}
+
+/* ----------------------------------------------------------------------
+   set or clear (NULL) the 64-bit key hash used by aggregate() w/out a hash,
+     convert(), collate() and the combiner, NULL = hashkey() in hash.h
+   apphash(key,keybytes) must mix all 64 bits well,
+     disjoint bit ranges pick the proc, table slot and partition of a key
+------------------------------------------------------------------------- */
+
+void MapReduce::set_hash(uint64_t (*apphash_caller)(char *, int))
+{
+    apphash = apphash_caller;
+}
+
+/* ----------------------------------------------------------------------
+   allocate a page for the combiner table and attach it to kv_dest
+   called by map() and open() before pairs are added
+   a table left by open() without close() is discarded
+------------------------------------------------------------------------- */
+
+void MapReduce::combine_start(KeyValue *kv_dest)
+{
+    if (combinetag >= 0) myfree(combinetag);
+    combinetag = -1;
+    if (appcombine == NULL) return;
+
+    uint64_t combinesize;
+    char *combinepage = mymalloc(1, combinesize, combinetag);
+    kv_dest->combine_start(appcombine, appcombineptr, combinesize, combinepage);
+}
+
+/* ----------------------------------------------------------------------
+   flush the combiner table into kv_dest and release its page
+   called by map() and close() before kv_dest->complete()
+------------------------------------------------------------------------- */
+
+void MapReduce::combine_stop(KeyValue *kv_dest)
+{
+    if (combinetag < 0) return;
+
+    kv_dest->combine_stop();
+    myfree(combinetag);
+    combinetag = -1;
+}
+
+/* ----------------------------------------------------------------------
+   parse fpath into list of dirs
+   tiers are separated by ';', dirs within a tier by ','
+   each dir is path[*weight][@maxMb]
+   e.g. "/dev/shm@2048;/nvme0*2,/nvme1*2;/scratch"
+------------------------------------------------------------------------- */
+
+void MapReduce::fpath_parse()
+{
+    for (int i = 0; i < nfdir; i++) delete [] fdirs[i].path;
+    nfdir = ntier = 0;
+
+    int n = strlen(fpath) + 1;
+    char *copy = new char[n];
+    strcpy(copy, fpath);
+
+    char *tiersave, *dirsave;
+    char *tier = strtok_r(copy, ";", &tiersave);
+    while (tier) {
+        int ndir = 0;
+        char *dir = strtok_r(tier, ",", &dirsave);
+        while (dir) {
+            char *ptr;
+            uint64_t maxmb = 0;
+            int weight = 1;
+            if ((ptr = strrchr(dir, '@'))) {
+                *ptr = '\0';
+                maxmb = strtoull(ptr + 1, NULL, 10);
+                if (maxmb == 0) error->all("Invalid fpath setting");
+            }
+            if ((ptr = strrchr(dir, '*'))) {
+                *ptr = '\0';
+                weight = atoi(ptr + 1);
+                if (weight <= 0) error->all("Invalid fpath setting");
+            }
+            if (strlen(dir) == 0) error->all("Invalid fpath setting");
+
+            fdirs = (FileDir *)
+                    memory->srealloc(fdirs, (nfdir + 1) * sizeof(FileDir),
+                                     "MR:fdirs");
+            FileDir *fd = &fdirs[nfdir++];
+            fd->path = new char[strlen(dir) + 1];
+            strcpy(fd->path, dir);
+            fd->tier = ntier;
+            fd->weight = weight;
+            fd->credit = 0;
+            fd->maxsize = maxmb * 1024 * 1024;
+            fd->size = 0;
+            ndir++;
+
+            dir = strtok_r(NULL, ",", &dirsave);
+        }
+        if (ndir) ntier++;
+        tier = strtok_r(NULL, ";", &tiersave);
+    }
+
+    delete [] copy;
+    if (nfdir == 0) error->all("Invalid fpath setting");
+}
+
+/* ----------------------------------------------------------------------
+   select dir for a new file
+   use first tier with a dir under its size limit and with free space,
+     else use last tier regardless of limits
+   within a tier, pick by weighted round-robin or by most free space
+------------------------------------------------------------------------- */
+
+int MapReduce::fpath_select()
+{
+    if (nfdir == 1) return 0;
+
+    struct statvfs sbuf;
+    double *space = new double[nfdir];
+    int pick = -1;
+
+    for (int itier = 0; itier < ntier && pick < 0; itier++) {
+        int last = (itier == ntier - 1);
+        int total = 0;
+        for (int i = 0; i < nfdir; i++) {
+            space[i] = -1.0;
+            if (fdirs[i].tier != itier) continue;
+            if (!last && fdirs[i].maxsize && fdirs[i].size >= fdirs[i].maxsize)
+                continue;
+            if ((!last || fpathstyle == 1) && statvfs(fdirs[i].path, &sbuf) == 0) {
+                double avail = (double) sbuf.f_bavail * sbuf.f_frsize;
+                if (!last && avail < pagesize) continue;
+                space[i] = avail * fdirs[i].weight;
+            }
+            else space[i] = 0.0;
+            total += fdirs[i].weight;
+        }
+        if (total == 0) continue;
+
+        if (fpathstyle == 1) {
+            for (int i = 0; i < nfdir; i++)
+                if (space[i] >= 0.0 && (pick < 0 || space[i] > space[pick]))
+                    pick = i;
+        }
+        else {
+            for (int i = 0; i < nfdir; i++) {
+                if (space[i] < 0.0) continue;
+                fdirs[i].credit += fdirs[i].weight;
+                if (pick < 0 || fdirs[i].credit > fdirs[pick].credit) pick = i;
+            }
+            fdirs[pick].credit -= total;
+        }
+    }
+
+    delete [] space;
+    return pick;
 }
 
 /* ----------------------------------------------------------------------
@@ -2401,8 +3893,27 @@ void MapReduce::mr_stats(int level)
                "%.3g Mb hi-water for files\n",
                npages, npages * pagesize / mbyte, fsizemaxall / mbyte);
 
+    // page allocator: peak pages in use, failed contiguous requests,
+    //   fragmentation = 1 - largest free run / free pages
+
+    int maxcontig, dummy;
+    memquery(maxcontig, dummy);
+    double frag = nfree ? 1.0 - (double) maxcontig / nfree : 0.0;
+
+    int npeaks, nfails;
+    double fragmax;
+    MPI_Allreduce(&npeak, &npeaks, 1, MPI_INT, MPI_SUM, comm);
+    MPI_Allreduce(&nfailcontig, &nfails, 1, MPI_INT, MPI_SUM, comm);
+    MPI_Allreduce(&frag, &fragmax, 1, MPI_DOUBLE, MPI_MAX, comm);
+
+    if (me == 0)
+        printf("MapReduce page stats = %d peak pages in use, "
+               "%d failed contiguous requests, %.3g max fragmentation\n",
+               npeaks, nfails, fragmax);
+
     if (level == 2) {
         if (npages) write_histo((double) npage, "  Pages:");
+        if (npeaks) write_histo((double) npeak, "  PeakPages:");
         if (fsizemaxall) write_histo(fsizemax / mbyte, "  HiWater:");
     }
 }
@@ -2456,12 +3967,16 @@ void MapReduce::stats(const char *heading, int which)
 
     MPI_Allreduce(&rsize_one, &rall, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
     MPI_Allreduce(&wsize_one, &wall, 1, MPI_UNSIGNED_LONG, MPI_SUM, comm);
+    double stallall;
+    MPI_Allreduce(&iostall_one, &stallall, 1, MPI_DOUBLE, MPI_SUM, comm);
     if (rall || wall) {
-        if (me == 0) printf("%s I/O = %.3g Mb read, %.3g Mb write\n", heading,
-                                rall / mbyte, wall / mbyte);
+        if (me == 0) printf("%s I/O = %.3g Mb read, %.3g Mb write, "
+                                "%.3g secs stalled\n", heading,
+                                rall / mbyte, wall / mbyte, stallall / nprocs);
         if (verbosity == 2) {
             write_histo(rsize_one / mbyte, "  Read (Mb):");
             write_histo(wsize_one / mbyte, "  Write (Mb):");
+            write_histo(iostall_one, "  Stall (secs):");
         }
     }
 
@@ -2483,25 +3998,29 @@ void MapReduce::stats(const char *heading, int which)
 /* ----------------------------------------------------------------------
    create a filename with increasing counter for
      KV, KMV, Sort, Partition, Spool
+   idir = index of fpath dir the file is placed in
    return filename, caller will delete it
 ------------------------------------------------------------------------- */
 
-char *MapReduce::file_create(int style)
+char *MapReduce::file_create(int style, int &idir)
 {
-    int n = strlen(fpath) + 32;
+    idir = fpath_select();
+    char *dir = fdirs[idir].path;
+
+    int n = strlen(dir) + 32;
     char *fname = new char[n];
     if (style == KVFILE)
-        sprintf(fname, "%s/mrmpi.kv.%d.%d.%d", fpath, instance_me, fcounter_kv++, me);
+        sprintf(fname, "%s/mrmpi.kv.%d.%d.%d", dir, instance_me, fcounter_kv++, me);
     else if (style == KMVFILE)
-        sprintf(fname, "%s/mrmpi.kmv.%d.%d.%d", fpath, instance_me, fcounter_kmv++, me);
+        sprintf(fname, "%s/mrmpi.kmv.%d.%d.%d", dir, instance_me, fcounter_kmv++, me);
     else if (style == SORTFILE)
-        sprintf(fname, "%s/mrmpi.sort.%d.%d.%d", fpath, instance_me,
+        sprintf(fname, "%s/mrmpi.sort.%d.%d.%d", dir, instance_me,
                 fcounter_sort++, me);
     else if (style == PARTFILE)
-        sprintf(fname, "%s/mrmpi.part.%d.%d.%d", fpath, instance_me,
+        sprintf(fname, "%s/mrmpi.part.%d.%d.%d", dir, instance_me,
                 fcounter_part++, me);
     else if (style == SETFILE)
-        sprintf(fname, "%s/mrmpi.set.%d.%d.%d", fpath, instance_me,
+        sprintf(fname, "%s/mrmpi.set.%d.%d.%d", dir, instance_me,
                 fcounter_set++, me);
     return fname;
 }
@@ -2517,12 +4036,14 @@ void MapReduce::file_stats(int flag)
     if (flag == 0) {
         rsize_one = rsize;
         wsize_one = wsize;
+        iostall_one = iostall;
         cssize_one = cssize;
         crsize_one = crsize;
     }
     else {
         rsize_one = rsize - rsize_one;
         wsize_one = wsize - wsize_one;
+        iostall_one = iostall - iostall_one;
         cssize_one = cssize - cssize_one;
         crsize_one = crsize - crsize_one;
     }
@@ -2634,6 +4155,16 @@ void MapReduce::allocate()
     valignm1 = valign - 1;
     talignm1 = talign - 1;
 
+    // fixed-width pair = key, value at next valign, padded to talign
+    // a pair is never smaller than the lengths of a variable-width pair,
+    //   so per-pair work arrays sized for those still fit
+
+    if (kfixed) {
+        vfixoffset = roundup(kfixed, valign);
+        fixbytes = roundup(vfixoffset + vfixed, talign);
+        fixbytes = MAX(fixbytes, twolenbytes);
+    }
+
     // memory initialization
 
     if (memsize == 0) error->all("Invalid memsize setting");
@@ -2646,12 +4177,21 @@ void MapReduce::allocate()
         pagesize = (uint64_t)(-memsize);
 
     if (pagesize < ALIGNFILE) error->all("Page size smaller than ALIGNFILE");
+    if (hugepage < 0 || hugepage > 2) error->all("Invalid hugepage setting");
+    hugeflag = hugepage;
+
+    if (iobuf < 0) error->all("Invalid iobuf setting");
+    if (compresslevel < 0 || compresslevel > 9)
+        error->all("Invalid compresslevel setting");
+    aio = new AsyncIO(pagesize, iobuf, this, memory, error);
 
     if (minpage) allocate_page(minpage);
 }
 
 /* ----------------------------------------------------------------------
    allocate a contiguous set of N pages
+   pages are aligned to ALIGNFILE and zeroed only if zeropage is set,
+     mmap'd pages are first touched by the thread that uses them
 ------------------------------------------------------------------------- */
 
 void MapReduce::allocate_page(int n)
@@ -2660,9 +4200,12 @@ void MapReduce::allocate_page(int n)
     memptr = (char **) memory->srealloc(memptr, nnew * sizeof(char *), "MR:memptr");
     memused = (int *) memory->srealloc(memused, nnew * sizeof(int), "MR:memused");
     memcount = (int *) memory->srealloc(memcount, nnew * sizeof(int), "MR:memcount");
+    runlen = (int *) memory->srealloc(runlen, nnew * sizeof(int), "MR:runlen");
+    runnext = (int *) memory->srealloc(runnext, nnew * sizeof(int), "MR:runnext");
+    runprev = (int *) memory->srealloc(runprev, nnew * sizeof(int), "MR:runprev");
 
-    char *ptr = (char *) memory->smalloc_align(n * pagesize, ALIGNFILE, "MR:page");
-    memset(ptr, 0, n * pagesize);
+    char *ptr = (char *) memory->smalloc_page(n * pagesize, ALIGNFILE, hugeflag, "MR:page");
+    if (zeropage) memset(ptr, 0, n * pagesize);
 
     for (int i = 0; i < n; i++) {
         memptr[npage+i] = ptr + i * pagesize;
@@ -2670,12 +4213,30 @@ void MapReduce::allocate_page(int n)
         memcount[npage+i] = 0;
     }
     memcount[npage] = n;
+
+    // grow bitmaps, new pages are free and linked to the next one
+    //   except the last page of the allocation
+
+    int nword = nnew / 64 + 1;
+    if (nword > nmapword) {
+        freebits = (uint64_t *) 
+            memory->srealloc(freebits, nword * sizeof(uint64_t), "MR:freebits");
+        linkbits = (uint64_t *) 
+            memory->srealloc(linkbits, nword * sizeof(uint64_t), "MR:linkbits");
+        for (int i = nmapword; i < nword; i++) freebits[i] = linkbits[i] = 0;
+        nmapword = nword;
+    }
+    setbits(freebits, npage, n, 1);
+    setbits(linkbits, npage, n - 1, 1);
+    addrun(npage, n);
+
+    nfree += n;
     npage = nnew;
 }
 
 /* ----------------------------------------------------------------------
    request for numpages of contiguous memory
-   satisfy request out of 1st available unused page(s)
+   satisfy request out of smallest free run that fits
    else allocate new page(s) if maxpage allows
    else throw error
    return ptr to memory and size of memory
@@ -2684,23 +4245,21 @@ void MapReduce::allocate_page(int n)
 
 char *MapReduce::mymalloc(int numpage, uint64_t &size, int &tag)
 {
-    int ipage, ok;
+    tag = findrun(numpage);
 
-    for (tag = 0; tag < npage; tag++) {
-        if (memused[tag]) continue;
-        ok = 1;
-        for (ipage = tag + 1; ipage < tag + numpage; ipage++)
-            if (ipage >= npage || memused[ipage] || memcount[ipage]) ok = 0;
-        if (ok) break;
-    }
-
-    if (tag == npage) {
+    if (tag < 0) {
+        if (nfree >= numpage) nfailcontig++;
         if (maxpage && npage + numpage > maxpage)
             error->one("Cannot allocate requested memory page(s)");
+        tag = npage;
         allocate_page(numpage);
+        removerun(tag);
     }
 
-    for (ipage = 0; ipage < numpage; ipage++) memused[tag+ipage] = numpage;
+    for (int ipage = 0; ipage < numpage; ipage++) memused[tag+ipage] = numpage;
+    setbits(freebits, tag, numpage, 0);
+    nfree -= numpage;
+    npeak = MAX(npeak, npage - nfree);
     size = numpage * pagesize;
 
     return memptr[tag];
@@ -2713,7 +4272,95 @@ char *MapReduce::mymalloc(int numpage, uint64_t &size, int &tag)
 void MapReduce::myfree(int tag)
 {
     int n = memused[tag];
-    for (int i = 0; i < n; i++) memused[tag++] = 0;
+    setbits(freebits, tag, n, 1);
+    nfree += n;
+    for (int i = 0; i < n; i++) memused[tag+i] = 0;
+
+    // merge with free runs before and after it in the same allocation
+
+    int start = tag;
+    int len = n;
+    int last = tag + n - 1;
+    if (start > 0 && (linkbits[(start-1)/64] >> ((start-1) % 64) & 1) &&
+        (freebits[(start-1)/64] >> ((start-1) % 64) & 1)) {
+        start -= runlen[start-1];
+        len += runlen[start];
+        removerun(start);
+    }
+    if ((linkbits[last/64] >> (last % 64) & 1) &&
+        (freebits[(last+1)/64] >> ((last+1) % 64) & 1)) {
+        len += runlen[last+1];
+        removerun(last+1);
+    }
+    addrun(start, len);
+}
+
+/* ----------------------------------------------------------------------
+   take N unused pages within one contiguous allocation
+   use 1st run of smallest non-empty class that fits, rest of it stays free
+   constant time for N < NRUNCLASS, else runs of the last class are scanned
+   return index of 1st page, -1 if none
+------------------------------------------------------------------------- */
+
+int MapReduce::findrun(int numpage)
+{
+    if (nfree < numpage) return -1;
+
+    int iclass = (numpage < NRUNCLASS) ? numpage - 1 : NRUNCLASS - 1;
+    uint64_t mask = runmask >> iclass;
+    if (mask == 0) return -1;
+    iclass += __builtin_ctzll(mask);
+
+    int start = runhead[iclass];
+    if (iclass == NRUNCLASS - 1)
+        while (start >= 0 && runlen[start] < numpage) start = runnext[start];
+    if (start < 0) return -1;
+
+    int len = runlen[start];
+    removerun(start);
+    if (len > numpage) addrun(start + numpage, len - numpage);
+    return start;
+}
+
+/* ----------------------------------------------------------------------
+   add free run of N pages starting at page I to its class
+------------------------------------------------------------------------- */
+
+void MapReduce::addrun(int i, int n)
+{
+    int iclass = (n < NRUNCLASS) ? n - 1 : NRUNCLASS - 1;
+    runlen[i] = runlen[i+n-1] = n;
+    runprev[i] = -1;
+    runnext[i] = runhead[iclass];
+    if (runhead[iclass] >= 0) runprev[runhead[iclass]] = i;
+    runhead[iclass] = i;
+    runmask |= ((uint64_t) 1) << iclass;
+}
+
+/* ----------------------------------------------------------------------
+   remove free run starting at page I from its class
+------------------------------------------------------------------------- */
+
+void MapReduce::removerun(int i)
+{
+    int n = runlen[i];
+    int iclass = (n < NRUNCLASS) ? n - 1 : NRUNCLASS - 1;
+    if (runprev[i] >= 0) runnext[runprev[i]] = runnext[i];
+    else runhead[iclass] = runnext[i];
+    if (runnext[i] >= 0) runprev[runnext[i]] = runprev[i];
+    if (runhead[iclass] < 0) runmask &= ~(((uint64_t) 1) << iclass);
+}
+
+/* ----------------------------------------------------------------------
+   set N bits of a bitmap starting at bit I to flag
+------------------------------------------------------------------------- */
+
+void MapReduce::setbits(uint64_t *bits, int i, int n, int flag)
+{
+    for (int j = i; j < i + n; j++) {
+        if (flag) bits[j/64] |= ((uint64_t) 1) << (j % 64);
+        else bits[j/64] &= ~(((uint64_t) 1) << (j % 64));
+    }
 }
 
 /* ----------------------------------------------------------------------
@@ -2725,34 +4372,38 @@ void MapReduce::myfree(int tag)
 
 int MapReduce::memquery(int &maxcontig, int &max)
 {
-    int i, j;
-
-    int n = 0;
-    for (i = 0; i < npage; i++)
-        if (memused[i] == 0) n++;
+    // largest non-empty class, runs of the last class are scanned
 
     maxcontig = 0;
-    for (i = 0; i < npage; i++) {
-        if (memused[i]) continue;
-        for (j = i + 1; j < npage; j++)
-            if (memused[j] || memcount[j]) break;
-        maxcontig = MAX(maxcontig, j - i);
+    if (runmask) {
+        int iclass = 63 - __builtin_clzll(runmask);
+        if (iclass < NRUNCLASS - 1) maxcontig = iclass + 1;
+        else
+            for (int i = runhead[iclass]; i >= 0; i = runnext[i])
+                maxcontig = MAX(maxcontig, runlen[i]);
     }
 
     if (maxpage == 0) max = -1;
     else max = maxpage - npage;
-    return n;
+    return nfree;
 }
 
 /* ----------------------------------------------------------------------
    set hi-water mark for file sizes on disk
    flag = 0, file of fsize was written to disk
    flag = 1, file of fsize was deleted from disk
+   idir = fpath dir of the file
 ------------------------------------------------------------------------- */
 
-void MapReduce::hiwater(int flag, uint64_t size)
+void MapReduce::hiwater(int flag, uint64_t size, int idir)
 {
-    if (flag == 0) fsize += size;
-    if (flag == 1) fsize -= size;
+    if (flag == 0) {
+        fsize += size;
+        fdirs[idir].size += size;
+    }
+    if (flag == 1) {
+        fsize -= size;
+        fdirs[idir].size -= size;
+    }
     fsizemax = MAX(fsizemax, fsize);
 }
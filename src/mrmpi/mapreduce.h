@@ -16,25 +16,48 @@
 
 #include "mpi.h"
 #include "stdint.h"
+#include "pthread.h"
+#include <algorithm>
 
 namespace MAPREDUCE_NS {
 
+template <class K, class V> class TypedMapReduce;
+
 class MapReduce {
   friend class KeyValue;
   friend class KeyMultiValue;
   friend class Spool;
+  friend class AsyncIO;
+  template <class K, class V> friend class TypedMapReduce;
 
  public:
   int mapstyle;       // 0 = chunks, 1 = strided, 2 = master/slave
-  int all2all;        // 0 = irregular comm, 1 = use MPI_Alltoallv()
+                      // 3 = chunks + work stealing via MPI one-sided atomics
+  int mapthreads;     // # of threads per proc running map() tasks, 1 = none
+                      // each thread holds 1 extra page, 2 with a combiner
+  int mapmaster;      // 1 = mapstyle 2 master also runs tasks, 0 = it doesn't
+  int all2all;        // 0 = irregular comm, persistent point-to-point
+                      // 1 = use MPI_Ialltoallv()
+                      // 2 = MPI-3 neighborhood collective on sparse graph
   int verbosity;      // 0 = none, 1 = totals, 2 = proc histograms
   int timer;          // 0 = none, 1 = summary, 2 = proc histograms
   int memsize;        // # of Mbytes per page
+                      // threaded map() adds up to 2*mapthreads pages
   int minpage;        // # of pages that will be pre-allocated per proc >= 0
   int maxpage;        // max # of pages that can be allocated per proc, 0 = inf
   int keyalign;       // align keys to this byte count
   int valuealign;     // align values to this byte count
-  char *fpath;        // prefix path added to intermediate out-of-core files
+  char *fpath;        // dirs for intermediate out-of-core files
+                      // tiers separated by ';', dirs in a tier by ','
+                      // each dir = path[*weight][@maxMb]
+  int fpathstyle;     // 0 = weighted round-robin across dirs of a tier
+                      // 1 = dir with most free space (times weight)
+  int hugepage;       // 0 = malloc pages, 1 = mmap w/ transparent huge pages
+                      // 2 = explicit huge pages (MAP_HUGETLB) if available
+  int zeropage;       // 1 = zero pages when allocated (debug), 0 = no
+  int iobuf;          // # of page buffers per file for async I/O, 0 = sync I/O
+  int compresslevel;  // compress pages written to disk, 0 = none
+                      // 1 = fast LZ codec, 2-9 = zlib at that level
   
   class KeyValue *kv;              // single KV stored by MR
   class KeyMultiValue *kmv;        // single KMV stored by MR
@@ -48,6 +71,7 @@ class MapReduce {
                                    // grows as created, never shrinks
   static int mpi_finalize_flag;    // 1 if MR library should finalize MPI
   static uint64_t rsize,wsize;     // total read/write bytes for all I/O
+  static double iostall;           // total time waiting on file I/O
   static uint64_t cssize,crsize;   // total send/recv bytes for all comm
   static double commtime;          // total time for all comm
 
@@ -56,17 +80,20 @@ class MapReduce {
   MapReduce(MPI_Comm);
   MapReduce();
   MapReduce(double);
+  MapReduce(MPI_Comm, int, int);
   ~MapReduce();
 
   MapReduce *copy();
 
   uint64_t add(MapReduce *);
   uint64_t aggregate(int (*)(char *, int));
+  uint64_t aggregate(int (*)(char *, int, void *), void *);
   uint64_t broadcast(int);
   uint64_t clone();
   uint64_t close();
   uint64_t collapse(char *, int);
   uint64_t collate(int (*)(char *, int));
+  uint64_t collate(int (*)(char *, int, void *), void *);
   uint64_t compress(void (*)(char *, int, char *,
 			     int, int *, class KeyValue *, void *),
 		    void *);
@@ -97,15 +124,24 @@ class MapReduce {
   uint64_t multivalue_blocks(int &);
   int multivalue_block(int, char **, int **);
 
+  uint64_t sort_keys(int);
   uint64_t sort_keys(int (*)(char *, int, char *, int));
+  template <class Compare> uint64_t sort_keys(Compare);
+  uint64_t sort_values(int);
   uint64_t sort_values(int (*)(char *, int, char *, int));
+  template <class Compare> uint64_t sort_values(Compare);
   uint64_t sort_multivalues(int (*)(char *, int, char *, int));
+  uint64_t sort_keys_global(int);
+  uint64_t sort_keys_global(int (*)(char *, int, char *, int));
 
   void kv_stats(int);
   void kmv_stats(int);
   void cummulative_stats(int, int);
 
   void set_fpath(const char *);
+  void set_combiner(void (*)(char *, int, char *, int, char *, int, void *),
+                    void *);
+  void set_hash(uint64_t (*)(char *, int));
 
   // query functions
 
@@ -126,9 +162,19 @@ class MapReduce {
   double time_start,time_stop;
   class Memory *memory;
   class Error *error;
+  class AsyncIO *aio;       // file I/O for KV, KMV, and Spool pages
+  class Irregular *irregular;  // comm for aggregate(), kept between calls
+
+  // node-level comms for broadcast(), created on first use
+
+  MPI_Comm nodecomm;        // procs sharing memory with me, NULL if not made
+  MPI_Comm leadercomm;      // rank 0 proc of each node, NULL if not a leader
+  int nodeme,nodeprocs;     // my rank in nodecomm, # of procs in nodecomm
+  int nodeshared;           // 1 if any node has more than 1 proc
 
   uint64_t rsize_one,wsize_one;     // file read/write bytes for one operation
   uint64_t crsize_one,cssize_one;   // send/recv comm bytes for one operation
+  double iostall_one;               // time waiting on file I/O for one operation
 
   int collateflag;          // flag for when convert() is called from collate()
 
@@ -141,6 +187,23 @@ class MapReduce {
   int *memcount;            // # of pages alloced starting with this page
                             // 0 if in the middle of a contiguous alloc
   int npage;                // total # of pages currently allocated
+  int hugeflag;             // hugepage setting the pages were allocated with
+
+  uint64_t *freebits;       // bit per page, 1 if page is unused
+  uint64_t *linkbits;       // bit per page, 1 if next page is in same alloc
+  int nmapword;             // # of 64-bit words in freebits and linkbits
+  int nfree;                // # of unused pages
+  int npeak;                // max # of pages in use at once
+  int nfailcontig;          // # of requests that allocated new pages while
+                            //   enough unused but non-contiguous pages existed
+
+  // free runs = maximal sets of unused pages within one allocation
+  // indexed by length, class L-1 = runs of L pages, class 63 = 64 or more
+
+  int *runlen;              // length of free run, set at its 1st & last page
+  int *runnext,*runprev;    // links of a run in its class, set at 1st page
+  int runhead[64];          // 1st run of each class, -1 if none
+  uint64_t runmask;         // bit per class, 1 if class has a run
 
   // alignment info
 
@@ -150,6 +213,13 @@ class MapReduce {
   int kalignm1,valignm1;    // alignments-1 for masking
   int talignm1;
 
+  // fixed-width KV pairs, set by constructor, layout finalized in allocate()
+  // pairs store no lengths, key at start of pair, value at vfixoffset
+
+  int kfixed,vfixed;        // key & value sizes, 0 if variable-width
+  int vfixoffset;           // offset of value within pair
+  int fixbytes;             // size of one pair, >= twolenbytes
+
   // file info
 
   uint64_t fsize;           // current aggregate size of disk files
@@ -161,6 +231,19 @@ class MapReduce {
   int fcounter_part;
   int fcounter_set;
 
+  struct FileDir {
+    char *path;             // directory for files
+    int tier;               // lower tiers are filled first
+    int weight;             // relative share of files within its tier
+    int credit;             // running credit for weighted round-robin
+    uint64_t maxsize;       // max bytes of my files in dir, 0 = no limit
+    uint64_t size;          // current bytes of my files in dir
+  };
+
+  FileDir *fdirs;           // out-of-core dirs parsed from fpath
+  int nfdir;                // # of dirs
+  int ntier;                // # of tiers
+
   // sorting
 
   typedef int (CompareFunc)(char *, int, char *, int);
@@ -169,6 +252,73 @@ class MapReduce {
   char **dptr;              // ptrs to datums being sorted
   int *slength;             // length of each datum being sorted
 
+  int sortflag;             // built-in order of sort_keys/values(int), else 0
+  void *sortobj;            // comparator of templated sort_keys/values
+  void (*sortorder)(void *, int *, char **, int *, int);
+                            // sorts order[] of a page with sortobj
+
+  int nsplit;               // # of splitter keys in global sort
+  char *splitbuf;           // splitter keys, one after another
+  int *splitlen;            // length of each splitter key
+  char **splitptr;          // ptr to each splitter key
+  int *splitrank;           // range of sorted samples equal to each splitter
+  int nsampleall;           // # of samples from all procs
+  int splitnext;            // cycles keys equal to splitters across procs
+
+  struct MergeRun {          // one sorted run in a k-way merge
+    class Spool *spool;      // Spool file holding the run
+    char *page;              // read buffer for pages of the run
+    int npage,ipage;         // # of pages in run, current page
+    int nentry,ientry;       // # of entries in current page, current entry
+    char *ptr;               // current entry, NULL if run is exhausted
+    int len;                 // byte length of current entry
+    char *str;               // key or value of current entry
+    int nbytes;              // byte length of str
+  };
+
+  // map-side combiner
+
+  typedef void (CombineFunc)(char *, int, char *, int, char *, int, void *);
+  CombineFunc *appcombine;  // user function that folds 2 values of a key
+  void *appcombineptr;      // user data ptr passed to appcombine
+  int combinetag;           // page ID of combiner table in map(), -1 if none
+
+  // key hash of aggregate(), convert(), and combiner
+
+  typedef uint64_t (HashFunc)(char *, int);
+  HashFunc *apphash;        // user 64-bit key hash, NULL = hashkey()
+  int (*appproc)(char *, int);  // user proc hash of aggregate() w/out ptr
+
+  // threaded map()
+
+  struct MapThread {
+    class MapReduce *mr;
+    class KeyValue *kv;       // thread-private KV, pages spliced into MR kv
+    int combinetag;           // page ID of thread's combiner table, -1 if none
+  };
+
+  void (*mapfunc)(int, class KeyValue *, void *);  // user map function
+  void *mapptr;             // user data ptr passed to mapfunc
+  pthread_mutex_t tasklock; // serializes next_task()
+  pthread_mutex_t splicelock;  // serializes splices into MR kv
+  uint64_t tasknext;        // next task of a static or claimed task range
+  uint64_t taskstop;        // end of static or claimed task range
+  int taskstride;           // stride of task range
+  int tasknmap;             // # of map() tasks of mapstyle 2 or 3
+
+  // master/slave map(), mapstyle 2
+
+  uint64_t taskassign;      // next task not yet handed out by master
+  int taskndone;            // # of workers master has told it is done
+  int taskchunk[2];         // prefetched chunk: 1st task, # of tasks
+  MPI_Request taskrequest;  // receive of prefetched chunk by worker
+
+  // work-stealing map(), mapstyle 3
+
+  MPI_Win taskwin;          // window on taskclaimed of every proc
+  int64_t taskclaimed;      // # of tasks claimed from my chunk, by any proc
+  int taskvictim;           // offset from me of proc now claimed from
+
   // multi-block KMV info
 
   int kmv_block_valid;        // 1 if user is processing a multi-block KMV pair
@@ -204,14 +354,54 @@ class MapReduce {
   uint64_t map_file(int, int, char **,
 		    void (*)(int, char *, int, class KeyValue *, void *),
 		    void *, int addflag);
-
+  class KeyValue *map_kv_start(MapReduce *, int);
+  uint64_t map_kv_stop(MapReduce *, class KeyValue *, class KeyValue *);
+
+  void broadcast_direct(int, int, uint64_t *);
+  void broadcast_shared(int, int, uint64_t *);
+  char *broadcast_load(int, char *);
+  void broadcast_install(int, int, uint64_t *, char *);
+
+  int map_nthreads();
+  void map_threads(int, int, void (*)(int, class KeyValue *, void *), void *);
+  static void *map_thread_entry(void *);
+  int next_task();
+  void chunk_start(int);
+  void chunk_fetch();
+  void chunk_serve();
+  void steal_start(int);
+  void steal_tasks();
+  void steal_stop();
+
+  void combine_start(KeyValue *);
+  void combine_stop(KeyValue *);
+
+  uint64_t sort_pairs(int);
+  uint64_t sort_global();
+  void sample_splitters();
+  static int splitter_proc(char *, int, void *);
+  static int app_proc(char *, int, void *);
+  void aggregate_kv(int (*)(char *, int, void *), void *);
   void sort_kv(int);
   void sort_onepage(int, int, char *, char *, char *);
-  void merge(int, int, void *, int, void *, int, void *);
+  void sort_builtin(int, int, char *, char *, char *);
+  template <class T> void sort_radix(int, int, char *, char *, char *);
+  void sort_strings(int, int, char *, char *, char *);
+  static int compare_builtin(char *, int, char *, int);
+  template <class Compare> static void sort_order(void *, int *, char **,
+                                                  int *, int);
+  template <class Compare> static int compare_object(char *, int, char *, int);
+  int merge_slices(int, uint64_t, uint64_t &);
+  void merge_runs(int, int, class Spool **, char **, uint64_t, int, void *);
+  int merge_less(MergeRun *, int, int);
   int extract(int, char *, char *&, int &);
+  char *next_pair(char *, char *&, int &, char *&, int &);
+  char *place_pair(char *, int, int, char *&, char *&);
 
   void stats(const char *, int);
-  char *file_create(int);
+  char *file_create(int, int &);
+  void fpath_parse();
+  int fpath_select();
   void file_stats(int);
   uint64_t roundup(uint64_t, int);
   void start_timer();
@@ -225,9 +415,99 @@ class MapReduce {
   char *mymalloc(int, uint64_t &, int &);
   void myfree(int);
   int memquery(int &, int &);
-  void hiwater(int, uint64_t);
+  int findrun(int);
+  void addrun(int, int);
+  void removerun(int);
+  void setbits(uint64_t *, int, int, int);
+  void hiwater(int, uint64_t, int);
 };
 
+/* ----------------------------------------------------------------------
+   lay out a KV pair with keybytes and valuebytes starting at ptr
+   return key and value ptrs within the pair and ptr to the next pair
+   fixed-width pairs store no lengths, variable-width store 2 ints first
+   used by MR, KV, KMV so every walk of KV pages shares one layout
+------------------------------------------------------------------------- */
+
+inline char *MapReduce::place_pair(char *ptr, int keybytes, int valuebytes,
+                                   char *&key, char *&value)
+{
+    if (kfixed) {
+        key = ptr;
+        value = ptr + vfixoffset;
+        return ptr + fixbytes;
+    }
+
+    key = (char *) (((uint64_t) ptr + twolenbytes + kalignm1) & ~kalignm1);
+    value = (char *) (((uint64_t) key + keybytes + valignm1) & ~valignm1);
+    return (char *) (((uint64_t) value + valuebytes + talignm1) & ~talignm1);
+}
+
+/* ----------------------------------------------------------------------
+   parse the KV pair at ptr
+   return key, value and their sizes, and ptr to the next pair
+   fixed-width pairs are parsed without reading the page
+------------------------------------------------------------------------- */
+
+inline char *MapReduce::next_pair(char *ptr, char *&key, int &keybytes,
+                                  char *&value, int &valuebytes)
+{
+    if (kfixed) {
+        keybytes = kfixed;
+        valuebytes = vfixed;
+    }
+    else {
+        keybytes = *((int *) ptr);
+        valuebytes = *((int *) (ptr + sizeof(int)));
+    }
+    return place_pair(ptr, keybytes, valuebytes, key, value);
+}
+
+/* ----------------------------------------------------------------------
+   sort keys or values with a comparator object or lambda
+   cmp(char *, int, char *, int) returns -1, 0, 1 like appcompare()
+   each page is sorted with cmp inlined into std::sort()
+------------------------------------------------------------------------- */
+
+template <class Compare>
+uint64_t MapReduce::sort_keys(Compare cmp)
+{
+    sortobj = &cmp;
+    sortorder = &sort_order<Compare>;
+    compare = &compare_object<Compare>;
+    return sort_pairs(0);
+}
+
+template <class Compare>
+uint64_t MapReduce::sort_values(Compare cmp)
+{
+    sortobj = &cmp;
+    sortorder = &sort_order<Compare>;
+    compare = &compare_object<Compare>;
+    return sort_pairs(1);
+}
+
+template <class Compare>
+void MapReduce::sort_order(void *obj, int *order, char **dptr,
+                           int *slength, int n)
+{
+    struct Less {
+        Compare *cmp;
+        char **dptr;
+        int *slength;
+        bool operator()(int i, int j) const {
+            return (*cmp)(dptr[i], slength[i], dptr[j], slength[j]) < 0;
+        }
+    } less = {(Compare *) obj, dptr, slength};
+    std::sort(order, order + n, less);
+}
+
+template <class Compare>
+int MapReduce::compare_object(char *p1, int len1, char *p2, int len2)
+{
+    return (*(Compare *) mrptr->sortobj)(p1, len1, p2, len2);
+}
+
 }
 
 #endif
@@ -16,11 +16,15 @@
 #include "mpi.h"
 #include "stdlib.h"
 #include "stdio.h"
+#include "stdint.h"
+#include "sys/mman.h"
 #include "memory.h"
 #include "error.h"
 
 using namespace MAPREDUCE_NS;
 
+#define HUGEPAGE (2*1024*1024)   // huge page size assumed for alignment
+
 /* ---------------------------------------------------------------------- */
 
 Memory::Memory(MPI_Comm comm)
@@ -58,11 +62,9 @@ void *Memory::smalloc(size_t n, const char *name)
 void *Memory::smalloc_align(size_t n, int nalign, const char *name)
 {
   if (n == 0) return NULL;
-  //void *ptr;
-  //int ierror = posix_memalign(&ptr,nalign,n);
-  //if (ierror) {
-  void *ptr = malloc(n);
-  if (ptr == NULL) {
+  void *ptr = NULL;
+  int ierror = posix_memalign(&ptr,nalign,n);
+  if (ierror) {
     char str[128];
     sprintf(str,"Failed to allocate %lu bytes for array %s",n,name);
     error->one(str);
@@ -70,6 +72,54 @@ void *Memory::smalloc_align(size_t n, int nalign, const char *name)
   return ptr;
 }
 
+/* ----------------------------------------------------------------------
+   safe allocation of memory pages
+   huge = 0 or n < HUGEPAGE, malloc with alignment
+   huge = 1, anonymous mmap aligned to HUGEPAGE, transparent huge pages
+   huge = 2, explicit huge pages (MAP_HUGETLB), else same as 1
+   mmap'd memory is zero and is not touched here, so each page is placed
+     on the NUMA node of the thread that first writes it
+------------------------------------------------------------------------- */
+
+void *Memory::smalloc_page(size_t n, int nalign, int huge, const char *name)
+{
+  if (n == 0) return NULL;
+  if (huge == 0 || n < HUGEPAGE) return smalloc_align(n,nalign,name);
+
+  n = (n + HUGEPAGE - 1) & ~((size_t) HUGEPAGE - 1);
+  void *ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (huge == 2)
+    ptr = mmap(NULL,n,PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,-1,0);
+#endif
+
+  // map HUGEPAGE extra bytes and trim both ends to an aligned region
+
+  if (ptr == MAP_FAILED) {
+    char *raw = (char *) mmap(NULL,n + HUGEPAGE,PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if (raw != MAP_FAILED) {
+      char *start = (char *) 
+	(((uint64_t) raw + HUGEPAGE - 1) & ~((uint64_t) HUGEPAGE - 1));
+      if (start > raw) munmap(raw,start - raw);
+      if (raw + HUGEPAGE > start) munmap(start + n,raw + HUGEPAGE - start);
+      ptr = start;
+#ifdef MADV_HUGEPAGE
+      madvise(ptr,n,MADV_HUGEPAGE);
+#endif
+    }
+  }
+
+  if (ptr == MAP_FAILED || ((uint64_t) ptr) % nalign) {
+    char str[128];
+    sprintf(str,"Failed to map %lu bytes for array %s",n,name);
+    error->one(str);
+  }
+  return ptr;
+}
+
 /* ----------------------------------------------------------------------
    safe free 
 ------------------------------------------------------------------------- */
@@ -80,6 +130,21 @@ void Memory::sfree(void *ptr)
   free(ptr);
 }
 
+/* ----------------------------------------------------------------------
+   free memory pages allocated by smalloc_page() with same n and huge
+------------------------------------------------------------------------- */
+
+void Memory::sfree_page(void *ptr, size_t n, int huge)
+{
+  if (ptr == NULL) return;
+  if (huge == 0 || n < HUGEPAGE) {
+    free(ptr);
+    return;
+  }
+  n = (n + HUGEPAGE - 1) & ~((size_t) HUGEPAGE - 1);
+  munmap(ptr,n);
+}
+
 /* ----------------------------------------------------------------------
    safe realloc 
 ------------------------------------------------------------------------- */
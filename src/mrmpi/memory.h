@@ -25,7 +25,9 @@ class Memory {
 
   void *smalloc(size_t, const char *);
   void *smalloc_align(size_t, int, const char *);
+  void *smalloc_page(size_t, int, int, const char *);
   void sfree(void *);
+  void sfree_page(void *, size_t, int);
   void *srealloc(void *, size_t, const char *);
 
  private:
@@ -16,6 +16,7 @@
 #include "stdint.h"
 #include "spool.h"
 #include "mapreduce.h"
+#include "asyncio.h"
 #include "memory.h"
 #include "error.h"
 
@@ -35,7 +36,7 @@ Spool::Spool(int style,
   memory = memory_caller;
   error = error_caller;
 
-  filename = mr->file_create(style);
+  filename = mr->file_create(style,filedir);
   fileflag = 0;
   fp = NULL;
 
@@ -51,9 +52,10 @@ Spool::Spool(int style,
 Spool::~Spool()
 {
   memory->sfree(pages);
+  if (fp) mr->aio->close(fp);
   if (fileflag) {
     remove(filename);
-    mr->hiwater(1,fsize);
+    mr->hiwater(1,fsize,filedir);
   }
   delete [] filename;
 }
@@ -77,7 +79,7 @@ void Spool::complete()
 {
   create_page();
   write_page();
-  fclose(fp);
+  mr->aio->close(fp);
   fp = NULL;
 
   npage++;
@@ -92,7 +94,7 @@ void Spool::complete()
     fsize += pages[ipage].filesize;
   }
 
-  mr->hiwater(0,fsize);
+  mr->hiwater(0,fsize,filedir);
 
 #ifdef SPOOL_DEBUG
   printf("SP Created %s: %d pages, %u entries, %g Mb\n",
@@ -111,7 +113,8 @@ void Spool::truncate(int pagecut, int ncut, uint64_t sizecut)
   else {
     npage = pagecut+1;
     pages[pagecut].size = sizecut;
-    pages[pagecut].filesize = roundup(sizecut,ALIGNFILE);
+    if (pages[pagecut].zipsize == 0)
+      pages[pagecut].filesize = roundup(sizecut,ALIGNFILE);
     pages[pagecut].nkey = ncut;
   }
 }
@@ -135,12 +138,13 @@ int Spool::request_page(int ipage)
 {
   read_page(ipage);
 
-  // close file if last request
+  // close file if last request, else prefetch next page
 
   if (ipage == npage-1) {
-    fclose(fp);
+    mr->aio->close(fp);
     fp = NULL;
   }
+  else mr->aio->prefetch(fp,pages[ipage+1].fileoffset,pages[ipage+1].filesize);
 
   return pages[ipage].nkey;
 }
@@ -209,10 +213,17 @@ void Spool::create_page()
   pages[npage].nkey = nkey;
   pages[npage].size = size;
   pages[npage].filesize = roundup(size,ALIGNFILE);
+  pages[npage].zipsize = 0;
+
+  if (npage)
+    pages[npage].fileoffset =
+      pages[npage-1].fileoffset + pages[npage-1].filesize;
+  else
+    pages[npage].fileoffset = 0;
 }
 
 /* ----------------------------------------------------------------------
-   write in-memory page to disk
+   write in-memory page to disk, compressed if MR compresslevel is set
 ------------------------------------------------------------------------- */
 
 void Spool::write_page()
@@ -223,7 +234,9 @@ void Spool::write_page()
     fileflag = 1;
   }
 
-  fwrite(page,pages[npage].filesize,1,fp);
+  pages[npage].filesize =
+    mr->aio->write_page(fp,pages[npage].fileoffset,page,pages[npage].size,
+			pages[npage].zipsize);
   mr->wsize += pages[npage].filesize;
 }
 
@@ -238,7 +251,8 @@ void Spool::read_page(int ipage)
     if (fp == NULL) error->one("Could not open Spool file for reading");
   }
 
-  fread(page,pages[ipage].filesize,1,fp);
+  mr->aio->read_page(fp,pages[ipage].fileoffset,page,pagesize,
+		     pages[ipage].filesize,pages[ipage].zipsize);
   mr->rsize += pages[ipage].filesize;
 }
 
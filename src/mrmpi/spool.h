@@ -54,7 +54,9 @@ class Spool {
 
   struct Page {
     uint64_t size;              // size of entries
-    uint64_t filesize;          // rounded-up size for file I/O
+    uint64_t filesize;          // rounded-up size of page in file
+    uint64_t fileoffset;        // summed filesize of all previous pages
+    uint64_t zipsize;           // compressed size, 0 if uncompressed
     int nkey;                   // # of entries
   };
 
@@ -64,6 +66,7 @@ class Spool {
   // file info
 
   char *filename;               // filename to store Spool if needed
+  int filedir;                  // MR fpath dir that holds the file
   int fileflag;                 // 1 if file exists, 0 if not
   FILE *fp;                     // file ptr
 
@@ -0,0 +1,346 @@
+/* ----------------------------------------------------------------------
+   MR-MPI = MapReduce-MPI library
+   http://www.cs.sandia.gov/~sjplimp/mapreduce.html
+   Steve Plimpton, sjplimp@sandia.gov, Sandia National Laboratories
+
+   Copyright (2009) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the modified Berkeley Software Distribution (BSD) License.
+
+   See the README file in the top-level MapReduce directory.
+------------------------------------------------------------------------- */
+
+#ifndef TYPED_MAP_REDUCE_H
+#define TYPED_MAP_REDUCE_H
+
+#include "mpi.h"
+#include "stdint.h"
+#include "stddef.h"
+#include "string.h"
+#include "mapreduce.h"
+#include "keyvalue.h"
+
+namespace MAPREDUCE_NS {
+
+/* ----------------------------------------------------------------------
+   typed front end to a MapReduce object whose KV pairs are K,V
+   K,V = plain-old-data types, stored by value as fixed-width KV pairs
+   callbacks are function objects or lambdas:
+     map(itask, out)                     map() with # of tasks
+     map(key, value, out)                map() of another TypedMapReduce
+     reduce(key, values, out)            reduce() and compress()
+     combine(key, value, value2)         folds value2 into value
+     compare(a, b)                       returns -1, 0, 1 like appcompare()
+     hash(key)                           returns proc as non-negative int
+   each callback is inlined into the loop over tasks, pairs, or a page
+     of keys that calls it, keys and values are accessed in place in pages
+   mr = underlying MapReduce for settings and all other operations
+------------------------------------------------------------------------- */
+
+template <class K, class V>
+class TypedMapReduce {
+ public:
+    MapReduce *mr;
+
+    // adds K,V pairs to the KV being built by map(), reduce(), compress()
+
+    class Writer {
+     public:
+        KeyValue *kv;
+        Writer(KeyValue *kv_caller) : kv(kv_caller) {}
+        void add(const K &, const V &);
+    };
+
+    // values of one KMV pair
+    // a pair that spans several pages is read one block (page) at a time
+
+    class Values {
+        friend class TypedMapReduce;
+     public:
+        uint64_t size() const {return nvalue;}
+        int nblock() const {return nblk;}
+        const V *block(int, int &) const;
+     private:
+        MapReduce *mr;          // MR to query for blocks of a multi-block pair
+        const V *values;        // values of a single-block pair, else NULL
+        uint64_t nvalue;        // # of values in all blocks
+        int nblk;               // # of blocks
+    };
+
+    TypedMapReduce(MPI_Comm);
+    ~TypedMapReduce();
+
+    template <class Map> uint64_t map(int, Map, int addflag = 0);
+    template <class K2, class V2, class Map>
+        uint64_t map(TypedMapReduce<K2,V2> &, Map, int addflag = 0);
+    template <class Reduce> uint64_t reduce(Reduce);
+    template <class Reduce> uint64_t compress(Reduce);
+    template <class Combine> void set_combiner(Combine);
+    template <class Compare> uint64_t sort_keys(Compare);
+    template <class Compare> uint64_t sort_values(Compare);
+    template <class Hash> uint64_t aggregate(Hash);
+    template <class Hash> uint64_t collate(Hash);
+
+ private:
+    void *combineobj;                  // copy of combiner, owned by me
+    void (*combinefree)(void *);       // deletes combineobj
+
+    template <class T> struct Align {  // offset of t = alignment of T
+        char c;
+        T t;
+    };
+
+    template <class T, class Compare> struct TypedCompare {
+        Compare cmp;
+        int operator()(char *p1, int, char *p2, int) {
+            return cmp(*(const T *) p1, *(const T *) p2);
+        }
+    };
+
+    template <class Map> static void map_task(int, KeyValue *, void *);
+    template <class Reduce> static void reduce_pair(char *, int, char *,
+                                                    int, int *,
+                                                    KeyValue *, void *);
+    template <class Combine> static void combine_pair(char *, int, char *,
+                                                      int, char *, int,
+                                                      void *);
+    template <class Hash> static int hash_key(char *, int, void *);
+    template <class T> static void free_object(void *);
+
+    TypedMapReduce(const TypedMapReduce &);
+    TypedMapReduce &operator=(const TypedMapReduce &);
+};
+
+/* ----------------------------------------------------------------------
+   create MR of fixed-width K,V pairs
+   keys and values are aligned for their types so they can be used in place
+------------------------------------------------------------------------- */
+
+template <class K, class V>
+TypedMapReduce<K,V>::TypedMapReduce(MPI_Comm comm)
+{
+    mr = new MapReduce(comm, sizeof(K), sizeof(V));
+
+    int kalign = offsetof(Align<K>, t);
+    int valign = offsetof(Align<V>, t);
+    if (mr->keyalign < kalign) mr->keyalign = kalign;
+    if (mr->valuealign < valign) mr->valuealign = valign;
+
+    combineobj = NULL;
+    combinefree = NULL;
+}
+
+template <class K, class V>
+TypedMapReduce<K,V>::~TypedMapReduce()
+{
+    delete mr;
+    if (combineobj) combinefree(combineobj);
+}
+
+/* ----------------------------------------------------------------------
+   add a K,V pair, stored directly in the KV page if it fits
+   else KeyValue::add() flushes the page or folds the pair via combiner
+------------------------------------------------------------------------- */
+
+template <class K, class V>
+inline void TypedMapReduce<K,V>::Writer::add(const K &key, const V &value)
+{
+    if (kv->combiner || kv->alignsize + kv->fixbytes > kv->pagesize ||
+        kv->nkey == 0x7FFFFFFF) {
+        kv->add((char *) &key, sizeof(K), (char *) &value, sizeof(V));
+        return;
+    }
+
+    char *ptr = &kv->page[kv->alignsize];
+    memcpy(ptr, &key, sizeof(K));
+    memcpy(ptr + kv->vfixoffset, &value, sizeof(V));
+
+    kv->nkey++;
+    kv->keysize += sizeof(K);
+    kv->valuesize += sizeof(V);
+    kv->alignsize += kv->fixbytes;
+    if (kv->msize < kv->fixbytes) kv->msize = kv->fixbytes;
+}
+
+/* ----------------------------------------------------------------------
+   return values of block iblock of a KMV pair and their count n
+------------------------------------------------------------------------- */
+
+template <class K, class V>
+const V *TypedMapReduce<K,V>::Values::block(int iblock, int &n) const
+{
+    if (values) {
+        n = nvalue;
+        return values;
+    }
+
+    char *multivalue;
+    int *valuesizes;
+    n = mr->multivalue_block(iblock, &multivalue, &valuesizes);
+    return (const V *) multivalue;
+}
+
+/* ----------------------------------------------------------------------
+   map() with nmap tasks, map(itask, out) is called once per task
+------------------------------------------------------------------------- */
+
+template <class K, class V> template <class Map>
+uint64_t TypedMapReduce<K,V>::map(int nmap, Map map, int addflag)
+{
+    return mr->map(nmap, &map_task<Map>, &map, addflag);
+}
+
+template <class K, class V> template <class Map>
+void TypedMapReduce<K,V>::map_task(int itask, KeyValue *kv, void *ptr)
+{
+    Writer out(kv);
+    (*(Map *) ptr)(itask, out);
+}
+
+/* ----------------------------------------------------------------------
+   map() of K2,V2 pairs of src, which can be this MR
+   map(key, value, out) is called once per pair
+   pages of src are walked directly, pairs are at fixed offsets
+------------------------------------------------------------------------- */
+
+template <class K, class V> template <class K2, class V2, class Map>
+uint64_t TypedMapReduce<K,V>::map(TypedMapReduce<K2,V2> &src, Map map,
+                                  int addflag)
+{
+    KeyValue *kv_src = src.mr->kv;
+    KeyValue *kv_dest = mr->map_kv_start(src.mr, addflag);
+    Writer out(kv_dest);
+
+    int nkey_kv;
+    uint64_t dummy1, dummy2, dummy3;
+    char *page_kv, *ptr;
+    int npage_kv = kv_src->request_info(&page_kv);
+    int fixbytes = kv_src->fixbytes;
+    int vfixoffset = kv_src->vfixoffset;
+
+    for (int ipage = 0; ipage < npage_kv; ipage++) {
+        nkey_kv = kv_src->request_page(ipage, dummy1, dummy2, dummy3);
+        ptr = page_kv;
+        for (int i = 0; i < nkey_kv; i++) {
+            map(*(const K2 *) ptr, *(const V2 *)(ptr + vfixoffset), out);
+            ptr += fixbytes;
+        }
+    }
+
+    return mr->map_kv_stop(src.mr, kv_src, kv_dest);
+}
+
+/* ----------------------------------------------------------------------
+   reduce() or compress() of a KMV created from this MR's KV
+   reduce(key, values, out) is called once per KMV pair
+------------------------------------------------------------------------- */
+
+template <class K, class V> template <class Reduce>
+uint64_t TypedMapReduce<K,V>::reduce(Reduce reduce)
+{
+    return mr->reduce(&reduce_pair<Reduce>, &reduce);
+}
+
+template <class K, class V> template <class Reduce>
+uint64_t TypedMapReduce<K,V>::compress(Reduce reduce)
+{
+    return mr->compress(&reduce_pair<Reduce>, &reduce);
+}
+
+template <class K, class V> template <class Reduce>
+void TypedMapReduce<K,V>::reduce_pair(char *key, int,
+                                      char *multivalue, int nvalues,
+                                      int *valuesizes, KeyValue *kv,
+                                      void *ptr)
+{
+    Values values;
+    if (multivalue) {
+        values.mr = NULL;
+        values.values = (const V *) multivalue;
+        values.nvalue = nvalues;
+        values.nblk = 1;
+    }
+    else {
+        values.mr = (MapReduce *) valuesizes;
+        values.values = NULL;
+        values.nvalue = values.mr->multivalue_blocks(values.nblk);
+    }
+
+    Writer out(kv);
+    (*(Reduce *) ptr)(*(const K *) key, values, out);
+}
+
+/* ----------------------------------------------------------------------
+   set the map-side combiner, see MapReduce::set_combiner()
+   combine(key, value, value2) folds value2 into value
+------------------------------------------------------------------------- */
+
+template <class K, class V> template <class Combine>
+void TypedMapReduce<K,V>::set_combiner(Combine combine)
+{
+    if (combineobj) combinefree(combineobj);
+    combineobj = new Combine(combine);
+    combinefree = &free_object<Combine>;
+    mr->set_combiner(&combine_pair<Combine>, combineobj);
+}
+
+template <class K, class V> template <class Combine>
+void TypedMapReduce<K,V>::combine_pair(char *key, int,
+                                       char *value, int,
+                                       char *value2, int,
+                                       void *ptr)
+{
+    (*(Combine *) ptr)(*(const K *) key, *(V *) value, *(const V *) value2);
+}
+
+template <class K, class V> template <class T>
+void TypedMapReduce<K,V>::free_object(void *ptr)
+{
+    delete (T *) ptr;
+}
+
+/* ----------------------------------------------------------------------
+   sort keys or values with compare(a, b) inlined into the sort of a page
+------------------------------------------------------------------------- */
+
+template <class K, class V> template <class Compare>
+uint64_t TypedMapReduce<K,V>::sort_keys(Compare compare)
+{
+    TypedCompare<K,Compare> cmp = {compare};
+    return mr->sort_keys(cmp);
+}
+
+template <class K, class V> template <class Compare>
+uint64_t TypedMapReduce<K,V>::sort_values(Compare compare)
+{
+    TypedCompare<V,Compare> cmp = {compare};
+    return mr->sort_values(cmp);
+}
+
+/* ----------------------------------------------------------------------
+   aggregate() or collate() with proc of each key = hash(key) % nprocs
+   hash is passed to hash_key() as the data ptr of this call
+------------------------------------------------------------------------- */
+
+template <class K, class V> template <class Hash>
+uint64_t TypedMapReduce<K,V>::aggregate(Hash hash)
+{
+    return mr->aggregate(&hash_key<Hash>, &hash);
+}
+
+template <class K, class V> template <class Hash>
+uint64_t TypedMapReduce<K,V>::collate(Hash hash)
+{
+    return mr->collate(&hash_key<Hash>, &hash);
+}
+
+template <class K, class V> template <class Hash>
+int TypedMapReduce<K,V>::hash_key(char *key, int, void *ptr)
+{
+    return (*(Hash *) ptr)(*(const K *) key);
+}
+
+}
+
+#endif
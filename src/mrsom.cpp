@@ -57,8 +57,10 @@ int main(int argc, char** argv)
     po::options_description generalDesc("General options");
     generalDesc.add_options()
     ("help", "print help message")
-    ("mode,m", po::value<string>(), "set train/test mode, \"train or test\"")
+    ("mode,m", po::value<string>(), "set train/test/serve mode, \"train, test or serve\"")
     ("page-size,p", po::value<int>(&SZPAGE)->default_value(64), "[OPTIONAL] set page size of MR-MPI (default=64MB)")
+    ("nthreads", po::value<int>(&NTHREADS)->default_value(1), "[OPTIONAL] num of threads per rank (default=1)")
+    ("fpath", po::value<string>(&FPATH)->default_value("."), "[OPTIONAL] MR-MPI dirs for out-of-core files, \"dir[*weight][@maxMb],...;next tier\" (default=.)")
     ;
 
     po::options_description trainnigDesc("Options for training");
@@ -70,6 +72,11 @@ int main(int argc, char** argv)
     ("ndim,d", po::value<uint32_t>(), "set the number of dimension of input feature vector")
     ("nblocks,b", po::value<uint32_t>(), "set the number of blocks")
     ("sparse,s", po::value<int>(&bSPARSE)->default_value(0), "[OPTIONAL] sparse matrix as input or not (default=0)")    
+    ("stream", po::value<int>(&bSTREAM)->default_value(0), "[OPTIONAL] stream input in chunks instead of mmap (default=0)")
+    ("readahead", po::value<unsigned int>(&READAHEAD)->default_value(2), "[OPTIONAL] num of read buffers for streaming (default=2)")
+    ("chunk-size", po::value<int>(&SZCHUNK)->default_value(64), "[OPTIONAL] read chunk size for streaming (default=64MB)")
+    ("umatformat", po::value<string>(&UMATFORMAT)->default_value("txt"), "[OPTIONAL] u-matrix output, txt or bin (default=txt)")
+    ("mapstyle", po::value<int>(&MAPSTYLE)->default_value(0), "[OPTIONAL] work item scheduling, 0=chunk, 1=stride, 2=master/slave, 3=work stealing (default=0)")
     ;
     
     string binFileName, indexFileName, numFileName;
@@ -85,10 +92,17 @@ int main(int argc, char** argv)
     po::options_description testingDesc("Options for testing");
     testingDesc.add_options()
     ("codebook,c", po::value<string>(), "set saved codebook file name")
+    ("outformat", po::value<string>(&OUTFORMAT)->default_value("txt"), "[OPTIONAL] classification output, txt or bin (default=txt)")
+    ("bmu-out", po::value<int>(&bBMUOUT)->default_value(0), "[OPTIONAL] also write BMU, distance and runner-up records to *-bmu.bin (default=0)")
+    ;
+
+    po::options_description servingDesc("Options for serving");
+    servingDesc.add_options()
+    ("socket", po::value<string>(&SOCKETPATH)->default_value("mrsom.sock"), "[OPTIONAL] Unix-domain socket to listen on (default=mrsom.sock)")
     ;
 
     po::options_description allDesc("Allowed options");
-    allDesc.add(generalDesc).add(trainnigDesc).add(trainnigSparseDesc).add(testingDesc);
+    allDesc.add(generalDesc).add(trainnigDesc).add(trainnigSparseDesc).add(testingDesc).add(servingDesc);
 
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, allDesc), vm);
@@ -98,11 +112,17 @@ int main(int argc, char** argv)
     string ex = "Example for normal matrix\n";
     ex += "  Converting ASCII input file to bin: txt2bin rgbs.txt rgbs.bin 3 28\n";
     ex += "  Training: mpirun -np 4 mrsom -m train -i rgbs.bin -o rgbs -e 10 -n 28 -d 3 -b 4\n";
-    ex += "  Testing:  mrsom -m test -c rgbs-codebook.txt -i rgbs.txt -o rgbs -d 3 -n 10 \n\n";
+    ex += "  Testing:  mpirun -np 4 mrsom -m test -c rgbs-codebook.txt -i rgbs.bin -o rgbs -d 3 -n 28 --nthreads 2\n";
+    ex += "  Block-compressed input: txt2bin rgbs.txt rgbs.zbin 3 28 8\n";
+    ex += "                          mpirun -np 4 mrsom -m train -i rgbs.zbin -o rgbs -e 10 -n 28 -d 3 -b 4\n";
+    ex += "  Streaming input: mpirun -np 4 mrsom -m train -i rgbs.bin -o rgbs -e 10 -n 28 -d 3 -b 4 --stream 1 --readahead 2 --chunk-size 64\n\n";
     
     string ex2= "Example for sparse matrix\n";
     ex2 += "  Training: mpirun -np 4 mrsom -s 1 -m train -i rgbs-sparse.bin -x rgbs-sparse.idx -t rgbs-sparse.num -o rgbs-sparse -e 10 -n 28 -d 3 -b 4\n";
-    ex2 += "  Testing:  mrsom -s 1 -m test -c rgbs-sparse-codebook.txt -i rgbs-sparse.txt -o rgbs-sparse -d 3 -n 10 \n\n";
+    ex2 += "  Uneven work items: add --mapstyle 3 to let idle ranks steal work items\n";
+    ex2 += "  Testing:  mpirun -np 4 mrsom -s 1 -m test -c rgbs-sparse-codebook.txt -i rgbs-sparse.bin -x rgbs-sparse.idx -o rgbs-sparse -d 3 -n 28 \n\n";
+    ex2 += "Example for classification server\n";
+    ex2 += "  Serving:  mrsom -m serve -c rgbs-codebook.bin -d 3 --socket /tmp/mrsom.sock --nthreads 4\n\n";
 
     if (argc < 2 || (!strcmp(argv[1], "-?") || !strcmp(argv[1], "--?")
                  || !strcmp(argv[1], "/?") || !strcmp(argv[1], "/h")
@@ -124,7 +144,18 @@ int main(int argc, char** argv)
             bSPARSE = vm["sparse"].as<int>();       
         
         /// MANDATORY
-        if (vm.count("infile") && vm.count("nvecs") && vm.count("ndim") && vm.count("mode")) {
+        if (vm.count("mode") && !vm["mode"].as<string>().compare("serve")) {
+            RUNMODE = SERVE;
+            if (vm.count("codebook") && vm.count("ndim")) {
+                somMapFileName = vm["codebook"].as<string>();
+                NDIMEN = vm["ndim"].as<unsigned int>();
+            }
+            else {
+                cout << "Option error: serving needs codebook and ndim" << "\n" << ex << ex2;
+                return 1;
+            }
+        }
+        else if (vm.count("infile") && vm.count("nvecs") && vm.count("ndim") && vm.count("mode")) {
             binFileName = vm["infile"].as<string>();
             NVECS = vm["nvecs"].as<unsigned int>();
             NDIMEN = vm["ndim"].as<unsigned int>();
@@ -149,6 +180,14 @@ int main(int argc, char** argv)
                         return 1;
                     }
                 }
+                if (UMATFORMAT.compare("txt") && UMATFORMAT.compare("bin")) {
+                    cout << "Option error: umatformat should be txt or bin" << "\n" << ex << ex2;
+                    return 1;
+                }
+                if (MAPSTYLE < 0 || MAPSTYLE > 3 || (bSTREAM && MAPSTYLE != 0)) {
+                    cout << "Option error: mapstyle should be 0-3, and 0 for streaming" << "\n" << ex << ex2;
+                    return 1;
+                }
             }
             else if (!trainOrTest.compare("test")) {
                 RUNMODE = TEST;
@@ -158,6 +197,18 @@ int main(int argc, char** argv)
                     cout << "Option error: testing needs codebook" << "\n" << ex << ex2;
                     return 1;
                 }                
+                if (bSPARSE) {
+                    if (vm.count("indexfile")) 
+                        indexFileName = vm["indexfile"].as<string>();
+                    else {
+                        cout << "Option error: sparse mode error" << "\n" << ex << ex2;
+                        return 1;
+                    }
+                }
+                if (OUTFORMAT.compare("txt") && OUTFORMAT.compare("bin")) {
+                    cout << "Option error: outformat should be txt or bin" << "\n" << ex << ex2;
+                    return 1;
+                }
             }    
         }
         else {
@@ -167,6 +218,14 @@ int main(int argc, char** argv)
     }
  
 
+    ///
+    /// SERVING MODE: no input file and no MPI
+    ///
+    if (RUNMODE == SERVE) {
+        CODEBOOK.resize(boost::extents[SOM_Y][SOM_X][NDIMEN]);
+        return serve(somMapFileName.c_str(), SOCKETPATH.c_str());
+    }
+    
     ///
     /// Read input vector file
     ///
@@ -181,11 +240,30 @@ int main(int argc, char** argv)
     NUMER2.resize(boost::extents[SOM_Y * SOM_X * NDIMEN]);
     DENOM2.resize(boost::extents[SOM_Y * SOM_X]);
     
+    ///
+    /// MPI init
+    ///
+    int MPI_myId, MPI_nProcs, MPI_length;
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &MPI_myId);
+    g_RANKID = MPI_myId;
+    MPI_Comm_size(MPI_COMM_WORLD, &MPI_nProcs);
+    MPI_Barrier(MPI_COMM_WORLD);
+    double profile_time = MPI_Wtime();
+    
     ///
     /// TESTING MODE
     ///
     if (RUNMODE == TEST) {
-        test(somMapFileName.c_str(), binFileName.c_str());
+        test(somMapFileName.c_str());
+        
+        if (bSPARSE) 
+            MMAPIDXFILE.close();
+        MMAPBINFILE.close();
+        profile_time = MPI_Wtime() - profile_time;
+        if (MPI_myId == 0) 
+            cerr << "Total Execution Time: " << profile_time << endl;
+        MPI_Finalize();
         return 0;
     }
 
@@ -193,17 +271,6 @@ int main(int argc, char** argv)
     /// Fill initial random weights
     ///
     init_codebook((unsigned int)time(0));
-       
-    ///
-    /// MPI init
-    ///
-    int MPI_myId, MPI_nProcs, MPI_length;
-    MPI_Init(&argc, &argv);
-    MPI_Comm_rank(MPI_COMM_WORLD, &MPI_myId);
-    g_RANKID = MPI_myId;
-    MPI_Comm_size(MPI_COMM_WORLD, &MPI_nProcs);
-    MPI_Barrier(MPI_COMM_WORLD);
-    double profile_time = MPI_Wtime();
     
     ///
     /// MR-MPI
@@ -211,7 +278,10 @@ int main(int argc, char** argv)
     MapReduce* mr = new MapReduce(MPI_COMM_WORLD);
     /*
     * mapstyle = 0 (chunk) or 1 (stride) or 2 (master/slave)
+    *            or 3 (chunk + work stealing)
+    * mapmaster = 1 (mapstyle 2 master also runs tasks) or 0
     * all2all = 0 (irregular communication) or 1 (use MPI_Alltoallv)
+    *           or 2 (neighborhood collective)
     * verbosity = 0 (none) or 1 (summary) or 2 (histogrammed)
     * timer = 0 (none) or 1 (summary) or 2 (histogrammed)
     * memsize = N = number of Mbytes per page of memory
@@ -219,13 +289,15 @@ int main(int argc, char** argv)
     * maxpage = N = max # of pages allocatable per processor, 0 = no limit
     * keyalign = N = byte-alignment of keys
     * valuealign = N = byte-alignment of values
-    * fpath = string
+    * fpath = string, e.g. "/dev/shm@2048;/nvme0,/nvme1;/scratch"
     */
     mr->verbosity = 0;
     mr->timer = 0;
-    mr->mapstyle = 0;               /// NOTE: MPI_reduce() does not work with master/slave mode
+    mr->mapstyle = 0;               /// training map() uses MAPSTYLE, MPI_Reduce() map() needs 0
+    mr->mapmaster = 1;              /// rank 0 trains too with --mapstyle 2
     mr->memsize = SZPAGE;           /// page size
     mr->keyalign = sizeof(uint32_t);/// default: key type = uint32_t = 8 bytes
+    mr->set_fpath(FPATH.c_str());
     MPI_Barrier(MPI_COMM_WORLD);
 
     ///
@@ -254,9 +326,10 @@ int main(int argc, char** argv)
     /// reinterpret_cast memmapped bin file and set NVECSPERRANK and NVECSLEFT
     ///
     if (bSPARSE) {
-        assert(MMAPBINFILE.is_open());
+        assert(MMAPBINFILE.is_open() || bSTREAM);
         assert(MMAPIDXFILE.is_open());
-        FDATASPARSE = reinterpret_cast<SPARSE_STRUCT_T*>((char*)MMAPBINFILE.data());   
+        if (!bZBIN)
+            FDATASPARSE = reinterpret_cast<SPARSE_STRUCT_T*>((char*)MMAPBINFILE.data());   
         INDEXSPARSE = reinterpret_cast<INDEX_STRUCT_T*>((char*)MMAPIDXFILE.data());   
         
         ///
@@ -293,12 +366,22 @@ int main(int argc, char** argv)
         }        
     }
     else {
-        assert(MMAPBINFILE.is_open());
-        FDATA = reinterpret_cast<FLOAT_T*>((char*)MMAPBINFILE.data());   
+        assert(MMAPBINFILE.is_open() || bSTREAM);
+        if (!bZBIN)
+            FDATA = reinterpret_cast<FLOAT_T*>((char*)MMAPBINFILE.data());   
         NVECSPERRANK = ceil(NVECS / NBLOCKS);
         NVECSLEFT = NVECS % NBLOCKS; /// The last work item will be assigned NVECSPERRANK + NVECSLEFT vectors
     }
     
+    ///
+    /// Streaming: plan the chunks of the work items this rank gets from
+    /// map() with mapstyle 0. The same plan is read every epoch.
+    ///
+    if (bSTREAM) {
+        uint64_t nblocks64 = NBLOCKS;
+        make_stream_plan(MPI_myId * nblocks64 / MPI_nProcs, (MPI_myId + 1) * nblocks64 / MPI_nProcs);
+    }
+    
     ///
     /// Training
     ///
@@ -338,15 +421,24 @@ int main(int argc, char** argv)
         /// Each local map() gets blocks of input vectors and update NUMER1 and DENOM1
         /// and 
         ///
+        if (bSTREAM && chunkreader_start(&g_chunkReader)) {
+            cerr << "ERROR: failed to start the reader thread\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mr->mapstyle = MAPSTYLE;
         if (bSPARSE) 
             mr->map(NBLOCKS, &mr_map_train_batch_sparse, NULL);
         else         
             mr->map(NBLOCKS, &mr_map_train_batch, NULL);
+        if (bSTREAM)
+            chunkreader_join(&g_chunkReader);
         
         ///
         /// MPI_Reducing from workers to proc_0 using MPI_SUM op.
         /// Each NUMER and DENOM from workers MPI_Reduced to NUMER and DENOM of proc_0.
+        /// mapstyle 0 so that every rank runs exactly one MPI_Reduce() task.
         ///
+        mr->mapstyle = 0;
         mr->map(MPI_nProcs, &mr_map_mpi_reduce, NULL);
 
         ///
@@ -369,20 +461,31 @@ int main(int argc, char** argv)
     MPI_Barrier(MPI_COMM_WORLD);
 
     ///
-    /// Save u-matrix a codebook
+    /// Save u-matrix a codebook. The u-matrix rows are computed by all
+    /// ranks from the final codebook.
     ///
+    if (SZFLOAT == 4)
+        MPI_Bcast((void*)CODEBOOK.data(), SOM_Y * SOM_X * NDIMEN, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    else if (SZFLOAT == 8)
+        MPI_Bcast((void*)CODEBOOK.data(), SOM_Y * SOM_X * NDIMEN, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    
+    string umatFileName = OUTPREFIX + (UMATFORMAT.compare("bin") ? "-umat.txt" : "-umat.bin");
     if (MPI_myId == 0) {
         printf("INFO: Saving SOM map and U-Matrix...\n");
-        
-        string umatFileName = OUTPREFIX + "-umat.txt";                
         cout << "\tSaving U-mat file = " << umatFileName << endl;
-        int ret = save_umat(umatFileName.c_str());
+    }
+    int ret = save_umat(umatFileName.c_str());
+    if (MPI_myId == 0) {
         if (ret < 0) 
             printf("    Failed to save u-matrix. !\n");
         
         string cbFileName = OUTPREFIX + "-codebook.txt";
         cout << "\tCodebook file = " << cbFileName << endl;
         save_codebook(cbFileName.c_str());
+        
+        cbFileName = OUTPREFIX + "-codebook.bin";
+        cout << "\tBinary codebook file = " << cbFileName << endl;
+        save_codebook_bin(cbFileName.c_str());
     }
     MPI_Barrier(MPI_COMM_WORLD);
 
@@ -393,6 +496,14 @@ int main(int argc, char** argv)
     MMAPBINFILE.close();
     delete mr;
 
+    if (bSTREAM) {
+        double stallTime = 0.0;
+        MPI_Reduce(&g_chunkReader.stalltime, &stallTime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        if (MPI_myId == 0) 
+            cerr << "Max Read Stall Time: " << stallTime << endl;
+        chunkreader_close(&g_chunkReader);
+    }
+
     profile_time = MPI_Wtime() - profile_time;
     if (MPI_myId == 0) {
         cerr << "Total Execution Time: " << profile_time << endl;
@@ -434,17 +545,87 @@ void mr_map_train_batch(int itask,
                         KeyValue* kv,
                         void* ptr)
 {
-    int p1[SOM_D];
-    int p2[SOM_D];
-     
     uint32_t nvecs = NVECSPERRANK;
     /// Do NVECSPERRANK + NVECSLEFT if NVECSLEFT != 0 for the last work item
     if (itask == NBLOCKS - 1 && NVECSLEFT != 0) 
         nvecs = NVECSPERRANK + NVECSLEFT;
     
-    for (uint32_t n = 0; n < nvecs; n++) {
+    if (!bSTREAM) {
+        /// rows of the work item, mmapped or decompressed
+        train_rows(load_work_item(itask * NVECSPERRANK, nvecs), nvecs);
+        return;
+    }
+    
+    ///
+    /// Streaming: the chunks of the work item come from the reader thread
+    /// in order and the next chunk is loading while this one is processed.
+    ///
+    for (uint32_t n = 0; n < nvecs; ) {
+        const CHUNK_T* chunk = chunkreader_next(&g_chunkReader);
+        if (!chunk || chunk->itask != (uint32_t)itask) {
+            cerr << "ERROR: failed to read input chunk\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        train_rows(reinterpret_cast<const FLOAT_T*>(chunk->data), chunk->nrows);
+        n += chunk->nrows;
+        chunkreader_release(&g_chunkReader);
+    }
+}
+
+
+/** MR-MPI user-defined map function - batch training with MPI_reduce()
+ * @param itask - number of work items
+ * @param kv
+ * @param ptr
+ */
+
+void mr_map_train_batch_sparse(int itask,
+                               KeyValue* kv,
+                               void* ptr)
+{  
+    if ((size_t) itask >= g_vecSparseWorkItem.size())
+        return;
+    
+    /// row start~end for the work item assigned
+    uint32_t rowStart = g_vecSparseWorkItem[itask].start;
+    uint32_t rowEnd = g_vecSparseWorkItem[itask].end;
+    
+    if (!bSTREAM) {
+        /// items of the work item, mmapped or decompressed
+        train_rows_sparse(load_work_item_sparse(rowStart, rowEnd), rowStart, rowEnd);
+        return;
+    }
+    
+    for (uint32_t n = rowStart; n < rowEnd+1; ) {
+        const CHUNK_T* chunk = chunkreader_next(&g_chunkReader);
+        if (!chunk || chunk->itask != (uint32_t)itask) {
+            cerr << "ERROR: failed to read input chunk\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        train_rows_sparse(reinterpret_cast<const SPARSE_STRUCT_T*>(chunk->data), 
+                          chunk->rowStart, chunk->rowStart + chunk->nrows - 1);
+        n += chunk->nrows;
+        chunkreader_release(&g_chunkReader);
+    }
+}
+
+
+/** Accumulate NUMER1 and DENOM1 for dense rows
+ * @param rows - first row
+ * @param nrows - num of rows
+ */
+
+void train_rows(const FLOAT_T* rows,
+                uint32_t nrows)
+{
+    int p1[SOM_D];
+    int p2[SOM_D];
+     
+    for (uint32_t n = 0; n < nrows; n++) {
+        const FLOAT_T* vec = rows + n * NDIMEN;
+        
         /// get the coords of the best matching unit 
-        get_bmu_coord(p1, itask, n);
+        get_bmu_coord(p1, vec);
 
         /// Accumulate denoms and numers
         for (size_t y = 0; y < SOM_Y; y++) {
@@ -460,7 +641,7 @@ void mr_map_train_batch(int itask,
                 neighbor_fuct = exp(-(1.0f * dist * dist) / (R * R));
 
                 for (size_t d = 0; d < NDIMEN; d++) {
-                    FLOAT_T v = *((FDATA + itask * NDIMEN * NVECSPERRANK) + n * NDIMEN + d);
+                    FLOAT_T v = vec[d];
                     NUMER1[y * SOM_X * NDIMEN + x * NDIMEN + d] += 1.0f * neighbor_fuct * v;
                 }
                 DENOM1[y * SOM_X + x] += neighbor_fuct;
@@ -470,26 +651,28 @@ void mr_map_train_batch(int itask,
 }
 
 
-/** MR-MPI user-defined map function - batch training with MPI_reduce()
- * @param itask - number of work items
- * @param kv
- * @param ptr
+/** Accumulate NUMER1 and DENOM1 for sparse rows
+ * @param items - items of rowStart~rowEnd
+ * @param rowStart - first row
+ * @param rowEnd - last row
  */
 
-void mr_map_train_batch_sparse(int itask,
-                               KeyValue* kv,
-                               void* ptr)
+void train_rows_sparse(const SPARSE_STRUCT_T* items,
+                       uint32_t rowStart,
+                       uint32_t rowEnd)
 {  
     int p1[SOM_D];
     int p2[SOM_D];
     
-    /// row start~end for the work item assigned
-    uint32_t rowStart = g_vecSparseWorkItem[itask].start;
-    uint32_t rowEnd = g_vecSparseWorkItem[itask].end;
+    uint32_t itemStart = (INDEXSPARSE + rowStart)->num_values_accum - (INDEXSPARSE + rowStart)->num_values;
     
     for (uint32_t n = rowStart; n < rowEnd+1; n++) {
+        uint32_t numValues = (INDEXSPARSE + n)->num_values;
+        uint32_t numValuesAcc = (INDEXSPARSE + n)->num_values_accum;
+        const SPARSE_STRUCT_T* rowItems = items + (numValuesAcc - numValues - itemStart);
+        
         /// get the best matching unit
-        get_bmu_coord(p1, itask, n);
+        get_bmu_coord_sparse(p1, rowItems, numValues);
         
         /// Accumulate denoms and numers
         for (size_t y = 0; y < SOM_Y; y++) {
@@ -504,17 +687,9 @@ void mr_map_train_batch_sparse(int itask,
                 FLOAT_T neighbor_fuct = 0.0f;
                 neighbor_fuct = exp(-(1.0f * dist * dist) / (R * R));
 
-                uint32_t numValues = (INDEXSPARSE + n)->num_values;
-                uint32_t numValuesAcc = (INDEXSPARSE + n)->num_values_accum;
-                uint32_t dataLoc = numValuesAcc - numValues; 
-                size_t d2 = 0;
-                for (size_t d = 0; d < NDIMEN; d++) {
-                    FLOAT_T v = 0.0;
-                    if ((FDATASPARSE + dataLoc + d2)->index == d)  {
-                        v = (FDATASPARSE + dataLoc + d2)->value;
-                        d2++;
-                        NUMER1[y * SOM_X * NDIMEN + x * NDIMEN + d] += 1.0f * neighbor_fuct * v;
-                    }
+                for (size_t d2 = 0; d2 < numValues; d2++) {
+                    FLOAT_T v = rowItems[d2].value;
+                    NUMER1[y * SOM_X * NDIMEN + x * NDIMEN + rowItems[d2].index] += 1.0f * neighbor_fuct * v;
                 }
                 DENOM1[y * SOM_X + x] += neighbor_fuct;
             }
@@ -526,13 +701,11 @@ void mr_map_train_batch_sparse(int itask,
 
 /** MR-MPI Map function - Get node coords for the best matching unit (BMU)
  * @param coords - BMU coords
- * @param itask - #task
- * @param n - row num in the input feature file
+ * @param vec - feature vector
  */
 
 void get_bmu_coord(int* coords,
-                   int itask,
-                   uint32_t rownum)
+                   const FLOAT_T* vec)
 {
     FLOAT_T mindist = std::numeric_limits<FLOAT_T>::max();
     FLOAT_T dist = 0.0f;
@@ -543,9 +716,33 @@ void get_bmu_coord(int* coords,
     ///
     for (size_t y = 0; y < SOM_Y; y++) {
         for (size_t x = 0; x < SOM_X; x++) {
-            /// dist = get_distance(CODEBOOK[y][x],
-            /// (FDATA + itask*NDIMEN*NVECSPERRANK) + n*NDIMEN, DISTOPT);
-            dist = get_distance(y, x, itask, rownum, DISTOPT);
+            dist = get_distance(y, x, vec, DISTOPT);
+            if (dist < mindist) {
+                mindist = dist;
+                coords[0] = x;
+                coords[1] = y;
+            }
+        }
+    }
+}
+
+
+/** MR-MPI Map function - Get node coords for the BMU of a sparse row
+ * @param coords - BMU coords
+ * @param items - non-zero items of the row
+ * @param nitems - num of items
+ */
+
+void get_bmu_coord_sparse(int* coords,
+                          const SPARSE_STRUCT_T* items,
+                          uint32_t nitems)
+{
+    FLOAT_T mindist = std::numeric_limits<FLOAT_T>::max();
+    FLOAT_T dist = 0.0f;
+
+    for (size_t y = 0; y < SOM_Y; y++) {
+        for (size_t x = 0; x < SOM_X; x++) {
+            dist = get_distance_sparse(y, x, items, nitems);
             if (dist < mindist) {
                 mindist = dist;
                 coords[0] = x;
@@ -556,70 +753,30 @@ void get_bmu_coord(int* coords,
 }
 
 
-/** MR-MPI Map function - Distance b/w a feature vector and a weight vector
+/** MR-MPI Map function - Distance b/w a sparse row and a weight vector
  * = Euclidean
  * @param y
  * @param x
- * @param r - row number in the input feature file
- * @param distance_metric
+ * @param items - non-zero items of the row, sorted by index
+ * @param nitems - num of items
  */
 
-FLOAT_T get_distance(size_t y,
-                     size_t x,
-                     int itask,
-                     size_t rownum,
-                     unsigned int distance_metric)
+FLOAT_T get_distance_sparse(size_t y,
+                            size_t x,
+                            const SPARSE_STRUCT_T* items,
+                            uint32_t nitems)
 {
     FLOAT_T distance = 0.0f;
-    if (bSPARSE) {
-        uint32_t numValues = (INDEXSPARSE+rownum)->num_values;
-        uint32_t numValuesAcc = (INDEXSPARSE+rownum)->num_values_accum;
-        uint32_t dataLoc = numValuesAcc - numValues;
-        size_t d2 = 0;
-        for (size_t d = 0; d < NDIMEN; d++) {
-            /// *((FDATASPARSE + itask * NDIMEN * NVECSPERRANK) + rownum * NDIMEN + d)
-            FLOAT_T v = 0.0;
-            if ((FDATASPARSE+dataLoc+d2)->index == d)  {
-                v = (FDATASPARSE+dataLoc+d2)->value;
-                d2++;
-            }
-            distance += (CODEBOOK[y][x][d] - v) * (CODEBOOK[y][x][d] - v);
-        }
-        return sqrt(distance);
-    }
-    else {
-        switch (distance_metric) {
-        default:
-        case 0: /// EUCLIDIAN
-            for (size_t d = 0; d < NDIMEN; d++) {
-                FLOAT_T v = *((FDATA + itask * NDIMEN * NVECSPERRANK) + rownum * NDIMEN + d);
-                distance += (CODEBOOK[y][x][d] - v) * (CODEBOOK[y][x][d] - v);
-            }
-            return sqrt(distance);
-        //case 1: /// SOSD: //SUM OF SQUARED DISTANCES
-            //if (m_weights_number >= 4) {
-                //distance = mse(vec, m_weights, m_weights_number);
-            //} else {
-            //for (unsigned int d = 0; d < NDIMEN; d++)
-                //distance += (vec[d] - wvec[d]) * (vec[d] - wvec[d]);
-            //}
-            //return distance;
-        //case 2: /// TXCB: //TAXICAB
-            //for (unsigned int d = 0; d < NDIMEN; d++)
-                //distance += fabs(vec[d] - wvec[d]);
-            //return distance;
-        //case 3: /// ANGL: //ANGLE BETWEEN VECTORS
-            //for (unsigned int d = 0; d < NDIMEN; d++) {
-                //distance += vec[d] * wvec[d];
-                //n1 += vec[d] * vec[d];
-                //n2 += wvec[d] * wvec[d];
-            //}
-            //return acos(distance / (sqrt(n1) * sqrt(n2)));
-        //case 4: /// MHLN:   //mahalanobis
-            //distance = sqrt(m_weights * cov * vec)
-            //return distance
+    size_t d2 = 0;
+    for (size_t d = 0; d < NDIMEN; d++) {
+        FLOAT_T v = 0.0;
+        if (d2 < nitems && items[d2].index == d)  {
+            v = items[d2].value;
+            d2++;
         }
+        distance += (CODEBOOK[y][x][d] - v) * (CODEBOOK[y][x][d] - v);
     }
+    return sqrt(distance);
 }
 
 
@@ -708,54 +865,69 @@ FLOAT_T* get_wvec(size_t y,
     return wvec;
 }
 
-/** Save u-matrix
+/** Save u-matrix - the mean distance of each node to its 8 neighbors.
+ * Rows are split over ranks and threads and gathered to rank 0, which
+ * writes the text or binary (SOM_Y x SOM_X FLOAT_T) file. Collective.
  * @param fname
  */
 
 int save_umat(const char* fname)
 {
-    int D = 2;
-    FLOAT_T min_dist = 1.5f;
+    int myId, nProcs;
+    MPI_Comm_rank(MPI_COMM_WORLD, &myId);
+    MPI_Comm_size(MPI_COMM_WORLD, &nProcs);
+    
+    ///
+    /// Rows of this rank, split over threads
+    ///
+    size_t rowStart = myId * SOM_Y / nProcs;
+    size_t rowEnd = (myId + 1) * SOM_Y / nProcs;
+    vector<FLOAT_T> umat(SOM_Y * SOM_X);
+    
+    int nThreads = NTHREADS < 1 ? 1 : NTHREADS;
+    vector<pthread_t> threads(nThreads);
+    vector<UMATJOB_T> jobs(nThreads);
+    for (int t = 0; t < nThreads; t++) {
+        jobs[t].start = rowStart + (rowEnd - rowStart) * t / nThreads;
+        jobs[t].end = rowStart + (rowEnd - rowStart) * (t + 1) / nThreads;
+        jobs[t].umat = umat.data() + jobs[t].start * SOM_X;
+        if (t > 0 && pthread_create(&threads[t], NULL, umat_thread, &jobs[t])) {
+            cerr << "ERROR: failed to create thread\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    umat_thread(&jobs[0]);
+    for (int t = 1; t < nThreads; t++) 
+        pthread_join(threads[t], NULL);
+    
+    ///
+    /// Gather rows to rank 0
+    ///
+    vector<int> counts(nProcs), displs(nProcs);
+    for (int p = 0; p < nProcs; p++) {
+        displs[p] = (p * SOM_Y / nProcs) * SOM_X * SZFLOAT;
+        counts[p] = ((p + 1) * SOM_Y / nProcs) * SOM_X * SZFLOAT - displs[p];
+    }
+    MPI_Gatherv(myId == 0 ? MPI_IN_PLACE : (void*)(umat.data() + rowStart * SOM_X), 
+                counts[myId], MPI_BYTE, umat.data(), counts.data(), displs.data(), 
+                MPI_BYTE, 0, MPI_COMM_WORLD);
+    if (myId != 0)
+        return 0;
+    
+    if (!UMATFORMAT.compare("bin")) {
+        FILE* fp = fopen(fname, "wb");
+        if (fp == 0)
+            return -2;
+        size_t n = fwrite(umat.data(), SZFLOAT, umat.size(), fp);
+        fclose(fp);
+        return n == umat.size() ? 0 : -2;
+    }
+    
     FILE* fp = fopen(fname, "wt");
     if (fp != 0) {
-        unsigned int n = 0;
-        for (size_t som_y1 = 0; som_y1 < SOM_Y; som_y1++) {
-            for (size_t som_x1 = 0; som_x1 < SOM_X; som_x1++) {
-                FLOAT_T dist = 0.0f;
-                unsigned int nodes_number = 0;
-                int coords1[2];
-                coords1[0] = som_x1;
-                coords1[1] = som_y1;
-
-                for (size_t som_y2 = 0; som_y2 < SOM_Y; som_y2++) {
-                    for (size_t som_x2 = 0; som_x2 < SOM_X; som_x2++) {
-                        unsigned int coords2[2];
-                        coords2[0] = som_x2;
-                        coords2[1] = som_y2;
-
-                        if (som_x1 == som_x2 && som_y1 == som_y2) 
-                            continue;
-
-                        FLOAT_T tmp = 0.0;
-                        for (size_t d = 0; d < D; d++) {
-                            tmp += pow(coords1[d] - coords2[d], 2.0f);
-                        }
-                        tmp = sqrt(tmp);
-                        if (tmp <= min_dist) {
-                            nodes_number++;
-                            FLOAT_T* vec1 = get_wvec(som_y1, som_x1);
-                            FLOAT_T* vec2 = get_wvec(som_y2, som_x2);
-                            dist += get_distance(vec1, vec2, DISTOPT);
-                            free(vec1);
-                            free(vec2);
-                        }
-                    }
-                }
-                dist /= (FLOAT_T)nodes_number;
-                if (isnan(dist)) 
-                    dist = 0.0;
-                fprintf(fp, " %f", dist);
-            }
+        for (size_t y = 0; y < SOM_Y; y++) {
+            for (size_t x = 0; x < SOM_X; x++) 
+                fprintf(fp, " %f", umat[y * SOM_X + x]);
             fprintf(fp, "\n");
         }
         fclose(fp);
@@ -765,6 +937,40 @@ int save_umat(const char* fname)
         return -2;
 }
 
+/** umat_thread - u-matrix values of the rows of one thread
+ * @param ptr - UMATJOB_T
+ */
+
+void* umat_thread(void* ptr)
+{
+    UMATJOB_T* job = static_cast<UMATJOB_T*>(ptr);
+    const FLOAT_T* cb = CODEBOOK.data();
+    for (size_t y = job->start; y < job->end; y++) {
+        size_t y0 = y > 0 ? y - 1 : 0;
+        size_t y1 = y + 1 < SOM_Y ? y + 1 : SOM_Y - 1;
+        for (size_t x = 0; x < SOM_X; x++) {
+            size_t x0 = x > 0 ? x - 1 : 0;
+            size_t x1 = x + 1 < SOM_X ? x + 1 : SOM_X - 1;
+            const FLOAT_T* vec1 = cb + (y * SOM_X + x) * NDIMEN;
+            FLOAT_T dist = 0.0f;
+            unsigned int nodes_number = 0;
+            for (size_t y2 = y0; y2 <= y1; y2++) {
+                for (size_t x2 = x0; x2 <= x1; x2++) {
+                    if (x2 == x && y2 == y) 
+                        continue;
+                    nodes_number++;
+                    dist += get_distance(vec1, cb + (y2 * SOM_X + x2) * NDIMEN, DISTOPT);
+                }
+            }
+            dist /= (FLOAT_T)nodes_number;
+            if (isnan(dist)) 
+                dist = 0.0;
+            job->umat[(y - job->start) * SOM_X + x] = dist;
+        }
+    }
+    return NULL;
+}
+
 
 
 /** Classify - Compute BMU for new test vectors on the trained SOM MAP. The
@@ -776,23 +982,7 @@ int save_umat(const char* fname)
 void classify(const FLOAT_T* vec, 
               int* p)
 {
-    FLOAT_T mindist = std::numeric_limits<FLOAT_T>::max();
-    FLOAT_T dist = 0.0f;
-
-    ///
-    /// Check SOM_X * SOM_Y nodes one by one and compute the distance
-    /// D(W_K, Fvec) and get the mindist and get the coords for the BMU.
-    ///
-    for (size_t y = 0; y < SOM_Y; y++) {
-        for (size_t x = 0; x < SOM_X; x++) {
-            dist = get_distance(y, x, vec, DISTOPT);
-            if (dist < mindist) {
-                mindist = dist;
-                p[0] = x;
-                p[1] = y;
-            }
-        }
-    }
+    get_bmu_coord(p, vec);
 }
 
 
@@ -840,6 +1030,49 @@ int save_codebook(const char* cbFileName)
     }
 }
 
+/** Save codebook to binary file
+ * @param fname
+ */
+ 
+int save_codebook_bin(const char* cbFileName)
+{
+    FILE* fp = fopen(cbFileName, "wb");
+    if (!fp) 
+        return 1;
+    CODEBOOK_HEADER_T header;
+    header.magic = CODEBOOK_MAGIC;
+    header.somx = SOM_X;
+    header.somy = SOM_Y;
+    header.ndimen = NDIMEN;
+    header.szfloat = SZFLOAT;
+    size_t n = SOM_Y * SOM_X * NDIMEN;
+    int ret = 0;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 
+        || fwrite(CODEBOOK.data(), SZFLOAT, n, fp) != n)
+        ret = 1;
+    fclose(fp);
+    return ret;
+}
+
+/** Load codebook from binary file
+ * @param fp
+ */
+ 
+int load_codebook_bin(FILE* fp)
+{
+    CODEBOOK_HEADER_T header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != CODEBOOK_MAGIC
+        || header.somx != SOM_X || header.somy != SOM_Y || header.ndimen != NDIMEN
+        || header.szfloat != SZFLOAT) {
+        cerr << "ERROR: binary codebook does not match mrsom.ini and ndim\n";
+        return 1;
+    }
+    size_t n = SOM_Y * SOM_X * NDIMEN;
+    if (fread(CODEBOOK.data(), SZFLOAT, n, fp) != n)
+        return 1;
+    return 0;
+}
+
 /** Load codebook from file
  * @param fname
  */
@@ -848,6 +1081,14 @@ int load_codebook(const char *mapFilename)
 {
     FILE* somMapFile = fopen(mapFilename, "r");
     if (somMapFile) {
+        uint32_t magic = 0;
+        if (fread(&magic, sizeof(magic), 1, somMapFile) == 1 && magic == CODEBOOK_MAGIC) {
+            rewind(somMapFile);
+            int ret = load_codebook_bin(somMapFile);
+            fclose(somMapFile);
+            return ret;
+        }
+        rewind(somMapFile);
         for (size_t y = 0; y < SOM_Y; y++) {
             for (size_t x = 0; x < SOM_X; x++) {
                 for (size_t d = 0; d < NDIMEN; d++) {
@@ -886,6 +1127,14 @@ void read_matrix(const char *filename, const char *idxfilename)
         }
     }
     
+    ///
+    /// Streaming training reads the bin file with a reader thread
+    ///
+    if (bSTREAM && RUNMODE == TRAIN) {
+        open_stream(filename);
+        return;
+    }
+    
     unsigned long int realFileSize = boost::filesystem::file_size(filename);
     MMAPBINFILE.open(filename, realFileSize, 0);
     if (!MMAPBINFILE.is_open()) {
@@ -893,54 +1142,817 @@ void read_matrix(const char *filename, const char *idxfilename)
         MPI_Finalize();
         exit(1);
     }
+    
+    ///
+    /// Block-compressed input: the header and the block index are at the
+    /// beginning of the file. The blocks are decompressed on demand.
+    ///
+    if (zbin_check(MMAPBINFILE.data(), realFileSize)) {
+        bZBIN = 1;
+        ZBINHEADER = reinterpret_cast<const ZBIN_HEADER_T*>(MMAPBINFILE.data());
+        ZBININDEX = reinterpret_cast<const ZBIN_BLOCK_T*>(MMAPBINFILE.data() + sizeof(ZBIN_HEADER_T));
+        if (ZBINHEADER->codec != ZBIN_ZLIB || ZBINHEADER->sparse != (uint32_t)bSPARSE
+            || ZBINHEADER->ndimen != NDIMEN || ZBINHEADER->nvecs != NVECS) {
+            cerr << "ERROR: zbin file does not match the input options\n";
+            MPI_Finalize();
+            exit(1);
+        }
+    }
+}
+
+/** open_stream: open input file for streaming
+ * @param fname
+ */
+
+void open_stream(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        cerr << "ERROR: failed to open bin file\n";
+        MPI_Finalize();
+        exit(1);
+    }
+    char header[sizeof(ZBIN_HEADER_T)];
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    if (n > 0 && zbin_check(header, n)) {
+        cerr << "ERROR: streaming needs an uncompressed bin file\n";
+        MPI_Finalize();
+        exit(1);
+    }
+    chunkreader_init(&g_chunkReader, fd, READAHEAD, (size_t)SZCHUNK * 1024 * 1024);
+}
+
+/** make_stream_plan: split the work items taskStart~taskEnd-1 into chunks
+ * of up to SZCHUNK MB, in the order map() calls them
+ * @param taskStart
+ * @param taskEnd
+ */
+
+void make_stream_plan(int taskStart,
+                      int taskEnd)
+{
+    uint64_t chunkSize = (uint64_t)SZCHUNK * 1024 * 1024;
+    g_chunkReader.plan.clear();
+    
+    for (int itask = taskStart; itask < taskEnd; itask++) {
+        CHUNK_T chunk;
+        chunk.itask = itask;
+        chunk.data = NULL;
+        if (bSPARSE) {
+            if ((size_t) itask >= g_vecSparseWorkItem.size())
+                break;
+            uint32_t row = g_vecSparseWorkItem[itask].start;
+            uint32_t rowEnd = g_vecSparseWorkItem[itask].end;
+            while (row <= rowEnd) {
+                uint64_t itemStart = (INDEXSPARSE + row)->num_values_accum - (INDEXSPARSE + row)->num_values;
+                chunk.rowStart = row;
+                chunk.nrows = 0;
+                chunk.offset = itemStart * sizeof(SPARSE_STRUCT_T);
+                chunk.nbytes = 0;
+                while (row <= rowEnd) {
+                    uint64_t rowBytes = (INDEXSPARSE + row)->num_values * sizeof(SPARSE_STRUCT_T);
+                    if (chunk.nrows && chunk.nbytes + rowBytes > chunkSize)
+                        break;
+                    chunk.nbytes += rowBytes;
+                    chunk.nrows++;
+                    row++;
+                }
+                g_chunkReader.plan.push_back(chunk);
+            }
+        }
+        else {
+            uint32_t nvecs = NVECSPERRANK;
+            if (itask == NBLOCKS - 1 && NVECSLEFT != 0) 
+                nvecs = NVECSPERRANK + NVECSLEFT;
+            uint64_t rowBytes = NDIMEN * SZFLOAT;
+            uint32_t rowsPerChunk = chunkSize / rowBytes;
+            if (rowsPerChunk == 0)
+                rowsPerChunk = 1;
+            for (uint32_t n = 0; n < nvecs; n += rowsPerChunk) {
+                chunk.rowStart = itask * NVECSPERRANK + n;
+                chunk.nrows = min(rowsPerChunk, nvecs - n);
+                chunk.offset = chunk.rowStart * rowBytes;
+                chunk.nbytes = chunk.nrows * rowBytes;
+                g_chunkReader.plan.push_back(chunk);
+            }
+        }
+    }
+}
+
+/** load_work_item: get the rows of a work item
+ * @param rowStart - first row
+ * @param nrows - num of rows
+ */
+
+const FLOAT_T* load_work_item(uint32_t rowStart,
+                              uint32_t nrows)
+{
+    if (!bZBIN)
+        return FDATA + (size_t)rowStart * NDIMEN;
+    
+    const char* rows = load_blocks(rowStart, rowStart + nrows - 1);
+    uint32_t firstRow = rowStart - rowStart % ZBINHEADER->rowsperblock;
+    return reinterpret_cast<const FLOAT_T*>(rows) + (size_t)(rowStart - firstRow) * NDIMEN;
 }
 
-/** test
+/** load_work_item_sparse: get the items of a sparse work item
+ * @param rowStart - first row
+ * @param rowEnd - last row
+ */
+
+const SPARSE_STRUCT_T* load_work_item_sparse(uint32_t rowStart,
+                                             uint32_t rowEnd)
+{
+    uint32_t itemStart = (INDEXSPARSE + rowStart)->num_values_accum - (INDEXSPARSE + rowStart)->num_values;
+    if (!bZBIN)
+        return FDATASPARSE + itemStart;
+    
+    const char* items = load_blocks(rowStart, rowEnd);
+    uint32_t firstRow = rowStart - rowStart % ZBINHEADER->rowsperblock;
+    uint32_t firstItem = (INDEXSPARSE + firstRow)->num_values_accum - (INDEXSPARSE + firstRow)->num_values;
+    return reinterpret_cast<const SPARSE_STRUCT_T*>(items) + (itemStart - firstItem);
+}
+
+/** load_blocks: decompress the blocks which hold rows rowStart~rowEnd
+ * into the reusable block buffer
+ * @param rowStart - first row
+ * @param rowEnd - last row
+ */
+
+const char* load_blocks(uint32_t rowStart,
+                        uint32_t rowEnd)
+{
+    uint32_t blockStart = rowStart / ZBINHEADER->rowsperblock;
+    uint32_t blockEnd = rowEnd / ZBINHEADER->rowsperblock;
+    
+    size_t size = 0;
+    for (uint32_t b = blockStart; b <= blockEnd; b++) 
+        size += ZBININDEX[b].usize;
+    if (g_vecBlockBuffer.size() < size)
+        g_vecBlockBuffer.resize(size);
+    
+    size_t offset = 0;
+    for (uint32_t b = blockStart; b <= blockEnd; b++) {
+        if (zbin_decompress(MMAPBINFILE.data(), ZBININDEX + b, g_vecBlockBuffer.data() + offset)) {
+            cerr << "ERROR: failed to decompress block " << b << "\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        offset += ZBININDEX[b].usize;
+    }
+    return g_vecBlockBuffer.data();
+}
+
+/** test - classify the input rows, already opened by read_matrix(), in
+ * parallel. Row ranges are partitioned across ranks and threads, and each
+ * rank writes the result of its rows at its offset in the result file.
  * @param codebook
- * @param infilename
  */
  
-void test(const char* codebook, 
-          const char* binFileName) 
+void test(const char* codebook) 
 {
+    int myId, nProcs;
+    MPI_Comm_rank(MPI_COMM_WORLD, &myId);
+    MPI_Comm_size(MPI_COMM_WORLD, &nProcs);
+    
     ///
     /// Load codebook
     ///
     if (load_codebook(codebook) > 0) {
         cerr << "ERROR: codebook load error.\n";
-        exit(0);
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
-
+    g_vecNodeNorm.assign(SOM_Y * SOM_X, 0.0);
+    for (size_t k = 0; k < SOM_Y * SOM_X; k++) {
+        const FLOAT_T* w = CODEBOOK.data() + k * NDIMEN;
+        for (size_t d = 0; d < NDIMEN; d++) 
+            g_vecNodeNorm[k] += (double)w[d] * w[d];
+    }
+    
+    ///
+    /// The input should be a bin (or zbin) file of NVECS rows
+    ///
+    if (bSPARSE) {
+        if (MMAPIDXFILE.size() != (uint64_t)NVECS * sizeof(INDEX_STRUCT_T)) {
+            if (myId == 0)
+                cerr << "ERROR: index file should have " << NVECS << " rows.\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        INDEXSPARSE = reinterpret_cast<INDEX_STRUCT_T*>((char*)MMAPIDXFILE.data());   
+    }
+    if (!bZBIN) {
+        uint64_t expected = (uint64_t)NVECS * NDIMEN * SZFLOAT;
+        if (bSPARSE) 
+            expected = NVECS ? (uint64_t)(INDEXSPARSE + NVECS - 1)->num_values_accum * sizeof(SPARSE_STRUCT_T) : 0;
+        if (MMAPBINFILE.size() != expected) {
+            if (myId == 0)
+                cerr << "ERROR: test input should be a bin file of " << NVECS << " rows (see txt2bin).\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        if (bSPARSE) 
+            FDATASPARSE = reinterpret_cast<SPARSE_STRUCT_T*>((char*)MMAPBINFILE.data());   
+        else
+            FDATA = reinterpret_cast<FLOAT_T*>((char*)MMAPBINFILE.data());   
+    }
+    
     ///
     /// Classification: get the coords of the trained SOM MAP for new
     /// vectors for testing.
     ///
-    string classFileName = OUTPREFIX + "-class.txt";
-    FILE* classOutFile = fopen(classFileName.c_str(), "w");
-    int p[SOM_D];
+    int bBinOut = !OUTFORMAT.compare("bin");
+    string classFileName = OUTPREFIX + (bBinOut ? "-class.bin" : "-class.txt");
+    MPI_File classOutFile;
+    if (MPI_File_open(MPI_COMM_WORLD, (char*)classFileName.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                      MPI_INFO_NULL, &classOutFile) != MPI_SUCCESS) {
+        if (myId == 0)
+            cerr << "ERROR: test file open error.\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_File bmuOutFile;
+    string bmuFileName = OUTPREFIX + "-bmu.bin";
+    if (bBMUOUT && MPI_File_open(MPI_COMM_WORLD, (char*)bmuFileName.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                                 MPI_INFO_NULL, &bmuOutFile) != MPI_SUCCESS) {
+        if (myId == 0)
+            cerr << "ERROR: bmu file open error.\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
     
-    FILE* testingFile = fopen(binFileName, "r");
-    FLOAT_T vec[NDIMEN];        
-    if (classOutFile && testingFile) {
-        for (size_t nvec = 0; nvec < NVECS; nvec++) {
-            for (size_t d = 0; d < NDIMEN; d++) {
-                FLOAT_T tmp = 0.0f;
-                fscanf(testingFile, "%f", &tmp);
-                vec[d] = tmp;
+    uint64_t nvecs64 = NVECS;
+    uint32_t rowStart = myId * nvecs64 / nProcs;
+    uint32_t rowEnd = (myId + 1) * nvecs64 / nProcs;
+    
+    /// every rank does the same num of collective writes
+    uint32_t nSlabs = (rowEnd - rowStart + NSLABROWS - 1) / NSLABROWS;
+    uint32_t maxSlabs = 0;
+    MPI_Allreduce(&nSlabs, &maxSlabs, 1, MPI_UNSIGNED, MPI_MAX, MPI_COMM_WORLD);
+    
+    int nThreads = NTHREADS < 1 ? 1 : NTHREADS;
+    vector<BMU_RESULT_T> results(NSLABROWS);
+    vector<int> coords(2 * NSLABROWS);
+    vector<char> outBuf;
+    vector<BMU_RECORD_T> records(bBMUOUT ? NSLABROWS : 0);
+    double qeSum = 0.0;             /// sum of BMU distances
+    uint64_t teCount = 0;           /// num of rows whose runner-up is not a neighbor of the BMU
+    vector<pthread_t> threads(nThreads);
+    vector<CLASSIFYJOB_T> jobs(nThreads);
+    uint64_t txtOffset = 0;         /// bytes written by all ranks in previous slabs
+    
+    for (uint32_t slab = 0; slab < maxSlabs; slab++) {
+        uint32_t slabStart = min(rowStart + slab * NSLABROWS, rowEnd);
+        uint32_t slabRows = min((uint32_t)NSLABROWS, rowEnd - slabStart);
+        
+        ///
+        /// BMU search, rows of the slab split over threads
+        ///
+        if (slabRows) {
+            const FLOAT_T* rows = NULL;
+            const SPARSE_STRUCT_T* items = NULL;
+            if (bSPARSE) 
+                items = load_work_item_sparse(slabStart, slabStart + slabRows - 1);
+            else
+                rows = load_work_item(slabStart, slabRows);
+            
+            for (int t = 0; t < nThreads; t++) {
+                jobs[t].rows = rows;
+                jobs[t].items = items;
+                jobs[t].slabStart = slabStart;
+                jobs[t].start = (uint64_t)slabRows * t / nThreads;
+                jobs[t].end = (uint64_t)slabRows * (t + 1) / nThreads;
+                jobs[t].results = results.data();
+                if (t > 0 && pthread_create(&threads[t], NULL, classify_thread, &jobs[t])) {
+                    cerr << "ERROR: failed to create thread\n";
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
             }
-            /////////////////
-            classify(vec, p);
-            /////////////////
-            fprintf(classOutFile, "%d\t%d\n", p[0], p[1]); /// somx,somy
+            classify_thread(&jobs[0]);
+            for (int t = 1; t < nThreads; t++) 
+                pthread_join(threads[t], NULL);
+            
+            for (uint32_t n = 0; n < slabRows; n++) {
+                coords[2 * n] = results[n].bmu % SOM_X;
+                coords[2 * n + 1] = results[n].bmu / SOM_X;
+                
+                /// quantization and topographic error
+                qeSum += sqrt(results[n].dist);
+                int dx = abs((int)(results[n].bmu2 % SOM_X) - coords[2 * n]);
+                int dy = abs((int)(results[n].bmu2 / SOM_X) - coords[2 * n + 1]);
+                if (dx > 1 || dy > 1)
+                    teCount++;
+                
+                if (bBMUOUT) {
+                    records[n].bmu = results[n].bmu;
+                    records[n].dist = results[n].dist;
+                    records[n].bmu2 = results[n].bmu2;
+                }
+            }
+        }
+        
+        ///
+        /// Write: binary records are at fixed offsets, text lines at the
+        /// offset given by the byte counts of the lower ranks
+        ///
+        MPI_Status status;
+        if (bBMUOUT) {
+            MPI_Offset offset = (MPI_Offset)slabStart * sizeof(BMU_RECORD_T);
+            MPI_File_write_at_all(bmuOutFile, offset, records.data(), slabRows * sizeof(BMU_RECORD_T), 
+                                  MPI_BYTE, &status);
+        }
+        if (bBinOut) {
+            MPI_Offset offset = (MPI_Offset)slabStart * 2 * sizeof(int);
+            MPI_File_write_at_all(classOutFile, offset, coords.data(), 2 * slabRows, MPI_INT, &status);
+        }
+        else {
+            outBuf.resize((size_t)slabRows * 24);
+            size_t len = 0;
+            for (uint32_t n = 0; n < slabRows; n++) 
+                len += sprintf(&outBuf[len], "%d\t%d\n", coords[2 * n], coords[2 * n + 1]); /// somx,somy
+            
+            uint64_t myBytes = len, lowerBytes = 0, allBytes = 0;
+            MPI_Exscan(&myBytes, &lowerBytes, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+            MPI_Allreduce(&myBytes, &allBytes, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+            if (myId == 0)
+                lowerBytes = 0;
+            
+            MPI_Offset offset = txtOffset + lowerBytes;
+            MPI_File_write_at_all(classOutFile, offset, outBuf.data(), len, MPI_CHAR, &status);
+            txtOffset += allBytes;
         }
     }
-    else {
-        cerr << "ERROR: test file open error.\n";
-        exit(0);
+    
+    /// drop anything left from an older, longer result file
+    MPI_File_set_size(classOutFile, bBinOut ? (MPI_Offset)NVECS * 2 * sizeof(int) : txtOffset);
+    MPI_File_close(&classOutFile);
+    if (bBMUOUT) {
+        MPI_File_set_size(bmuOutFile, (MPI_Offset)NVECS * sizeof(BMU_RECORD_T));
+        MPI_File_close(&bmuOutFile);
     }
-    fclose(testingFile);
-    fclose(classOutFile);     
+    
+    ///
+    /// Global QE (mean distance to the BMU) and TE (fraction of rows whose
+    /// BMU and runner-up are not adjacent)
+    ///
+    double qeAll = 0.0;
+    uint64_t teAll = 0;
+    MPI_Reduce(&qeSum, &qeAll, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&teCount, &teAll, 1, MPI_UNSIGNED_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (myId == 0 && NVECS) 
+        printf("INFO: Quantization error = %g, Topographic error = %g\n", 
+               qeAll / NVECS, (double)teAll / NVECS);
 }
  
 
+/** classify_thread - BMU search for the rows of one thread
+ * @param ptr - CLASSIFYJOB_T
+ */
+
+void* classify_thread(void* ptr)
+{
+    CLASSIFYJOB_T* job = static_cast<CLASSIFYJOB_T*>(ptr);
+    uint32_t itemBase = 0;
+    if (bSPARSE) 
+        itemBase = (INDEXSPARSE + job->slabStart)->num_values_accum - (INDEXSPARSE + job->slabStart)->num_values;
+    
+    for (uint32_t n = job->start; n < job->end; n += SZBATCH) {
+        uint32_t nvecs = min((uint32_t)SZBATCH, job->end - n);
+        if (bSPARSE)
+            get_bmu_batch_sparse(job->items, job->slabStart + n, nvecs, itemBase, job->results + n);
+        else
+            get_bmu_batch(job->rows + (size_t)n * NDIMEN, nvecs, job->results + n);
+    }
+    return NULL;
+}
+
+
+/** get_bmu_batch - BMU and runner-up of a batch of dense vectors. Each
+ * weight vector is loaded once for the whole batch.
+ * @param vecs - nvecs feature vectors
+ * @param nvecs - num of vectors, <= SZBATCH
+ * @param results - BMU, runner-up and their squared distances
+ */
+
+void get_bmu_batch(const FLOAT_T* vecs,
+                   uint32_t nvecs,
+                   BMU_RESULT_T* results)
+{
+    for (uint32_t n = 0; n < nvecs; n++) {
+        results[n].bmu = results[n].bmu2 = 0;
+        results[n].dist = results[n].dist2 = std::numeric_limits<FLOAT_T>::max();
+    }
+    
+    const FLOAT_T* w = CODEBOOK.data();
+    for (size_t k = 0; k < SOM_Y * SOM_X; k++, w += NDIMEN) {
+        for (uint32_t n = 0; n < nvecs; n++) {
+            const FLOAT_T* vec = vecs + (size_t)n * NDIMEN;
+            FLOAT_T dist = 0.0f;
+            for (size_t d = 0; d < NDIMEN; d++) 
+                dist += (vec[d] - w[d]) * (vec[d] - w[d]);
+            BMU_RESULT_T* r = results + n;
+            if (dist < r->dist) {
+                r->dist2 = r->dist;
+                r->bmu2 = r->bmu;
+                r->dist = dist;
+                r->bmu = k;
+            }
+            else if (dist < r->dist2) {
+                r->dist2 = dist;
+                r->bmu2 = k;
+            }
+        }
+    }
+}
+
+
+/** get_bmu_batch_sparse - BMU and runner-up of a batch of sparse rows, using
+ * |w - v|^2 = |w|^2 - sum(w_i^2) + sum((w_i - v_i)^2) over the non-zero
+ * items i, so that only the items are visited. The sums are in double to
+ * keep the precision of small distances.
+ * @param items - items starting from item number itemBase
+ * @param rowStart - first row of the batch
+ * @param nvecs - num of rows, <= SZBATCH
+ * @param itemBase - item number of items[0]
+ * @param results - BMU, runner-up and their squared distances
+ */
+
+void get_bmu_batch_sparse(const SPARSE_STRUCT_T* items,
+                          uint32_t rowStart,
+                          uint32_t nvecs,
+                          uint32_t itemBase,
+                          BMU_RESULT_T* results)
+{
+    double mindist[SZBATCH];
+    double mindist2[SZBATCH];
+    const SPARSE_STRUCT_T* rowItems[SZBATCH];
+    uint32_t numValues[SZBATCH];
+    
+    for (uint32_t n = 0; n < nvecs; n++) {
+        const INDEX_STRUCT_T* idx = INDEXSPARSE + rowStart + n;
+        numValues[n] = idx->num_values;
+        rowItems[n] = items + (idx->num_values_accum - idx->num_values - itemBase);
+        mindist[n] = mindist2[n] = std::numeric_limits<double>::max();
+        results[n].bmu = results[n].bmu2 = 0;
+    }
+    
+    const FLOAT_T* w = CODEBOOK.data();
+    for (size_t k = 0; k < SOM_Y * SOM_X; k++, w += NDIMEN) {
+        for (uint32_t n = 0; n < nvecs; n++) {
+            double dist = g_vecNodeNorm[k];
+            for (uint32_t i = 0; i < numValues[n]; i++) {
+                double wi = w[rowItems[n][i].index];
+                double diff = wi - rowItems[n][i].value;
+                dist += diff * diff - wi * wi;
+            }
+            if (dist < mindist[n]) {
+                mindist2[n] = mindist[n];
+                results[n].bmu2 = results[n].bmu;
+                mindist[n] = dist;
+                results[n].bmu = k;
+            }
+            else if (dist < mindist2[n]) {
+                mindist2[n] = dist;
+                results[n].bmu2 = k;
+            }
+        }
+    }
+    for (uint32_t n = 0; n < nvecs; n++) {
+        results[n].dist = mindist[n] > 0.0 ? mindist[n] : 0.0;
+        results[n].dist2 = mindist2[n] > 0.0 ? mindist2[n] : 0.0;
+    }
+}
+ 
+
+/// Queries waiting for a server thread, and answered queries whose
+/// connections go back to the poll loop
+deque<SERVE_JOB_T*> g_deqJobs;
+deque<SERVE_JOB_T*> g_deqDone;
+pthread_mutex_t g_serverLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_serverCond = PTHREAD_COND_INITIALIZER;
+int g_wakeFds[2];                   /// pipe that wakes the poll loop
+volatile sig_atomic_t g_bStopServer = 0;
+
+void stop_server(int sig)
+{
+    g_bStopServer = 1;
+}
+
+/** write_full - write exactly n bytes to a non-blocking socket, waiting
+ * up to SERVE_TIMEOUT ms each time the socket is full
+ * @param fd
+ * @param buf
+ * @param n
+ */
+
+int write_full(int fd, 
+               const void* buf, 
+               size_t n)
+{
+    const char* p = static_cast<const char*>(buf);
+    while (n > 0) {
+        ssize_t r = write(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            int rc = poll(&pfd, 1, SERVE_TIMEOUT);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc <= 0)
+                return 1;
+            continue;
+        }
+        if (r <= 0)
+            return 1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/** serve - classification server. Load the codebook once and answer BMU
+ * queries on a Unix-domain socket. This thread polls the listening socket
+ * and all connections, reads queries without blocking and queues them for
+ * NTHREADS server threads.
+ * @param codebook
+ * @param socketPath
+ */
+
+int serve(const char* codebook,
+          const char* socketPath)
+{
+    if (load_codebook(codebook) > 0) {
+        cerr << "ERROR: codebook load error.\n";
+        return 1;
+    }
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        cerr << "ERROR: socket path is too long.\n";
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+    
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) 
+        || listen(listenFd, SOMAXCONN) || fcntl(listenFd, F_SETFL, O_NONBLOCK)) {
+        cerr << "ERROR: failed to listen on " << socketPath << "\n";
+        return 1;
+    }
+    if (pipe(g_wakeFds) || fcntl(g_wakeFds[0], F_SETFL, O_NONBLOCK) 
+        || fcntl(g_wakeFds[1], F_SETFL, O_NONBLOCK)) {
+        cerr << "ERROR: failed to create pipe\n";
+        return 1;
+    }
+    
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    signal(SIGPIPE, SIG_IGN);
+    
+    int nThreads = NTHREADS < 1 ? 1 : NTHREADS;
+    for (int t = 0; t < nThreads; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_thread, NULL)) {
+            cerr << "ERROR: failed to create thread\n";
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    cerr << "INFO: serving " << SOM_X << "x" << SOM_Y << "x" << NDIMEN 
+         << " codebook on " << socketPath << " with " << nThreads << " threads\n";
+    
+    ///
+    /// Poll loop. Connections with queries queued or being answered are
+    /// not polled, so the replies of a connection keep the query order.
+    ///
+    map<int, SERVE_CONN_T> conns;
+    vector<struct pollfd> pfds;
+    deque<SERVE_JOB_T*> done;
+    char wake[64];
+    while (!g_bStopServer) {
+        struct pollfd pfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pfds.clear();
+        pfd.fd = listenFd;
+        pfds.push_back(pfd);
+        pfd.fd = g_wakeFds[0];
+        pfds.push_back(pfd);
+        for (map<int, SERVE_CONN_T>::iterator it = conns.begin(); it != conns.end(); ++it) {
+            if (!it->second.bBusy) {
+                pfd.fd = it->first;
+                pfds.push_back(pfd);
+            }
+        }
+        if (poll(pfds.data(), pfds.size(), 1000) <= 0) 
+            continue;
+        
+        ///
+        /// Connections whose queries are answered: queue the next queries
+        /// already read, or close
+        ///
+        if (pfds[1].revents & POLLIN) {
+            while (read(g_wakeFds[0], wake, sizeof(wake)) > 0)
+                ;
+            pthread_mutex_lock(&g_serverLock);
+            done.swap(g_deqDone);
+            pthread_mutex_unlock(&g_serverLock);
+            for (size_t i = 0; i < done.size(); i++) {
+                int fd = done[i]->fd;
+                SERVE_CONN_T& conn = conns[fd];
+                conn.bBusy = 0;
+                if (done[i]->status || queue_queries(fd, conn)) {
+                    close(fd);
+                    conns.erase(fd);
+                }
+                delete done[i];
+            }
+            done.clear();
+        }
+        
+        ///
+        /// Read what is waiting on idle connections
+        ///
+        for (size_t i = 2; i < pfds.size(); i++) {
+            if (!pfds[i].revents) 
+                continue;
+            int fd = pfds[i].fd;
+            SERVE_CONN_T& conn = conns[fd];
+            size_t nold = conn.in.size();
+            conn.in.resize(nold + (1 << 20));
+            ssize_t r = read(fd, conn.in.data() + nold, 1 << 20);
+            conn.in.resize(nold + (r > 0 ? r : 0));
+            if (r == 0 || (r < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+                conn.bClose = 1;
+            if (queue_queries(fd, conn)) {
+                close(fd);
+                conns.erase(fd);
+            }
+        }
+        
+        ///
+        /// New connections
+        ///
+        if (pfds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+                if (fcntl(fd, F_SETFL, O_NONBLOCK)) {
+                    close(fd);
+                    continue;
+                }
+                SERVE_CONN_T& conn = conns[fd];
+                conn.bBusy = 0;
+                conn.bClose = 0;
+            }
+        }
+    }
+    
+    close(listenFd);
+    unlink(socketPath);
+    cerr << "INFO: server stopped\n";
+    return 0;
+}
+
+/** queue_queries - queue the complete queries read on an idle connection
+ * for the server threads, up to SERVE_MAXVECS vectors. A bad query is
+ * answered with BMU_BADQUERY once the queries before it are answered.
+ * @param fd
+ * @param conn
+ * @return 1 if the connection is to be closed
+ */
+
+int queue_queries(int fd, 
+                  SERVE_CONN_T& conn)
+{
+    SERVE_JOB_T* job = NULL;
+    size_t nvecs = 0;
+    size_t pos = 0;
+    BMUQUERY_HEADER_T q;
+    while (conn.in.size() - pos >= sizeof(q)) {
+        memcpy(&q, conn.in.data() + pos, sizeof(q));
+        if (q.magic != BMUQUERY_MAGIC || q.ndimen != NDIMEN || q.nvecs > SERVE_MAXVECS) {
+            if (job)
+                break;
+            BMUREPLY_HEADER_T r;
+            r.magic = BMUREPLY_MAGIC;
+            r.status = BMU_BADQUERY;
+            r.nvecs = 0;
+            r.flags = q.flags;
+            write_full(fd, &r, sizeof(r));
+            return 1;
+        }
+        size_t nbytes = (size_t)q.nvecs * NDIMEN * SZFLOAT;
+        if (conn.in.size() - pos - sizeof(q) < nbytes || (job && nvecs + q.nvecs > SERVE_MAXVECS))
+            break;
+        if (!job) {
+            job = new SERVE_JOB_T;
+            job->fd = fd;
+            job->status = 0;
+        }
+        job->queries.push_back(q);
+        job->vecs.resize((nvecs + q.nvecs) * NDIMEN);
+        memcpy(job->vecs.data() + nvecs * NDIMEN, conn.in.data() + pos + sizeof(q), nbytes);
+        nvecs += q.nvecs;
+        pos += sizeof(q) + nbytes;
+    }
+    conn.in.erase(conn.in.begin(), conn.in.begin() + pos);
+    
+    if (!job)
+        return conn.bClose;
+    conn.bBusy = 1;
+    pthread_mutex_lock(&g_serverLock);
+    g_deqJobs.push_back(job);
+    pthread_cond_signal(&g_serverCond);
+    pthread_mutex_unlock(&g_serverLock);
+    return 0;
+}
+
+/** serve_thread - answer all queued queries, of any connections, up to
+ * SERVE_MAXVECS vectors in one batched search, then write each reply to
+ * its connection and hand the connection back to the poll loop
+ * @param ptr
+ */
+
+void* serve_thread(void* ptr)
+{
+    vector<SERVE_JOB_T*> jobs;
+    vector<FLOAT_T> vecs;
+    vector<BMU_RESULT_T> results;
+    vector<char> reply;
+    
+    while (1) {
+        jobs.clear();
+        size_t nvecs = 0;
+        pthread_mutex_lock(&g_serverLock);
+        while (g_deqJobs.empty())
+            pthread_cond_wait(&g_serverCond, &g_serverLock);
+        do {
+            SERVE_JOB_T* job = g_deqJobs.front();
+            size_t n = job->vecs.size() / NDIMEN;
+            if (!jobs.empty() && nvecs + n > SERVE_MAXVECS)
+                break;
+            g_deqJobs.pop_front();
+            jobs.push_back(job);
+            nvecs += n;
+        } while (!g_deqJobs.empty());
+        pthread_mutex_unlock(&g_serverLock);
+        
+        ///
+        /// One batched BMU search for the queries of all connections
+        ///
+        const FLOAT_T* allvecs = jobs[0]->vecs.data();
+        if (jobs.size() > 1) {
+            vecs.resize(nvecs * NDIMEN);
+            size_t off = 0;
+            for (size_t k = 0; k < jobs.size(); k++) {
+                memcpy(vecs.data() + off, jobs[k]->vecs.data(), jobs[k]->vecs.size() * SZFLOAT);
+                off += jobs[k]->vecs.size();
+            }
+            allvecs = vecs.data();
+        }
+        results.resize(nvecs);
+        for (size_t n = 0; n < nvecs; n += SZBATCH) 
+            get_bmu_batch(allvecs + n * NDIMEN, min((size_t)SZBATCH, nvecs - n), results.data() + n);
+        
+        ///
+        /// Replies in query order, one write per connection
+        ///
+        size_t n = 0;
+        for (size_t k = 0; k < jobs.size(); k++) {
+            SERVE_JOB_T* job = jobs[k];
+            reply.clear();
+            for (size_t i = 0; i < job->queries.size(); i++) {
+                BMUREPLY_HEADER_T r;
+                r.magic = BMUREPLY_MAGIC;
+                r.status = BMU_OK;
+                r.nvecs = job->queries[i].nvecs;
+                r.flags = job->queries[i].flags & BMUQUERY_SECOND;
+                reply.insert(reply.end(), (char*)&r, (char*)&r + sizeof(r));
+                for (uint32_t j = 0; j < job->queries[i].nvecs; j++, n++) {
+                    uint32_t rec[6];
+                    rec[0] = results[n].bmu % SOM_X;
+                    rec[1] = results[n].bmu / SOM_X;
+                    memcpy(&rec[2], &results[n].dist, sizeof(float));
+                    rec[3] = results[n].bmu2 % SOM_X;
+                    rec[4] = results[n].bmu2 / SOM_X;
+                    memcpy(&rec[5], &results[n].dist2, sizeof(float));
+                    size_t nrec = (r.flags & BMUQUERY_SECOND) ? 6 : 3;
+                    reply.insert(reply.end(), (char*)rec, (char*)(rec + nrec));
+                }
+            }
+            job->status = write_full(job->fd, reply.data(), reply.size());
+            
+            pthread_mutex_lock(&g_serverLock);
+            g_deqDone.push_back(job);
+            pthread_mutex_unlock(&g_serverLock);
+            char c = 0;
+            if (write(g_wakeFds[1], &c, 1) < 0) {
+                /// pipe is full, the poll loop is already woken
+            }
+        }
+    }
+    return NULL;
+} 
+
 /// EOF
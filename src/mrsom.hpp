@@ -30,6 +30,19 @@ namespace po = boost::program_options;
 boost::iostreams::mapped_file_source MMAPBINFILE;  /// Read-only Boost mmap file for input bin file
 boost::iostreams::mapped_file_source MMAPIDXFILE;  /// Read-only Boost mmap file fr input index file (sparse)
 
+/// Block-compressed input file (*.zbin)
+#include "blockbin.hpp"
+
+/// Classification server
+#include <deque>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #define FLOAT_T float
 //#define FLOAT_T double
 #define SZFLOAT sizeof(FLOAT_T)
@@ -60,7 +73,7 @@ using namespace MAPREDUCE_NS;
 using namespace std;
 
 enum DISTTYPE   { EUCL, SOSD, TXCB, ANGL, MHLN };   /// distance metrics
-enum RUNMODE    { TRAIN, TEST };                    /// running mode
+enum RUNMODE    { TRAIN, TEST, SERVE };             /// running mode
 
 /// GLOBALS
 int SZPAGE = 64;                /// Page size (MB), default = 64MB
@@ -104,12 +117,133 @@ vector<SPARSEWORKITEM_STRUCT_T> g_vecSparseWorkItem;
 SPARSE_STRUCT_T* FDATASPARSE = NULL; 
 INDEX_STRUCT_T*  INDEXSPARSE = NULL; 
 
+/// Block-compressed input
+int bZBIN = 0;                      /// input is a zbin file or not
+const ZBIN_HEADER_T* ZBINHEADER = NULL;
+const ZBIN_BLOCK_T*  ZBININDEX = NULL;
+vector<char> g_vecBlockBuffer;      /// reusable buffer for decompressed blocks
+
+/// Streaming (out-of-core) input
+#include "chunkreader.hpp"
+int bSTREAM = 0;                    /// read input in chunks instead of mmap
+unsigned int READAHEAD = 2;         /// num of read buffers (read-ahead depth)
+int SZCHUNK = 64;                   /// read chunk size (MB)
+string FPATH;                       /// MR-MPI dirs for out-of-core files
+int MAPSTYLE = 0;                   /// MR-MPI mapstyle of the training map()
+CHUNKREADER_T g_chunkReader;
+
+/// Classification
+#define SZBATCH 64                  /// num of rows in a BMU search batch
+#define NSLABROWS (1 << 20)         /// num of rows classified and written at once
+int NTHREADS = 1;                   /// num of threads per rank
+string OUTFORMAT;                   /// classification output: txt or bin
+int bBMUOUT = 0;                    /// write *-bmu.bin records
+vector<double> g_vecNodeNorm;       /// squared norm of each weight vector
+
+typedef struct classifyjob {
+    const FLOAT_T* rows;            /// dense rows of the slab
+    const SPARSE_STRUCT_T* items;   /// sparse items of the slab
+    uint32_t slabStart;             /// first row of the slab
+    uint32_t start;                 /// first row of the thread, in the slab
+    uint32_t end;                   /// last row + 1 of the thread, in the slab
+    struct bmuresult* results;      /// BMU search results of the slab rows
+} CLASSIFYJOB_T;
+
+typedef struct bmuresult {
+    uint32_t bmu;                   /// BMU node index = y * SOM_X + x
+    uint32_t bmu2;                  /// runner-up node index
+    FLOAT_T dist;                   /// squared distance to the BMU
+    FLOAT_T dist2;                  /// squared distance to the runner-up
+} BMU_RESULT_T;
+
+/// Record of *-bmu.bin, one per input row in row order
+typedef struct bmurecord {
+    uint32_t bmu;                   /// BMU node index = y * SOM_X + x
+    float dist;                     /// squared distance to the BMU
+    uint32_t bmu2;                  /// runner-up node index
+} BMU_RECORD_T;
+
+/// Binary codebook (*-codebook.bin): header followed by the weights in
+/// CODEBOOK order
+#define CODEBOOK_MAGIC 0x4243524d   /// "MRCB"
+typedef struct codebookheader {
+    uint32_t magic;                 /// CODEBOOK_MAGIC
+    uint32_t somx;                  /// SOM_X
+    uint32_t somy;                  /// SOM_Y
+    uint32_t ndimen;                /// NDIMEN
+    uint32_t szfloat;               /// SZFLOAT
+} CODEBOOK_HEADER_T;
+
+///
+/// Classification server (serve mode)
+///
+/// A client connects to the Unix-domain socket and sends any number of
+/// queries on the connection, each answered in order:
+///
+///   query:  BMUQUERY_HEADER_T, then nvecs * ndimen floats
+///   reply:  BMUREPLY_HEADER_T, then nvecs records of
+///           uint32 x, uint32 y, float squared distance
+///           and, if BMUQUERY_SECOND is set, uint32 x2, uint32 y2, 
+///           float squared distance of the runner-up
+///
+/// One poll loop owns all connections and queues each complete query to
+/// the server threads; a thread searches the queries of all connections
+/// waiting at that time in one pass and writes each reply to its client.
+///
+#define BMUQUERY_MAGIC  0x51554d42  /// "BMUQ"
+#define BMUREPLY_MAGIC  0x52554d42  /// "BMUR"
+#define BMUQUERY_SECOND 0x1         /// flag: return the runner-up node
+#define SERVE_MAXVECS   (1 << 20)   /// max num of vectors searched in one pass
+#define SERVE_TIMEOUT   10000       /// ms to wait for a client to take a reply
+enum BMUSTATUS  { BMU_OK, BMU_BADQUERY };
+
+typedef struct bmuqueryheader {
+    uint32_t magic;                 /// BMUQUERY_MAGIC
+    uint32_t flags;                 /// BMUQUERY_SECOND
+    uint32_t nvecs;                 /// num of vectors
+    uint32_t ndimen;                /// dimension of vectors, = NDIMEN
+} BMUQUERY_HEADER_T;
+
+typedef struct bmureplyheader {
+    uint32_t magic;                 /// BMUREPLY_MAGIC
+    uint32_t status;                /// BMUSTATUS
+    uint32_t nvecs;                 /// num of records
+    uint32_t flags;                 /// flags of the query
+} BMUREPLY_HEADER_T;
+
+typedef struct serveconn {
+    vector<char> in;                /// bytes read, not yet queued
+    int bBusy;                      /// queries queued or being answered
+    int bClose;                     /// close once not busy
+} SERVE_CONN_T;
+
+typedef struct servejob {
+    int fd;                         /// connection of the queries
+    vector<BMUQUERY_HEADER_T> queries;
+    vector<FLOAT_T> vecs;           /// vectors of all queries
+    int status;                     /// set by the thread, 1 = write failed
+} SERVE_JOB_T;
+
+string SOCKETPATH;                  /// socket of the server
+
+/// U-matrix
+string UMATFORMAT;                  /// u-matrix output: txt or bin
+
+typedef struct umatjob {
+    size_t start;                   /// first row of the thread
+    size_t end;                     /// last row + 1 of the thread
+    FLOAT_T* umat;                  /// u-matrix values of the rows, from row start
+} UMATJOB_T;
+
 /// MR-MPI fuctions and related functions
 void     mr_map_train_batch(int itask, KeyValue* kv, void* ptr);
 void     mr_map_train_batch_sparse(int itask, KeyValue* kv, void* ptr); /// sparse
 void     mr_map_mpi_reduce(int itask, KeyValue* kv, void* ptr);
-void     get_bmu_coord(int* p, int itask, uint32_t n);
-FLOAT_T  get_distance(size_t y, size_t x, int itask, size_t row, unsigned int distance_metric);
+void     train_rows(const FLOAT_T* rows, uint32_t nrows);
+void     train_rows_sparse(const SPARSE_STRUCT_T* items, uint32_t rowStart, uint32_t rowEnd);
+void     get_bmu_coord(int* p, const FLOAT_T* vec);
+void     get_bmu_coord_sparse(int* p, const SPARSE_STRUCT_T* items, uint32_t nitems);
+FLOAT_T  get_distance_sparse(size_t y, size_t x, const SPARSE_STRUCT_T* items, uint32_t nitems);
 FLOAT_T  get_distance(size_t y, size_t x, const FLOAT_T* vec, unsigned int distance_metric);
 FLOAT_T  get_distance(const FLOAT_T* vec1, const FLOAT_T* vec2, unsigned int distance_metric);
 FLOAT_T* get_wvec(size_t y, size_t x);
@@ -118,12 +252,27 @@ FLOAT_T* get_wvec(size_t y, size_t x);
 void     init_codebook(unsigned int seed);
 int      load_codebook(const char *mapFilename);
 int      save_codebook(const char* cbFileName);
+int      save_codebook_bin(const char* cbFileName);
+int      load_codebook_bin(FILE* fp);
 int      save_umat(const char* fname);
+void*    umat_thread(void* ptr);
 void     read_matrix(const char *binfilename, const char *indexilename);
+const FLOAT_T*         load_work_item(uint32_t rowStart, uint32_t nrows);
+const SPARSE_STRUCT_T* load_work_item_sparse(uint32_t rowStart, uint32_t rowEnd);
+const char*            load_blocks(uint32_t rowStart, uint32_t rowEnd);
+void     open_stream(const char *binfilename);
+void     make_stream_plan(int taskStart, int taskEnd);
 
 /// Classification
-void     test(const char* codebook, const char* binFileName);
+void     test(const char* codebook);
 void     classify(const FLOAT_T* vec, int* p);
+void*    classify_thread(void* ptr);
+int      serve(const char* codebook, const char* socketPath);
+void*    serve_thread(void* ptr);
+int      queue_queries(int fd, SERVE_CONN_T& conn);
+void     get_bmu_batch(const FLOAT_T* vecs, uint32_t nvecs, BMU_RESULT_T* results);
+void     get_bmu_batch_sparse(const SPARSE_STRUCT_T* items, uint32_t rowStart, uint32_t nvecs, 
+                              uint32_t itemBase, BMU_RESULT_T* results);
 
 
 #endif
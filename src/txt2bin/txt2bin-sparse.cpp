@@ -23,6 +23,9 @@ boost::iostreams::mapped_file_source MMAPFILE;     /// Read-only Boost mmap file
 
 using namespace std;
 
+/// Block-compressed output
+#include "../blockbin.hpp"
+
 /// Sparse structures and routines
 typedef struct sparsetype {
     uint32_t index;
@@ -38,8 +41,10 @@ typedef struct indextype {
 
 int main(int argc, char* argv[])
 {
-    if (argc != 5) {
-        cout << "Usage: txt2bin-sparse input output numcols numrows\n";
+    if (argc != 5 && argc != 6) {
+        cout << "Usage: txt2bin-sparse input output numcols numrows [rowsperblock]\n";
+        cout << "  rowsperblock: write a block-compressed file (-sparse.zbin) with\n"
+             << "                rowsperblock rows in each block\n";
         exit(0);
     }
     
@@ -47,11 +52,27 @@ int main(int argc, char* argv[])
     string outFileName(argv[2]); 
     uint32_t nDimen = atoi(argv[3]);
     uint32_t nVecs = atoi(argv[4]);
+    uint32_t rowsPerBlock = (argc == 6) ? atoi(argv[5]) : 0;
+    string binFileName = outFileName + (rowsPerBlock ? "-sparse.zbin" : "-sparse.bin");
     
     FILE *fp;
     fp = fopen(argv[1], "r");
     
-    ofstream outputBinFile((outFileName+"-sparse.bin").c_str(), ios::binary);
+    ///
+    /// For the block-compressed output, the items are written to the zbin
+    /// file row by row and irec.position is the offset in the uncompressed 
+    /// item stream.
+    ///
+    ZBIN_WRITER_T zbin;
+    if (rowsPerBlock && zbin_open(&zbin, binFileName.c_str(), 1, nDimen, nVecs, rowsPerBlock)) {
+        cerr << "Error: Cannot open file.";
+        return 1;
+    }
+    vector<SPARSE_STRUCT_T> rowItems;
+    
+    ofstream outputBinFile;
+    if (!rowsPerBlock)
+        outputBinFile.open(binFileName.c_str(), ios::binary);
     ofstream outputIndexFile((outFileName+"-sparse.idx").c_str(), ios::binary);
     ofstream numValuesFile((outFileName+"-sparse.num").c_str());
     
@@ -59,7 +80,11 @@ int main(int argc, char* argv[])
     for (uint32_t row = 0; row < nVecs; row++) {
         uint32_t nColsWritten = 0;
         INDEX_STRUCT_T irec;
-        irec.position = outputBinFile.tellp();
+        if (rowsPerBlock)
+            irec.position = (totalNData * sizeof(SPARSE_STRUCT_T));
+        else
+            irec.position = outputBinFile.tellp();
+        rowItems.clear();
         
         for (uint32_t col = 0; col < nDimen; col++) {
             float tmp = 0.0f;
@@ -69,11 +94,19 @@ int main(int argc, char* argv[])
                 SPARSE_STRUCT_T item;
                 item.index = col;
                 item.value = tmp;
-                outputBinFile.write((char*)&item, sizeof(item));
+                if (rowsPerBlock)
+                    rowItems.push_back(item);
+                else
+                    outputBinFile.write((char*)&item, sizeof(item));
                 nColsWritten++;
                 totalNData++;
             }
         }
+        if (rowsPerBlock && zbin_add_row(&zbin, rowItems.data(), 
+                                         rowItems.size() * sizeof(SPARSE_STRUCT_T))) {
+            cerr << "Error: Cannot compress block.";
+            return 1;
+        }
         irec.num_values = nColsWritten;
         irec.num_values_accum = totalNData;
         outputIndexFile.write((char *)&irec, sizeof(irec));
@@ -81,13 +114,20 @@ int main(int argc, char* argv[])
     cout << "Total number of items = " << totalNData << endl;
     
     numValuesFile << totalNData << endl;
-    outputBinFile.close();
+    if (rowsPerBlock) {
+        if (zbin_close(&zbin)) {
+            cerr << "Error: Cannot write file.";
+            return 1;
+        }
+    }
+    else
+        outputBinFile.close();
     outputIndexFile.close();
     numValuesFile.close();
     fclose(fp); 
     
     cout << "INFO: Files generated\n";
-    cout << "\tbin file: \t" << outFileName+"-sparse.bin" << endl;
+    cout << "\tbin file: \t" << binFileName << endl;
     cout << "\tindex file: \t" << outFileName+"-sparse.idx" << endl;
     cout << "\tnum file: \t" << outFileName+"-sparse.num" << endl;
  
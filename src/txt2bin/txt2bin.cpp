@@ -10,11 +10,16 @@
 #include <fstream>
 using namespace std;
 
+/// Block-compressed output
+#include "../blockbin.hpp"
+
 
 int main(int argc, char* argv[])
 {
-    if (argc != 5) {
-        cout << "Usage: txt2bin input output numcols numrows\n";
+    if (argc != 5 && argc != 6) {
+        cout << "Usage: txt2bin input output numcols numrows [rowsperblock]\n";
+        cout << "  rowsperblock: write a block-compressed file (zbin) with\n"
+             << "                rowsperblock rows in each block\n";
         exit(0);
     }
     int len = atoi(argv[4]);
@@ -23,6 +28,35 @@ int main(int argc, char* argv[])
     FILE *fp;
     fp = fopen(argv[1], "r");
     
+    ///
+    /// Block-compressed output
+    ///
+    if (argc == 6) {
+        ZBIN_WRITER_T w;
+        if (zbin_open(&w, argv[2], 0, D, len, atoi(argv[5]))) {
+            cerr << "Error: Cannot open file.";
+            return 1;
+        }
+        vector<float> row(D);
+        for (int r = 0; r < len; r++) {
+            for (int col = 0; col < D; col++) {
+                float tmp = 0.0f;
+                fscanf(fp, "%f", &tmp);
+                row[col] = tmp;
+            }
+            if (zbin_add_row(&w, &row[0], D * sizeof(float))) {
+                cerr << "Error: Cannot compress block.";
+                return 1;
+            }
+        }
+        fclose(fp);
+        if (zbin_close(&w)) {
+            cerr << "Error: Cannot write file.";
+            return 1;
+        }
+        return 0;
+    }
+    
     ofstream out(argv[2], ios::out | ios::binary);
     if (!out) {
         cerr << "Error: Cannot open file.";